@@ -7,8 +7,10 @@
 #define __LIBEOT_EOT_H__
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "EOTAllocator.h"
 #include "EOTError.h"
 
 struct EUDCInfo {
@@ -68,6 +70,7 @@ struct EOTMetadata {
   uint16_t *versionName;
   uint16_t fullNameSize;
   uint16_t *fullName;
+  /* the NUL-separated root strings, split up, without empty ones */
   unsigned numRootStrings;
   struct EOTRootStringInfo *rootStrings;
   uint32_t fontDataSize;
@@ -77,12 +80,111 @@ struct EOTMetadata {
    * deleted properly if there is an error in the metadata parser. */
   uint16_t do_not_use_size;
   uint16_t *do_not_use;
+  /* where the strings above came from, and go back to in EOTfreeMetadata */
+  const struct EOTAllocator *allocator;
 };
 
+/* A string in the buffer a view was filled from: size bytes of UTF-16LE text
+ * starting offset bytes in. */
+struct EOTStringRef {
+  unsigned offset;
+  uint16_t size;
+};
+
+/* The same header as EOTMetadata, but pointing into the buffer it was filled
+ * from instead of copying anything out of it. Nothing needs freeing, and the
+ * view is only valid as long as that buffer is. */
+struct EOTMetadataView {
+  const uint8_t *bytes;
+  uint32_t totalSize;
+  enum EOTVersion version;
+  uint32_t flags;
+  uint8_t panose[10];
+  enum EOTCharset charset;
+  bool italic;
+  uint32_t weight;
+  uint16_t permissions;
+  uint32_t unicodeRange[4];
+  uint32_t codePageRange[2];
+  uint32_t checkSumAdjustment;
+  struct EOTStringRef familyName;
+  struct EOTStringRef styleName;
+  struct EOTStringRef versionName;
+  struct EOTStringRef fullName;
+  /* version 2 and up */
+  struct EOTStringRef rootString;
+  uint32_t fontDataSize;
+  unsigned fontDataOffset;
+  /* version 3 only; eudcFontDataSize is 0 if there is no EUDC font */
+  uint32_t eudcCodePage;
+  uint32_t eudcFlags;
+  unsigned eudcFontDataOffset;
+  uint32_t eudcFontDataSize;
+};
+
+/* The fixed-size fields at the start of an EOT header, which is all
+ * EOTprobeHeader reads. */
+struct EOTHeaderProbe {
+  /* as coded in the file; EOTfillMetadata may settle on another one */
+  enum EOTVersion version;
+  uint32_t flags;
+  bool compressed;
+  bool encrypted;
+  enum EOTCharset charset;
+  uint32_t weight;
+  uint16_t permissions;
+  uint32_t unicodeRange[4];
+  uint32_t fontDataSize;
+  /* where the header sizes put the font data. When bytesLength is totalSize,
+   * EOTfillMetadata finds it there too. */
+  unsigned fontDataOffset;
+};
+
+/* Enough room for any string converted by EOTviewStringUTF8, terminator
+ * included. */
+#define EOT_UTF8_MAX_SIZE(ref) ((unsigned)(ref).size / 2 * 3 + 1)
+
 unsigned EOTgetMetadataLength(const uint8_t *bytes);
+/* Reads only the fixed-size part of the header, checking it against
+ * bytesLength the way EOTfillMetadata does, but skipping the strings. Never
+ * allocates. */
+enum EOTError EOTprobeHeader(const uint8_t *bytes, unsigned bytesLength,
+                             struct EOTHeaderProbe *out);
+/* Parses the header exactly like EOTfillMetadata, returning the same errors,
+ * but without allocating. */
+enum EOTError EOTfillMetadataView(const uint8_t *bytes, unsigned bytesLength,
+                                  struct EOTMetadataView *out);
+/* Converts a string of the view to UTF-8 in out, which has room for outSize
+ * bytes, and NUL-terminates it. *lengthOut is set to the length without the
+ * terminator. If it doesn't fit, nothing is written and EOT_BUFFER_TOO_SMALL
+ * is returned. Unpaired surrogates become U+FFFD. */
+enum EOTError EOTviewStringUTF8(const struct EOTMetadataView *view,
+                                struct EOTStringRef str, char *out,
+                                unsigned outSize, unsigned *lengthOut);
 enum EOTError EOTfillMetadata(const uint8_t *bytes, unsigned bytesLength,
                               struct EOTMetadata *out);
+/* Like EOTfillMetadata, but the strings are allocated from allocator. */
+enum EOTError EOTfillMetadataWithAllocator(const uint8_t *bytes,
+                                           unsigned bytesLength,
+                                           const struct EOTAllocator *allocator,
+                                           struct EOTMetadata *out);
 void EOTfreeMetadata(struct EOTMetadata *toFree);
+
+/* The root strings of an EOT, compiled for checking many URLs against. */
+struct EOTRootStringMatcher;
+
+/* Compiles the root strings of metadata into a matcher, allocated from
+ * metadata->allocator. It doesn't refer to metadata once compiled. */
+enum EOTError EOTcompileRootStrings(const struct EOTMetadata *metadata,
+                                    struct EOTRootStringMatcher **out);
+/* Whether one of the root strings is a prefix of url, length bytes of UTF-8,
+ * ignoring ASCII case. The prefix has to end at the end of url or next to a
+ * '/', ':', '?' or '#', so http://a.com matches http://a.com/b and
+ * http://a.com:8080 but not http://a.com.example. The cost depends on the
+ * number of distinct root string lengths, not on the number of root strings. */
+bool EOTmatchRootString(const struct EOTRootStringMatcher *matcher,
+                        const char *url, size_t length);
+void EOTfreeRootStringMatcher(struct EOTRootStringMatcher *matcher);
 bool EOTcanLegallyEdit(const struct EOTMetadata *metadata);
 
 #endif /* #define __LIBEOT_EOT_H__ */
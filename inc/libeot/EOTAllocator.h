@@ -0,0 +1,38 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+#ifndef __LIBEOT_EOTALLOCATOR_H__
+#define __LIBEOT_EOTALLOCATOR_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Where the library gets its memory from. Each hook is handed userData first.
+ * realloc is only ever given blocks that malloc or realloc returned, and free
+ * is never given NULL. Wherever an allocator may be given, NULL stands for the
+ * C library's malloc, realloc and free. */
+struct EOTAllocator {
+  void *(*malloc)(void *userData, size_t size);
+  void *(*realloc)(void *userData, void *ptr, size_t size);
+  void (*free)(void *userData, void *ptr);
+  void *userData;
+};
+
+/* An arena hands out memory from large chunks and ignores frees, apart from
+ * giving back or growing the block it handed out last. Everything allocated
+ * from it, including a converted font, is released at once by EOTresetArena,
+ * which keeps the chunks for the next round. Pass EOTarenaAllocator(arena) as
+ * the allocator of a conversion, then reset the arena once done with the
+ * result. An arena must only be used by one thread at a time. */
+struct EOTArena;
+/* chunkSize is the size of the chunks memory is carved from, 0 for the
+ * default; bigger requests get a chunk to themselves. With hugePages, chunks
+ * are rounded to and backed by huge pages where the system allows it. */
+struct EOTArena *EOTcreateArena(size_t chunkSize, bool hugePages);
+const struct EOTAllocator *EOTarenaAllocator(struct EOTArena *arena);
+void EOTresetArena(struct EOTArena *arena);
+void EOTfreeArena(struct EOTArena *arena);
+
+#endif /* #define __LIBEOT_EOTALLOCATOR_H__ */
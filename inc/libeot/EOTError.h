@@ -28,8 +28,17 @@ enum EOTError {
   EOT_UNKNOWN_BUFFER_WRITE_ERROR,
   EOT_MTX_ERROR,
   EOT_MALFORMED_HEAD_TABLE,
+  EOT_NO_CMAP_TABLE,
+  EOT_NO_HHEA_TABLE,
+  EOT_BUFFER_TOO_SMALL,
   EOT_WARN_NOT_ENOUGH_SPACE_RESERVED = EOT_WARN,
   EOT_WARN_BAD_VERSION,
-  EOT_WARN_NOT_ENOUGH_GLYPHS
+  EOT_WARN_NOT_ENOUGH_GLYPHS,
+  /* the font was converted, but without its hdmx table, which could not be
+   * decoded */
+  EOT_WARN_DROPPED_HDMX,
+  /* the font was converted, but without its VDMX table, which was
+   * malformed */
+  EOT_WARN_DROPPED_VDMX
 };
 #endif /* #define __LIBEOT_EOTERROR_H__ */
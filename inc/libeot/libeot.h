@@ -6,17 +6,195 @@
 #ifndef __LIBEOT_LIBEOT_H__
 #define __LIBEOT_LIBEOT_H__
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
 #include "EOT.h"
 #include "EOTError.h"
 
+struct EOTConversionOptions {
+  /* If non-NULL, only the outlines of glyphs needed to render these Unicode
+   * codepoints (plus .notdef and any composite components) are reconstructed.
+   * All other glyphs are left empty, so glyph IDs and hmtx are unchanged.
+   * Fonts that are not MTX-compressed are returned whole. */
+  const uint32_t *subsetCodepoints;
+  unsigned numSubsetCodepoints;
+  /* If set, a VDMX table is synthesised from the decoded glyph bounding boxes
+   * when the font has none, or when the one it has is malformed. */
+  bool generateVDMX;
+  /* If set, glyphs are emitted without instructions and the fpgm, prep, cvt,
+   * hdmx and LTSH tables, which only matter to the TrueType hinter, are
+   * dropped. The push and code streams are not even unpacked. Like subsetting,
+   * this only applies to MTX-compressed fonts. */
+  bool stripHinting;
+  /* If non-NULL, every allocation the conversion makes goes through it,
+   * including the metadata strings and the font returned by the _buffer
+   * variants. That font must then be given back to allocator->free rather
+   * than to EOTfreeBuffer. allocator must outlive anything allocated from
+   * it. */
+  const struct EOTAllocator *allocator;
+};
+
+/* Receives the converted font in order, a piece at a time. Returning false
+ * aborts the conversion with EOT_FWRITE_ERROR. */
+typedef bool (*EOTWriteCallback)(void *userData, const uint8_t *data,
+                                 unsigned size);
+
+/* The _file, _fd and _callback variants write the font out as it is
+ * assembled, without holding a complete copy of it in memory. */
 enum EOTError EOT2ttf_file(const uint8_t *font, unsigned fontSize,
                            struct EOTMetadata *metadataOut, FILE *out);
+enum EOTError EOT2ttf_fd(const uint8_t *font, unsigned fontSize,
+                         const struct EOTConversionOptions *opts,
+                         struct EOTMetadata *metadataOut, int fd);
+enum EOTError EOT2ttf_callback(const uint8_t *font, unsigned fontSize,
+                               const struct EOTConversionOptions *opts,
+                               struct EOTMetadata *metadataOut,
+                               EOTWriteCallback write, void *userData);
 enum EOTError EOT2ttf_buffer(const uint8_t *font, unsigned fontSize,
                              struct EOTMetadata *metadataOut, uint8_t **fontOut,
                              unsigned *fontSizeOut);
+enum EOTError EOT2ttf_buffer_opts(const uint8_t *font, unsigned fontSize,
+                                  const struct EOTConversionOptions *opts,
+                                  struct EOTMetadata *metadataOut,
+                                  uint8_t **fontOut, unsigned *fontSizeOut);
+enum EOTError EOT2ttf_buffer_subset(const uint8_t *font, unsigned fontSize,
+                                    const uint32_t *codepoints,
+                                    unsigned numCodepoints,
+                                    struct EOTMetadata *metadataOut,
+                                    uint8_t **fontOut, unsigned *fontSizeOut);
+/* Like EOT2ttf_buffer_opts, except that when the font data is neither
+ * MTX-compressed nor XOR-encrypted, *fontOut points straight into font and
+ * *borrowedOut is set. Such a pointer is only valid as long as font is, and
+ * must not be passed to EOTfreeBuffer. */
+enum EOTError EOT2ttf_buffer_borrow(const uint8_t *font, unsigned fontSize,
+                                    const struct EOTConversionOptions *opts,
+                                    struct EOTMetadata *metadataOut,
+                                    const uint8_t **fontOut,
+                                    unsigned *fontSizeOut, bool *borrowedOut);
+/* Like EOT2ttf_buffer_borrow, except that XOR-encrypted font data is
+ * decrypted in place in font, so that uncompressed fonts are borrowed even
+ * when encrypted. font no longer holds a valid EOT afterwards. */
+enum EOTError EOT2ttf_buffer_inplace(uint8_t *font, unsigned fontSize,
+                                     const struct EOTConversionOptions *opts,
+                                     struct EOTMetadata *metadataOut,
+                                     const uint8_t **fontOut,
+                                     unsigned *fontSizeOut, bool *borrowedOut);
+/* Works out the size of the converted font. For fonts that are not
+ * MTX-compressed that is metadataOut->fontDataSize, and nothing is decoded;
+ * the others have to be decoded to find out, and then again by EOT2ttf_into.
+ * EOT2ttf_size_ctx and EOT2ttf_into_ctx only decode them once. */
+enum EOTError EOT2ttf_size(const uint8_t *font, unsigned fontSize,
+                           const struct EOTConversionOptions *opts,
+                           struct EOTMetadata *metadataOut,
+                           unsigned *fontSizeOut);
+/* Writes the converted font straight into buf, which has room for bufSize
+ * bytes. If that is not enough, nothing is written and EOT_BUFFER_TOO_SMALL
+ * is returned with the size needed in *fontSizeOut. */
+enum EOTError EOT2ttf_into(const uint8_t *font, unsigned fontSize,
+                           const struct EOTConversionOptions *opts,
+                           struct EOTMetadata *metadataOut, uint8_t *buf,
+                           unsigned bufSize, unsigned *fontSizeOut);
+
+/* Holds on to the decoder, its buffers and the output buffer between
+ * conversions, so that converting many fonts doesn't allocate them over and
+ * over. A context must only be used by one thread at a time: give each thread
+ * its own. */
+struct EOTContext;
+struct EOTContext *EOTcreateContext(void);
+/* The context, and everything it holds on to, is allocated from allocator,
+ * which must outlive it. Metadata strings still come from the conversion
+ * options' allocator. */
+struct EOTContext *
+EOTcreateContextWithAllocator(const struct EOTAllocator *allocator);
+void EOTfreeContext(struct EOTContext *ctx);
+/* Like EOT2ttf_buffer_opts, but *fontOut belongs to ctx. It stays valid until
+ * the next conversion made with ctx, or until ctx is freed. */
+enum EOTError EOT2ttf_buffer_ctx(struct EOTContext *ctx, const uint8_t *font,
+                                 unsigned fontSize,
+                                 const struct EOTConversionOptions *opts,
+                                 struct EOTMetadata *metadataOut,
+                                 const uint8_t **fontOut,
+                                 unsigned *fontSizeOut);
+enum EOTError EOT2ttf_fd_ctx(struct EOTContext *ctx, const uint8_t *font,
+                             unsigned fontSize,
+                             const struct EOTConversionOptions *opts,
+                             struct EOTMetadata *metadataOut, int fd);
+enum EOTError EOT2ttf_callback_ctx(struct EOTContext *ctx, const uint8_t *font,
+                                   unsigned fontSize,
+                                   const struct EOTConversionOptions *opts,
+                                   struct EOTMetadata *metadataOut,
+                                   EOTWriteCallback write, void *userData);
+
+/* Like EOT2ttf_size, but the decoded font is kept in ctx, so that an
+ * EOT2ttf_into_ctx of the same font, at the same address and with the same
+ * options, only has to write it out. The font is given up by any other
+ * conversion made with ctx in between. */
+enum EOTError EOT2ttf_size_ctx(struct EOTContext *ctx, const uint8_t *font,
+                               unsigned fontSize,
+                               const struct EOTConversionOptions *opts,
+                               struct EOTMetadata *metadataOut,
+                               unsigned *fontSizeOut);
+/* Like EOT2ttf_into. If buf is too small, the decoded font is kept in ctx as
+ * by EOT2ttf_size_ctx, for a second try with a bigger one. */
+enum EOTError EOT2ttf_into_ctx(struct EOTContext *ctx, const uint8_t *font,
+                               unsigned fontSize,
+                               const struct EOTConversionOptions *opts,
+                               struct EOTMetadata *metadataOut, uint8_t *buf,
+                               unsigned bufSize, unsigned *fontSizeOut);
+
+/* One font of a batch. The caller fills in the input, EOT2ttf_batch the
+ * rest. */
+struct EOTBatchItem {
+  const uint8_t *font;
+  unsigned fontSize;
+  const struct EOTConversionOptions *opts; /* may be NULL */
+  /* Warnings (>= EOT_WARN) mean the font was converted anyway. Unlike the
+   * other functions, the batch doesn't print them. */
+  enum EOTError result;
+  /* must be freed with EOTfreeMetadata, whatever the result */
+  struct EOTMetadata metadata;
+  /* NULL if the conversion failed; freed like the result of
+   * EOT2ttf_buffer_opts */
+  uint8_t *fontOut;
+  unsigned fontSizeOut;
+};
+
+/* Converts each item like EOT2ttf_buffer_opts, on numThreads threads counting
+ * the calling one, or one per CPU if numThreads is 0. Each thread keeps its
+ * own decoder state from one font to the next, and takes over items from the
+ * others once it runs out. An allocator shared between items must be safe to
+ * use from several threads at once. Returns the first error among the items,
+ * if any. */
+enum EOTError EOT2ttf_batch(struct EOTBatchItem *items, unsigned numItems,
+                            unsigned numThreads);
+
+/* A cache of converted fonts, for when the same EOTs come up over and over.
+ * Fonts are looked up by a 128-bit hash of the EOT along with the conversion
+ * options that make a difference to the result. The cache is split into
+ * shards, each with a lock and an even share of maxBytes, and drops the least
+ * recently used fonts of a shard to make room in it; fonts too big for a
+ * shard's share are converted but not kept. It may be used from any number of
+ * threads at once. */
+struct EOTCache;
+struct EOTCache *EOTcreateCache(size_t maxBytes);
+/* Fonts handed out by the cache stay valid after it is freed, until they are
+ * released. */
+void EOTfreeCache(struct EOTCache *cache);
+/* Like EOT2ttf_buffer_ctx, except that the font is looked up in cache first,
+ * and only converted, with ctx if it isn't NULL, when it isn't there.
+ * metadataOut may be NULL; if it isn't, it is filled in even on a hit, which
+ * only takes parsing the header. Warnings are returned rather than printed.
+ * *fontOut is shared, must not be changed, and must be given back to
+ * EOTreleaseCachedFont. It is not allocated from opts->allocator. */
+enum EOTError EOT2ttf_cached(struct EOTCache *cache, struct EOTContext *ctx,
+                             const uint8_t *font, unsigned fontSize,
+                             const struct EOTConversionOptions *opts,
+                             struct EOTMetadata *metadataOut,
+                             const uint8_t **fontOut, unsigned *fontSizeOut);
+void EOTreleaseCachedFont(const uint8_t *font);
 
 void EOTfreeBuffer(const uint8_t *buffer);
 void EOTprintError(enum EOTError, FILE *out);
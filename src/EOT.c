@@ -7,6 +7,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "flags.h"
+#include "util/alloc.h"
+#include "util/utf8.h"
+
 const uint16_t EDITING_MASK = 0x0008;
 
 uint32_t EOTreadU32LE(const uint8_t *bytes)
@@ -27,101 +31,120 @@ unsigned EOTgetMetadataLength(const uint8_t *bytes)
   return totalLength - fontLength;
 }
 
-enum EOTError EOTgetString(const uint8_t **scanner, const uint8_t *begin,
-                           unsigned bytesLength, uint16_t *size,
-                           uint16_t **string)
+bool _eot_decodeVersion(uint32_t versionMagic, enum EOTVersion *out)
+{
+  switch (versionMagic) {
+  case 0x00010000:
+    *out = VERSION_1;
+    return true;
+  case 0x00020001:
+    *out = VERSION_2;
+    return true;
+  case 0x00020002:
+    *out = VERSION_3;
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* Offsets of the fixed-size fields, counted from just after the version. The
+ * last one read, the checksum adjustment, ends at EOT_PROBE_FIXED_END. */
+#define EOT_PROBE_FLAGS 0
+#define EOT_PROBE_CHARSET 14
+#define EOT_PROBE_WEIGHT 16
+#define EOT_PROBE_PERMISSIONS 20
+#define EOT_PROBE_MAGIC 22
+#define EOT_PROBE_UNICODE_RANGE 24
+#define EOT_PROBE_FIXED_END 52
+
+enum EOTError EOTprobeHeader(const uint8_t *bytes, unsigned bytesLength,
+                             struct EOTHeaderProbe *out)
 {
-  if (*string) {
-    free(*string);
+  struct EOTHeaderProbe zero = {0};
+  *out = zero;
+  if (bytesLength < 8 || bytesLength < EOTgetMetadataLength(bytes)) {
+    return EOT_INSUFFICIENT_BYTES;
+  }
+  if (bytesLength <= 12) {
+    return EOT_INSUFFICIENT_BYTES;
+  }
+  uint32_t totalSize = EOTreadU32LE(bytes);
+  uint32_t fontDataSize = EOTreadU32LE(bytes + 4);
+  if (!_eot_decodeVersion(EOTreadU32LE(bytes + 8), &out->version)) {
+    return EOT_CORRUPT_FILE;
+  }
+  /* EOTfillMetadata reports running out of bytes anywhere in here, or the
+   * header and font data not fitting together, as corruption */
+  if (bytesLength < fontDataSize ||
+      bytesLength - fontDataSize <= 12 + EOT_PROBE_FIXED_END ||
+      totalSize > bytesLength) {
+    return EOT_CORRUPT_FILE;
+  }
+  const uint8_t *fixed = bytes + 12;
+  if (EOTreadU16LE(fixed + EOT_PROBE_MAGIC) != 0x504C) {
+    return EOT_CORRUPT_FILE;
+  }
+  out->flags = EOTreadU32LE(fixed + EOT_PROBE_FLAGS);
+  out->compressed = out->flags & TTEMBED_TTCOMPRESSED;
+  out->encrypted = out->flags & TTEMBED_XORENCRYPTDATA;
+  out->charset = (enum EOTCharset)fixed[EOT_PROBE_CHARSET];
+  out->weight = EOTreadU32LE(fixed + EOT_PROBE_WEIGHT);
+  out->permissions = EOTreadU16LE(fixed + EOT_PROBE_PERMISSIONS);
+  for (unsigned i = 0; i < 4; ++i) {
+    out->unicodeRange[i] =
+        EOTreadU32LE(fixed + EOT_PROBE_UNICODE_RANGE + 4 * i);
   }
-  *string = 0;
+  out->fontDataSize = fontDataSize;
+  out->fontDataOffset = totalSize - fontDataSize;
+  return EOT_SUCCESS;
+}
+
+enum EOTError _eot_getString(const uint8_t **scanner, const uint8_t *begin,
+                             unsigned bytesLength, unsigned currIndex,
+                             struct EOTStringRef *out)
+{
+  *out = (struct EOTStringRef){0, 0};
   if (*scanner - begin + 2 > bytesLength) {
     return EOT_INSUFFICIENT_BYTES;
   }
-  *size = EOTreadU16LE(*scanner);
+  uint16_t size = EOTreadU16LE(*scanner);
   *scanner += 2;
-  if (*size % 2 != 0) // strings are encoded in UTF-16.
+  if (size % 2 != 0) // strings are encoded in UTF-16.
   {
     return EOT_BOGUS_STRING_SIZE;
   }
-  if (*scanner - begin + *size > bytesLength) {
+  if (*scanner - begin + size > bytesLength) {
     return EOT_INSUFFICIENT_BYTES;
   }
-  if (*size != 0) {
-    *string = malloc(*size);
-    if (!*string) {
-      return EOT_CANT_ALLOCATE_MEMORY;
-    }
-    for (unsigned i = 0; i < *size / 2; ++i) {
-      (*string)[i] = EOTreadU16LE(*scanner);
-      *scanner += 2;
-    }
-  }
+  out->offset = *scanner - begin + currIndex;
+  out->size = size;
+  *scanner += size;
   return EOT_SUCCESS;
 }
 
-enum EOTError EOTgetByteArray(const uint8_t **scanner, const uint8_t *begin,
-                              unsigned bytesLength, uint32_t *size,
-                              uint8_t **array)
+enum EOTError _eot_getByteArray(const uint8_t **scanner, const uint8_t *begin,
+                                unsigned bytesLength, unsigned currIndex,
+                                unsigned *offset, uint32_t *size)
 {
-  if (*array) {
-    free(*array);
-  }
-  *array = 0;
+  *offset = 0;
+  *size = 0;
   if (*scanner - begin + 4 > bytesLength) {
     return EOT_INSUFFICIENT_BYTES;
   }
-  *size = EOTreadU32LE(*scanner);
+  uint32_t arraySize = EOTreadU32LE(*scanner);
   *scanner += 4;
-  if (*scanner - begin + *size > bytesLength) {
+  if (*scanner - begin + arraySize > bytesLength) {
     return EOT_INSUFFICIENT_BYTES;
   }
-  if (*size != 0) {
-    *array = malloc(*size);
-    if (!*array) {
-      return EOT_CANT_ALLOCATE_MEMORY;
-    }
-    for (unsigned i = 0; i < *size; ++i) {
-      (*array)[i] = **scanner;
-      ++(*scanner);
-    }
-  }
+  *offset = *scanner - begin + currIndex;
+  *size = arraySize;
+  *scanner += arraySize;
   return EOT_SUCCESS;
 }
 
-void EOTfreeMetadata(struct EOTMetadata *d)
-{
-  if (d->familyName) {
-    free(d->familyName);
-  }
-  if (d->styleName) {
-    free(d->styleName);
-  }
-  if (d->versionName) {
-    free(d->versionName);
-  }
-  if (d->fullName) {
-    free(d->fullName);
-  }
-  if (d->do_not_use) {
-    free(d->do_not_use);
-  }
-  if (d->rootStrings) {
-    for (unsigned i = 0; i < d->numRootStrings; ++i) {
-      free(d->rootStrings[i].rootString);
-    }
-    free(d->rootStrings);
-  }
-  if (d->eudcInfo.fontData) {
-    free(d->eudcInfo.fontData);
-  }
-  struct EOTMetadata zero = {0};
-  *d = zero;
-}
-
 #define EOT_ENSURE_SCANNER(N)                                                  \
   if (scanner - bytes + N >= bytesLength) {                                    \
-    EOTfreeMetadata(out);                                                      \
     return EOT_INSUFFICIENT_BYTES;                                             \
   }
 
@@ -129,18 +152,16 @@ void EOTfreeMetadata(struct EOTMetadata *d)
   {                                                                            \
     enum EOTError macro_defined_var_E = E;                                     \
     if (macro_defined_var_E != EOT_SUCCESS) {                                  \
-      EOTfreeMetadata(out);                                                    \
       return macro_defined_var_E;                                              \
     }                                                                          \
   }
 
-enum EOTError EOTfillMetadataSpecifyingVersion(const uint8_t *bytes,
-                                               unsigned bytesLength,
-                                               struct EOTMetadata *out,
-                                               enum EOTVersion version,
-                                               int currIndex)
+/* Parses the part of the header after the version that every version shares,
+ * up to and including the full name. bytes is currIndex bytes into the EOT. */
+enum EOTError _eot_fillViewPrefix(const uint8_t *bytes, unsigned bytesLength,
+                                  struct EOTMetadataView *out,
+                                  unsigned currIndex, const uint8_t **end)
 {
-  out->version = version;
   const uint8_t *scanner = bytes;
   EOT_ENSURE_SCANNER(4);
   out->flags = EOTreadU32LE(scanner);
@@ -178,61 +199,93 @@ enum EOTError EOTfillMetadataSpecifyingVersion(const uint8_t *bytes,
   EOT_ENSURE_SCANNER(4);
   out->checkSumAdjustment = EOTreadU32LE(scanner);
   scanner += 22;
-  EOT_ENSURE_STRING_NOERR(EOTgetString(&scanner, bytes, bytesLength,
-                                       &(out->familyNameSize),
-                                       &(out->familyName)));
+  EOT_ENSURE_STRING_NOERR(_eot_getString(&scanner, bytes, bytesLength,
+                                         currIndex, &out->familyName));
+  scanner += 2;
+  EOT_ENSURE_STRING_NOERR(_eot_getString(&scanner, bytes, bytesLength,
+                                         currIndex, &out->styleName));
   scanner += 2;
-  EOT_ENSURE_STRING_NOERR(EOTgetString(
-      &scanner, bytes, bytesLength, &(out->styleNameSize), &(out->styleName)));
+  EOT_ENSURE_STRING_NOERR(_eot_getString(&scanner, bytes, bytesLength,
+                                         currIndex, &out->versionName));
   scanner += 2;
-  EOT_ENSURE_STRING_NOERR(EOTgetString(&scanner, bytes, bytesLength,
-                                       &(out->versionNameSize),
-                                       &(out->versionName)));
+  EOT_ENSURE_STRING_NOERR(_eot_getString(&scanner, bytes, bytesLength,
+                                         currIndex, &out->fullName));
+  *end = scanner;
+  return EOT_SUCCESS;
+}
+
+/* Parses the version 3 fields that follow the root string, starting at
+ * *end. */
+enum EOTError _eot_fillViewV3(const uint8_t *bytes, unsigned bytesLength,
+                              struct EOTMetadataView *out, unsigned currIndex,
+                              const uint8_t **end)
+{
+  const uint8_t *scanner = *end;
+  EOT_ENSURE_SCANNER(4);
+  EOTreadU32LE(scanner); /* root string checksum */
+  scanner += 4;
+  EOT_ENSURE_SCANNER(4);
+  out->eudcCodePage = EOTreadU32LE(scanner);
+  scanner += 6;
+  EOT_ENSURE_SCANNER(2);
+  uint16_t signatureSize = EOTreadU16LE(scanner);
   scanner += 2;
-  EOT_ENSURE_STRING_NOERR(EOTgetString(&scanner, bytes, bytesLength,
-                                       &(out->fullNameSize), &(out->fullName)));
-  if (out->version > VERSION_1) {
-    scanner += 2;
-    EOT_ENSURE_STRING_NOERR(EOTgetString(&scanner, bytes, bytesLength,
-                                         &(out->do_not_use_size),
-                                         &(out->do_not_use)));
-    if (out->version == VERSION_3) {
-      EOT_ENSURE_SCANNER(4);
-      EOTreadU32LE(scanner); /* root string checksum */
-      scanner += 4;
-      EOT_ENSURE_SCANNER(4);
-      out->eudcInfo.codePage = EOTreadU32LE(scanner);
-      scanner += 6;
-      EOT_ENSURE_SCANNER(2);
-      uint16_t signatureSize = EOTreadU16LE(scanner);
-      scanner += 2;
-      EOT_ENSURE_SCANNER(signatureSize);
-      scanner += signatureSize;
-      /* signature is reserved, so do nothing with this. */
-      EOT_ENSURE_SCANNER(4);
-      out->eudcInfo.flags = EOTreadU32LE(scanner);
-      scanner += 4;
-      EOT_ENSURE_STRING_NOERR(EOTgetByteArray(&scanner, bytes, bytesLength,
-                                              &(out->eudcInfo.fontDataSize),
-                                              &(out->eudcInfo.fontData)));
-      if (out->eudcInfo.fontDataSize > 0) {
-        out->eudcInfo.exists = true;
+  EOT_ENSURE_SCANNER(signatureSize);
+  scanner += signatureSize;
+  /* signature is reserved, so do nothing with this. */
+  EOT_ENSURE_SCANNER(4);
+  out->eudcFlags = EOTreadU32LE(scanner);
+  scanner += 4;
+  EOT_ENSURE_STRING_NOERR(_eot_getByteArray(&scanner, bytes, bytesLength,
+                                            currIndex, &out->eudcFontDataOffset,
+                                            &out->eudcFontDataSize));
+  *end = scanner;
+  return EOT_SUCCESS;
+}
+
+/* Files in the wild don't always carry the version their header is laid out
+ * in. Starting from the coded version, this moves up while the header would
+ * end before the font data starts and down while it would run out of bytes,
+ * giving up if it has to turn around or runs out of versions. layouts[i] is
+ * the outcome of reading the header as VERSION_1 + i. */
+enum EOTError _eot_resolveVersion(const enum EOTError layouts[3],
+                                  enum EOTVersion codedVersion,
+                                  enum EOTVersion *versionOut)
+{
+  enum EOTError first = layouts[codedVersion - VERSION_1];
+  enum EOTVersion tryVersion = codedVersion;
+  while (true) {
+    enum EOTError result = layouts[tryVersion - VERSION_1];
+    if (result == EOT_SUCCESS) {
+      *versionOut = tryVersion;
+      return EOT_SUCCESS;
+    }
+    if (result != EOT_HEADER_TOO_BIG && result != EOT_INSUFFICIENT_BYTES) {
+      return result;
+    }
+    if (result != first) {
+      return EOT_CORRUPT_FILE;
+    }
+    if (result == EOT_HEADER_TOO_BIG) {
+      if (tryVersion == VERSION_3) {
+        return EOT_CORRUPT_FILE;
       }
+      ++tryVersion;
+    } else {
+      if (tryVersion == VERSION_1) {
+        return EOT_CORRUPT_FILE;
+      }
+      --tryVersion;
     }
   }
-  out->fontDataOffset = scanner - bytes + currIndex;
-  int expectedHeaderSize = (int)(out->totalSize) - (int)(out->fontDataSize);
-  if (out->fontDataOffset < expectedHeaderSize) {
-    return EOT_HEADER_TOO_BIG;
-  }
-  return EOT_SUCCESS;
 }
 
-enum EOTError EOTfillMetadata(const uint8_t *bytes, unsigned bytesLength,
-                              struct EOTMetadata *out)
+enum EOTError EOTfillMetadataView(const uint8_t *bytes, unsigned bytesLength,
+                                  struct EOTMetadataView *out)
 {
-  struct EOTMetadata zero = {0};
+  struct EOTMetadataView zero = {0};
   *out = zero;
+  out->bytes = bytes;
   const uint8_t *scanner = bytes;
   if (bytesLength < 8 || bytesLength < EOTgetMetadataLength(bytes)) {
     return EOT_INSUFFICIENT_BYTES;
@@ -247,52 +300,239 @@ enum EOTError EOTfillMetadata(const uint8_t *bytes, unsigned bytesLength,
   uint32_t versionMagic = EOTreadU32LE(scanner);
   scanner += 4;
   enum EOTVersion codedVersion;
-  switch (versionMagic) {
-  case 0x00010000:
-    codedVersion = VERSION_1;
-    break;
-  case 0x00020001:
-    codedVersion = VERSION_2;
-    break;
-  case 0x00020002:
-    codedVersion = VERSION_3;
-    break;
-  default:
+  if (!_eot_decodeVersion(versionMagic, &codedVersion)) {
     return EOT_CORRUPT_FILE;
   }
-  enum EOTVersion tryVersion = codedVersion;
-  bool bumpedUp = false, knockedDown = false;
-  while (true) {
-    EOTfreeMetadata(out);
-    out->totalSize = totalSize;
-    out->fontDataSize = fontDataSize;
-    if (bytesLength + bytes < out->fontDataSize + scanner) {
-      return EOT_CORRUPT_FILE;
+  out->totalSize = totalSize;
+  out->fontDataSize = fontDataSize;
+  if (bytesLength + bytes < out->fontDataSize + scanner) {
+    return EOT_CORRUPT_FILE;
+  }
+  unsigned currIndex = scanner - bytes;
+  unsigned headerLength = bytesLength - fontDataSize - currIndex;
+  const uint8_t *end;
+  enum EOTError result =
+      _eot_fillViewPrefix(scanner, headerLength, out, currIndex, &end);
+  if (result == EOT_INSUFFICIENT_BYTES) {
+    /* every version starts this way, so none of them fits */
+    return EOT_CORRUPT_FILE;
+  } else if (result != EOT_SUCCESS) {
+    return result;
+  }
+  /* The versions only differ in what follows the full name, and each extends
+   * the one before, so one walk over it finds where the header would end as
+   * each of them. */
+  enum EOTError layouts[3];
+  unsigned ends[3];
+  layouts[0] = EOT_SUCCESS;
+  ends[0] = end - scanner + currIndex;
+  end += 2;
+  layouts[1] = _eot_getString(&end, scanner, headerLength, currIndex,
+                              &out->rootString);
+  ends[1] = end - scanner + currIndex;
+  layouts[2] = layouts[1];
+  if (layouts[2] == EOT_SUCCESS) {
+    layouts[2] = _eot_fillViewV3(scanner, headerLength, out, currIndex, &end);
+  }
+  ends[2] = end - scanner + currIndex;
+  unsigned expectedHeaderSize = totalSize - fontDataSize;
+  for (unsigned i = 0; i < 3; ++i) {
+    if (layouts[i] == EOT_SUCCESS && ends[i] < expectedHeaderSize) {
+      layouts[i] = EOT_HEADER_TOO_BIG;
     }
-    enum EOTError result = EOTfillMetadataSpecifyingVersion(
-        scanner, bytesLength - out->fontDataSize - (scanner - bytes), out,
-        tryVersion, scanner - bytes);
-    if (result == EOT_SUCCESS) {
-      return tryVersion == codedVersion ? EOT_SUCCESS : EOT_WARN_BAD_VERSION;
+  }
+  enum EOTVersion version;
+  result = _eot_resolveVersion(layouts, codedVersion, &version);
+  if (result != EOT_SUCCESS) {
+    return result;
+  }
+  out->version = version;
+  out->fontDataOffset = ends[version - VERSION_1];
+  if (version < VERSION_2) {
+    out->rootString = zero.rootString;
+  }
+  if (version < VERSION_3) {
+    out->eudcCodePage = 0;
+    out->eudcFlags = 0;
+    out->eudcFontDataOffset = 0;
+    out->eudcFontDataSize = 0;
+  }
+  return version == codedVersion ? EOT_SUCCESS : EOT_WARN_BAD_VERSION;
+}
+
+enum EOTError EOTviewStringUTF8(const struct EOTMetadataView *view,
+                                struct EOTStringRef str, char *out,
+                                unsigned outSize, unsigned *lengthOut)
+{
+  const uint8_t *src = view->bytes + str.offset;
+  unsigned units = str.size / 2;
+  if (outSize < EOT_UTF8_MAX_SIZE(str)) {
+    /* the worst case might not fit, so count first */
+    unsigned length = utf16leUTF8Length(src, units);
+    if (length >= outSize) {
+      *lengthOut = length;
+      return EOT_BUFFER_TOO_SMALL;
     }
-    if (result == EOT_HEADER_TOO_BIG) {
-      if (knockedDown || (tryVersion == VERSION_3)) {
-        return EOT_CORRUPT_FILE;
-      }
-      knockedDown = false;
-      bumpedUp = true;
-      ++tryVersion;
-    } else if (result == EOT_INSUFFICIENT_BYTES) {
-      if (bumpedUp || (tryVersion == VERSION_1)) {
-        return EOT_CORRUPT_FILE;
-      }
-      knockedDown = true;
-      bumpedUp = false;
-      --tryVersion;
+  }
+  *lengthOut = utf16leToUTF8(src, units, (uint8_t *)out);
+  out[*lengthOut] = '\0';
+  return EOT_SUCCESS;
+}
+
+/* Copies a string of the view out into memory of its own, in host byte
+ * order. */
+enum EOTError _eot_copyString(const struct EOTMetadataView *view,
+                              struct EOTStringRef str,
+                              const struct EOTAllocator *alloc, uint16_t *size,
+                              uint16_t **string)
+{
+  *size = str.size;
+  *string = NULL;
+  if (str.size == 0) {
+    return EOT_SUCCESS;
+  }
+  *string = (uint16_t *)eotMalloc(alloc, str.size);
+  if (!*string) {
+    return EOT_CANT_ALLOCATE_MEMORY;
+  }
+  for (unsigned i = 0; i < str.size / 2u; ++i) {
+    (*string)[i] = EOTreadU16LE(view->bytes + str.offset + 2 * i);
+  }
+  return EOT_SUCCESS;
+}
+
+/* Splits the NUL-separated root strings in out->do_not_use into
+ * out->rootStrings, skipping empty ones. */
+enum EOTError _eot_splitRootStrings(struct EOTMetadata *out)
+{
+  unsigned units = out->do_not_use_size / 2u;
+  const uint16_t *blob = out->do_not_use;
+  unsigned count = 0;
+  for (unsigned i = 0; i < units; ++i) {
+    if (blob[i] != 0 && (i + 1 == units || blob[i + 1] == 0)) {
+      ++count;
+    }
+  }
+  if (count == 0) {
+    return EOT_SUCCESS;
+  }
+  out->rootStrings = (struct EOTRootStringInfo *)eotCalloc(
+      out->allocator, count, sizeof(struct EOTRootStringInfo));
+  if (!out->rootStrings) {
+    return EOT_CANT_ALLOCATE_MEMORY;
+  }
+  for (unsigned i = 0; i < units;) {
+    if (blob[i] == 0) {
+      ++i;
+      continue;
+    }
+    unsigned start = i;
+    while (i < units && blob[i] != 0) {
+      ++i;
+    }
+    struct EOTRootStringInfo *info = &out->rootStrings[out->numRootStrings];
+    info->rootString =
+        (uint16_t *)eotMalloc(out->allocator, (i - start) * sizeof(uint16_t));
+    if (!info->rootString) {
+      return EOT_CANT_ALLOCATE_MEMORY;
+    }
+    memcpy(info->rootString, blob + start, (i - start) * sizeof(uint16_t));
+    info->rootStringSize = (i - start) * sizeof(uint16_t);
+    ++out->numRootStrings;
+  }
+  return EOT_SUCCESS;
+}
+
+void EOTfreeMetadata(struct EOTMetadata *d)
+{
+  const struct EOTAllocator *alloc = d->allocator;
+  eotFree(alloc, d->familyName);
+  eotFree(alloc, d->styleName);
+  eotFree(alloc, d->versionName);
+  eotFree(alloc, d->fullName);
+  eotFree(alloc, d->do_not_use);
+  if (d->rootStrings) {
+    for (unsigned i = 0; i < d->numRootStrings; ++i) {
+      eotFree(alloc, d->rootStrings[i].rootString);
+    }
+    eotFree(alloc, d->rootStrings);
+  }
+  eotFree(alloc, d->eudcInfo.fontData);
+  struct EOTMetadata zero = {0};
+  *d = zero;
+}
+
+enum EOTError EOTfillMetadata(const uint8_t *bytes, unsigned bytesLength,
+                              struct EOTMetadata *out)
+{
+  return EOTfillMetadataWithAllocator(bytes, bytesLength, NULL, out);
+}
+
+enum EOTError EOTfillMetadataWithAllocator(const uint8_t *bytes,
+                                           unsigned bytesLength,
+                                           const struct EOTAllocator *allocator,
+                                           struct EOTMetadata *out)
+{
+  struct EOTMetadata zero = {0};
+  *out = zero;
+  out->allocator = allocator;
+  struct EOTMetadataView view;
+  enum EOTError result = EOTfillMetadataView(bytes, bytesLength, &view);
+  if (result != EOT_SUCCESS && result < EOT_WARN) {
+    return result;
+  }
+  out->totalSize = view.totalSize;
+  out->version = view.version;
+  out->flags = view.flags;
+  memcpy(out->panose, view.panose, sizeof(out->panose));
+  out->charset = view.charset;
+  out->italic = view.italic;
+  out->weight = view.weight;
+  out->permissions = view.permissions;
+  memcpy(out->unicodeRange, view.unicodeRange, sizeof(out->unicodeRange));
+  memcpy(out->codePageRange, view.codePageRange, sizeof(out->codePageRange));
+  out->checkSumAdjustment = view.checkSumAdjustment;
+  out->fontDataSize = view.fontDataSize;
+  out->fontDataOffset = view.fontDataOffset;
+  out->eudcInfo.codePage = view.eudcCodePage;
+  out->eudcInfo.flags = view.eudcFlags;
+  out->eudcInfo.fontDataSize = view.eudcFontDataSize;
+  out->eudcInfo.exists = view.eudcFontDataSize > 0;
+  enum EOTError copyResult = EOT_SUCCESS;
+  struct {
+    struct EOTStringRef ref;
+    uint16_t *size;
+    uint16_t **string;
+  } strings[] = {
+      {view.familyName, &out->familyNameSize, &out->familyName},
+      {view.styleName, &out->styleNameSize, &out->styleName},
+      {view.versionName, &out->versionNameSize, &out->versionName},
+      {view.fullName, &out->fullNameSize, &out->fullName},
+      {view.rootString, &out->do_not_use_size, &out->do_not_use}};
+  for (unsigned i = 0;
+       i < sizeof(strings) / sizeof(strings[0]) && copyResult == EOT_SUCCESS;
+       ++i) {
+    copyResult = _eot_copyString(&view, strings[i].ref, allocator,
+                                 strings[i].size, strings[i].string);
+  }
+  if (copyResult == EOT_SUCCESS) {
+    copyResult = _eot_splitRootStrings(out);
+  }
+  if (copyResult == EOT_SUCCESS && view.eudcFontDataSize > 0) {
+    out->eudcInfo.fontData =
+        (uint8_t *)eotMalloc(allocator, view.eudcFontDataSize);
+    if (out->eudcInfo.fontData) {
+      memcpy(out->eudcInfo.fontData, bytes + view.eudcFontDataOffset,
+             view.eudcFontDataSize);
     } else {
-      return result;
+      copyResult = EOT_CANT_ALLOCATE_MEMORY;
     }
   }
+  if (copyResult != EOT_SUCCESS) {
+    EOTfreeMetadata(out);
+    return copyResult;
+  }
+  return result;
 }
 
 /* Please think twice before circumventing this function.
@@ -0,0 +1,216 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+/* for MAP_ANONYMOUS and madvise */
+#define _DEFAULT_SOURCE
+
+#include <libeot/EOTAllocator.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_DEFAULT_CHUNK_SIZE (1u << 20)
+#define ARENA_HUGE_PAGE_SIZE (2u << 20)
+
+/* Every block is preceded by a header this big, holding its size. */
+#define ARENA_HEADER ARENA_ALIGN
+
+struct _arena_Chunk {
+  struct _arena_Chunk *next;
+  size_t size; /* including this header */
+  size_t used;
+};
+
+#define ARENA_CHUNK_HEADER                                                     \
+  ((sizeof(struct _arena_Chunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct EOTArena {
+  struct EOTAllocator allocator;
+  size_t chunkSize;
+  bool hugePages;
+  /* chunks of chunkSize, in the order they are filled; those after current
+   * are empty */
+  struct _arena_Chunk *chunks;
+  struct _arena_Chunk *current;
+  /* chunks holding a single oversized block, dropped on reset */
+  struct _arena_Chunk *large;
+  /* the last block handed out, and the chunk it came from */
+  uint8_t *last;
+  struct _arena_Chunk *lastChunk;
+};
+
+size_t _arena_round(size_t n, size_t to) { return (n + to - 1) / to * to; }
+
+struct _arena_Chunk *_arena_mapChunk(struct EOTArena *arena, size_t size)
+{
+  size = _arena_round(size, arena->hugePages ? ARENA_HUGE_PAGE_SIZE : 4096);
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    return NULL;
+  }
+#ifdef MADV_HUGEPAGE
+  if (arena->hugePages) {
+    madvise(mem, size, MADV_HUGEPAGE); /* only a hint */
+  }
+#endif
+  struct _arena_Chunk *chunk = (struct _arena_Chunk *)mem;
+  chunk->next = NULL;
+  chunk->size = size;
+  chunk->used = ARENA_CHUNK_HEADER;
+  return chunk;
+}
+
+void _arena_unmapChunks(struct _arena_Chunk *chunk)
+{
+  while (chunk) {
+    struct _arena_Chunk *next = chunk->next;
+    munmap(chunk, chunk->size);
+    chunk = next;
+  }
+}
+
+size_t _arena_blockSize(const uint8_t *block)
+{
+  size_t size;
+  memcpy(&size, block - ARENA_HEADER, sizeof(size));
+  return size;
+}
+
+uint8_t *_arena_carve(struct _arena_Chunk *chunk, size_t size)
+{
+  uint8_t *block = (uint8_t *)chunk + chunk->used + ARENA_HEADER;
+  memcpy(block - ARENA_HEADER, &size, sizeof(size));
+  chunk->used += ARENA_HEADER + _arena_round(size, ARENA_ALIGN);
+  return block;
+}
+
+void *_arena_malloc(void *userData, size_t size)
+{
+  struct EOTArena *arena = (struct EOTArena *)userData;
+  size_t need = ARENA_HEADER + _arena_round(size, ARENA_ALIGN);
+  if (need < size) {
+    return NULL;
+  }
+  struct _arena_Chunk *chunk;
+  if (need > arena->chunkSize - ARENA_CHUNK_HEADER) {
+    chunk = _arena_mapChunk(arena, ARENA_CHUNK_HEADER + need);
+    if (!chunk) {
+      return NULL;
+    }
+    chunk->next = arena->large;
+    arena->large = chunk;
+  } else {
+    chunk = arena->current;
+    while (chunk && chunk->size - chunk->used < need) {
+      chunk = chunk->next;
+    }
+    if (!chunk) {
+      chunk = _arena_mapChunk(arena, arena->chunkSize);
+      if (!chunk) {
+        return NULL;
+      }
+      if (arena->current) {
+        /* whatever is left in the full chunk is given up on */
+        chunk->next = arena->current->next;
+        arena->current->next = chunk;
+      } else {
+        arena->chunks = chunk;
+      }
+    }
+    arena->current = chunk;
+  }
+  arena->last = _arena_carve(chunk, size);
+  arena->lastChunk = chunk;
+  return arena->last;
+}
+
+void *_arena_realloc(void *userData, void *ptr, size_t size)
+{
+  struct EOTArena *arena = (struct EOTArena *)userData;
+  uint8_t *block = (uint8_t *)ptr;
+  size_t oldSize = _arena_blockSize(block);
+  if (block == arena->last) {
+    /* the last block can grow into the rest of its chunk */
+    struct _arena_Chunk *chunk = arena->lastChunk;
+    size_t start = (size_t)(block - (uint8_t *)chunk) - ARENA_HEADER;
+    size_t need = ARENA_HEADER + _arena_round(size, ARENA_ALIGN);
+    if (need >= size && chunk->size - start >= need) {
+      chunk->used = start + need;
+      memcpy(block - ARENA_HEADER, &size, sizeof(size));
+      return block;
+    }
+  } else if (size <= oldSize) {
+    return block;
+  }
+  uint8_t *moved = (uint8_t *)_arena_malloc(arena, size);
+  if (moved) {
+    memcpy(moved, block, oldSize < size ? oldSize : size);
+  }
+  return moved;
+}
+
+void _arena_free(void *userData, void *ptr)
+{
+  struct EOTArena *arena = (struct EOTArena *)userData;
+  uint8_t *block = (uint8_t *)ptr;
+  if (block == arena->last) {
+    arena->lastChunk->used =
+        (size_t)(block - (uint8_t *)arena->lastChunk) - ARENA_HEADER;
+    arena->last = NULL;
+    arena->lastChunk = NULL;
+  }
+}
+
+struct EOTArena *EOTcreateArena(size_t chunkSize, bool hugePages)
+{
+  struct EOTArena *arena = (struct EOTArena *)calloc(1, sizeof(struct EOTArena));
+  if (!arena) {
+    return NULL;
+  }
+  if (chunkSize == 0) {
+    chunkSize = hugePages ? ARENA_HUGE_PAGE_SIZE : ARENA_DEFAULT_CHUNK_SIZE;
+  }
+  if (hugePages) {
+    chunkSize = _arena_round(chunkSize, ARENA_HUGE_PAGE_SIZE);
+  }
+  arena->chunkSize = chunkSize < 4096 ? 4096 : chunkSize;
+  arena->hugePages = hugePages;
+  arena->allocator = (struct EOTAllocator){_arena_malloc, _arena_realloc,
+                                           _arena_free, arena};
+  return arena;
+}
+
+const struct EOTAllocator *EOTarenaAllocator(struct EOTArena *arena)
+{
+  return &arena->allocator;
+}
+
+void EOTresetArena(struct EOTArena *arena)
+{
+  for (struct _arena_Chunk *chunk = arena->chunks; chunk; chunk = chunk->next) {
+    chunk->used = ARENA_CHUNK_HEADER;
+  }
+  arena->current = arena->chunks;
+  _arena_unmapChunks(arena->large);
+  arena->large = NULL;
+  arena->last = NULL;
+  arena->lastChunk = NULL;
+}
+
+void EOTfreeArena(struct EOTArena *arena)
+{
+  if (!arena) {
+    return;
+  }
+  _arena_unmapChunks(arena->chunks);
+  _arena_unmapChunks(arena->large);
+  free(arena);
+}
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
@@ -0,0 +1,174 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+/* for sysconf(_SC_NPROCESSORS_ONLN) */
+#define _DEFAULT_SOURCE
+
+#include <libeot/libeot.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "flags.h"
+#include "writeFontFile.h"
+
+/* The items a worker has yet to start, [next, end). The owner takes them
+ * from the front; idle workers steal half of what is left from the back. */
+struct _batch_Queue {
+  pthread_mutex_t lock;
+  unsigned next;
+  unsigned end;
+};
+
+struct _batch_Pool {
+  struct EOTBatchItem *items;
+  struct _batch_Queue *queues;
+  unsigned numWorkers;
+};
+
+struct _batch_Worker {
+  struct _batch_Pool *pool;
+  unsigned index;
+  pthread_t thread;
+  bool started;
+};
+
+/* The same pipeline as EOT2ttf_buffer_opts, except that warnings are left in
+ * item->result instead of being printed. */
+void _batch_convert(struct EOTContext *ctx, struct EOTBatchItem *item)
+{
+  const struct EOTConversionOptions *opts = item->opts;
+  struct EOTMetadata *md = &item->metadata;
+  item->fontOut = NULL;
+  item->fontSizeOut = 0;
+  enum EOTError result =
+      fillConversionMetadata(item->font, item->fontSize, opts, false, md);
+  if (result != EOT_SUCCESS && result < EOT_WARN) {
+    item->result = result;
+    return;
+  }
+  enum EOTError writeResult = writeFontOwned(
+      item->font + md->fontDataOffset, md->fontDataSize,
+      md->flags & TTEMBED_TTCOMPRESSED, md->flags & TTEMBED_XORENCRYPTDATA,
+      opts, ctx, &item->fontOut, &item->fontSizeOut);
+  item->result = writeResult != EOT_SUCCESS ? writeResult : result;
+}
+
+bool _batch_take(struct _batch_Queue *q, unsigned *item)
+{
+  pthread_mutex_lock(&q->lock);
+  bool found = q->next < q->end;
+  if (found) {
+    *item = q->next++;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+/* Moves the back half of some other worker's items to worker index's own
+ * queue, which is empty. Returns false once there is nothing left anywhere. */
+bool _batch_steal(struct _batch_Pool *pool, unsigned index)
+{
+  for (unsigned i = 1; i < pool->numWorkers; ++i) {
+    struct _batch_Queue *victim =
+        &pool->queues[(index + i) % pool->numWorkers];
+    pthread_mutex_lock(&victim->lock);
+    unsigned end = victim->end;
+    unsigned mid = victim->next + (victim->end - victim->next) / 2;
+    victim->end = mid;
+    pthread_mutex_unlock(&victim->lock);
+    if (mid < end) {
+      struct _batch_Queue *own = &pool->queues[index];
+      pthread_mutex_lock(&own->lock);
+      own->next = mid;
+      own->end = end;
+      pthread_mutex_unlock(&own->lock);
+      return true;
+    }
+  }
+  return false;
+}
+
+void *_batch_run(void *arg)
+{
+  struct _batch_Worker *worker = (struct _batch_Worker *)arg;
+  struct _batch_Pool *pool = worker->pool;
+  /* without a context of its own, a worker still converts, only slower */
+  struct EOTContext *ctx = EOTcreateContext();
+  unsigned item;
+  do {
+    while (_batch_take(&pool->queues[worker->index], &item)) {
+      _batch_convert(ctx, &pool->items[item]);
+    }
+  } while (_batch_steal(pool, worker->index));
+  EOTfreeContext(ctx);
+  return NULL;
+}
+
+enum EOTError EOT2ttf_batch(struct EOTBatchItem *items, unsigned numItems,
+                            unsigned numThreads)
+{
+  if (numThreads == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    numThreads = cpus > 0 ? (unsigned)cpus : 1;
+  }
+  if (numThreads > numItems) {
+    numThreads = numItems ? numItems : 1;
+  }
+  struct _batch_Pool pool = {items, NULL, numThreads};
+  pool.queues = (struct _batch_Queue *)calloc(numThreads,
+                                              sizeof(struct _batch_Queue));
+  struct _batch_Worker *workers = (struct _batch_Worker *)calloc(
+      numThreads, sizeof(struct _batch_Worker));
+  if (!pool.queues || !workers) {
+    /* convert everything on this thread instead */
+    free(pool.queues);
+    free(workers);
+    struct _batch_Queue queue = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                 .next = 0,
+                                 .end = numItems};
+    struct _batch_Worker worker = {.pool = &pool, .index = 0};
+    pool.queues = &queue;
+    pool.numWorkers = 1;
+    _batch_run(&worker);
+  } else {
+    for (unsigned i = 0; i < numThreads; ++i) {
+      pthread_mutex_init(&pool.queues[i].lock, NULL);
+      pool.queues[i].next = (unsigned)((uint64_t)numItems * i / numThreads);
+      pool.queues[i].end =
+          (unsigned)((uint64_t)numItems * (i + 1) / numThreads);
+      workers[i].pool = &pool;
+      workers[i].index = i;
+    }
+    /* this thread is worker 0; the queues of workers that fail to start are
+     * left for the others to steal */
+    for (unsigned i = 1; i < numThreads; ++i) {
+      workers[i].started =
+          pthread_create(&workers[i].thread, NULL, _batch_run, &workers[i]) ==
+          0;
+    }
+    _batch_run(&workers[0]);
+    for (unsigned i = 1; i < numThreads; ++i) {
+      if (workers[i].started) {
+        pthread_join(workers[i].thread, NULL);
+      }
+    }
+    for (unsigned i = 0; i < numThreads; ++i) {
+      pthread_mutex_destroy(&pool.queues[i].lock);
+    }
+    free(workers);
+    free(pool.queues);
+  }
+  for (unsigned i = 0; i < numItems; ++i) {
+    if (items[i].result != EOT_SUCCESS && items[i].result < EOT_WARN) {
+      return items[i].result;
+    }
+  }
+  return EOT_SUCCESS;
+}
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
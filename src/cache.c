@@ -0,0 +1,376 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+#include <fcntl.h>
+#include <libeot/libeot.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flags.h"
+#include "util/alloc.h"
+#include "util/siphash.h"
+#include "writeFontFile.h"
+
+#define CACHE_SHARDS 16
+
+/* A converted font, with what it was converted from. It is allocated in one
+ * block with the font, which follows it, and the subset codepoints after
+ * that. */
+struct _cache_Entry {
+  uint64_t hash[2]; /* of the EOT */
+  unsigned eotSize;
+  bool generateVDMX;
+  bool stripHinting;
+  unsigned numCodepoints;
+  const uint32_t *codepoints;
+  enum EOTError result;
+  struct _cache_Entry *chain; /* the next in its bucket */
+  struct _cache_Entry *newer;
+  struct _cache_Entry *older;
+  size_t cost;
+  /* one for the cache while it holds the entry, and one per caller */
+  unsigned refs;
+  unsigned size;
+};
+
+struct _cache_Shard {
+  pthread_mutex_t lock;
+  /* chained; the bucket count is a power of 2 */
+  struct _cache_Entry **buckets;
+  unsigned numBuckets;
+  unsigned numEntries;
+  /* the entries from the most recently used on */
+  struct _cache_Entry *newest;
+  struct _cache_Entry *oldest;
+  size_t bytes;
+};
+
+struct EOTCache {
+  uint64_t key[2];
+  size_t maxShardBytes;
+  struct _cache_Shard shards[CACHE_SHARDS];
+};
+
+uint8_t *_cache_font(struct _cache_Entry *e) { return (uint8_t *)(e + 1); }
+
+/* Picks a secret key for the hash, so that nobody can make fonts collide in
+ * the cache. */
+void _cache_seed(struct EOTCache *cache)
+{
+  int fd = open("/dev/urandom", O_RDONLY);
+  bool seeded = fd != -1 &&
+                read(fd, cache->key, sizeof(cache->key)) == sizeof(cache->key);
+  if (fd != -1) {
+    close(fd);
+  }
+  if (!seeded) {
+    cache->key[0] = (uint64_t)time(NULL) ^ (uintptr_t)cache;
+    cache->key[1] = (uint64_t)clock() ^ ((uint64_t)(uintptr_t)&fd << 17);
+  }
+}
+
+bool _cache_matches(const struct _cache_Entry *e, const uint64_t hash[2],
+                    unsigned eotSize,
+                    const struct EOTConversionOptions *opts)
+{
+  bool generateVDMX = opts && opts->generateVDMX;
+  bool stripHinting = opts && opts->stripHinting;
+  unsigned numCodepoints = opts ? opts->numSubsetCodepoints : 0;
+  const uint32_t *codepoints = opts ? opts->subsetCodepoints : NULL;
+  return e->hash[0] == hash[0] && e->hash[1] == hash[1] &&
+         e->eotSize == eotSize && e->generateVDMX == generateVDMX &&
+         e->stripHinting == stripHinting &&
+         (e->codepoints != NULL) == (codepoints != NULL) &&
+         e->numCodepoints == numCodepoints &&
+         (numCodepoints == 0 ||
+          memcmp(e->codepoints, codepoints,
+                 numCodepoints * sizeof(uint32_t)) == 0);
+}
+
+void _cache_release(struct _cache_Entry *e)
+{
+  if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(e);
+  }
+}
+
+/* The shard's lock must be held by the caller for all of these. */
+
+struct _cache_Entry *_cache_find(struct _cache_Shard *shard,
+                                 const uint64_t hash[2], unsigned eotSize,
+                                 const struct EOTConversionOptions *opts)
+{
+  if (shard->numBuckets == 0) {
+    return NULL;
+  }
+  struct _cache_Entry *e = shard->buckets[hash[0] & (shard->numBuckets - 1)];
+  while (e && !_cache_matches(e, hash, eotSize, opts)) {
+    e = e->chain;
+  }
+  return e;
+}
+
+void _cache_unlinkLRU(struct _cache_Shard *shard, struct _cache_Entry *e)
+{
+  if (e->newer) {
+    e->newer->older = e->older;
+  } else {
+    shard->newest = e->older;
+  }
+  if (e->older) {
+    e->older->newer = e->newer;
+  } else {
+    shard->oldest = e->newer;
+  }
+}
+
+void _cache_pushLRU(struct _cache_Shard *shard, struct _cache_Entry *e)
+{
+  e->newer = NULL;
+  e->older = shard->newest;
+  if (shard->newest) {
+    shard->newest->newer = e;
+  } else {
+    shard->oldest = e;
+  }
+  shard->newest = e;
+}
+
+void _cache_evictOldest(struct _cache_Shard *shard)
+{
+  struct _cache_Entry *e = shard->oldest;
+  struct _cache_Entry **link =
+      &shard->buckets[e->hash[0] & (shard->numBuckets - 1)];
+  while (*link != e) {
+    link = &(*link)->chain;
+  }
+  *link = e->chain;
+  _cache_unlinkLRU(shard, e);
+  shard->bytes -= e->cost;
+  --shard->numEntries;
+  _cache_release(e);
+}
+
+/* Makes room for one more entry in the bucket table. Returns false if there
+ * is no table and none could be made. */
+bool _cache_grow(struct _cache_Shard *shard)
+{
+  if (shard->numEntries < shard->numBuckets) {
+    return true;
+  }
+  unsigned numBuckets = shard->numBuckets ? 2 * shard->numBuckets : 16;
+  struct _cache_Entry **buckets = (struct _cache_Entry **)calloc(
+      numBuckets, sizeof(struct _cache_Entry *));
+  if (!buckets) {
+    /* longer chains will do */
+    return shard->numBuckets != 0;
+  }
+  for (unsigned i = 0; i < shard->numBuckets; ++i) {
+    struct _cache_Entry *e = shard->buckets[i];
+    while (e) {
+      struct _cache_Entry *next = e->chain;
+      unsigned bucket = e->hash[0] & (numBuckets - 1);
+      e->chain = buckets[bucket];
+      buckets[bucket] = e;
+      e = next;
+    }
+  }
+  free(shard->buckets);
+  shard->buckets = buckets;
+  shard->numBuckets = numBuckets;
+  return true;
+}
+
+/* Adds e to the cache, unless another caller got there first, and returns
+ * the entry to hand out, with a reference for the caller. */
+struct _cache_Entry *_cache_insert(struct EOTCache *cache,
+                                   struct _cache_Shard *shard,
+                                   struct _cache_Entry *e,
+                                   const struct EOTConversionOptions *opts)
+{
+  pthread_mutex_lock(&shard->lock);
+  struct _cache_Entry *existing = _cache_find(shard, e->hash, e->eotSize, opts);
+  if (existing) {
+    __atomic_add_fetch(&existing->refs, 1, __ATOMIC_RELAXED);
+    _cache_unlinkLRU(shard, existing);
+    _cache_pushLRU(shard, existing);
+    pthread_mutex_unlock(&shard->lock);
+    free(e);
+    return existing;
+  }
+  if (e->cost <= cache->maxShardBytes && _cache_grow(shard)) {
+    while (shard->bytes + e->cost > cache->maxShardBytes) {
+      _cache_evictOldest(shard);
+    }
+    unsigned bucket = e->hash[0] & (shard->numBuckets - 1);
+    e->chain = shard->buckets[bucket];
+    shard->buckets[bucket] = e;
+    _cache_pushLRU(shard, e);
+    shard->bytes += e->cost;
+    ++shard->numEntries;
+    e->refs = 2;
+  }
+  pthread_mutex_unlock(&shard->lock);
+  return e;
+}
+
+/* Converts the font into a new entry, or returns NULL with the error in
+ * *resultOut. md is filled in either way. */
+struct _cache_Entry *_cache_convert(struct EOTContext *ctx,
+                                    const uint8_t *font, unsigned fontSize,
+                                    const struct EOTConversionOptions *opts,
+                                    const uint64_t hash[2],
+                                    struct EOTMetadata *md,
+                                    enum EOTError *resultOut)
+{
+  const struct EOTAllocator *alloc = opts ? opts->allocator : NULL;
+  uint8_t *converted = NULL;
+  unsigned size = 0;
+  struct _cache_Entry *e = NULL;
+  enum EOTError result =
+      fillConversionMetadata(font, fontSize, opts, false, md);
+  if (result != EOT_SUCCESS && result < EOT_WARN) {
+    goto CLEANUP;
+  }
+  enum EOTError writeResult = writeFontBuffer(
+      font + md->fontDataOffset, md->fontDataSize,
+      md->flags & TTEMBED_TTCOMPRESSED, md->flags & TTEMBED_XORENCRYPTDATA,
+      opts, ctx, &converted, &size);
+  if (writeResult != EOT_SUCCESS) {
+    result = writeResult;
+    if (result < EOT_WARN) {
+      goto CLEANUP;
+    }
+  }
+  unsigned numCodepoints = opts ? opts->numSubsetCodepoints : 0;
+  size_t fontBytes = ((size_t)size + 3) & ~(size_t)3;
+  size_t cost = sizeof(struct _cache_Entry) + fontBytes +
+                numCodepoints * sizeof(uint32_t);
+  e = (struct _cache_Entry *)malloc(cost);
+  if (!e) {
+    result = EOT_CANT_ALLOCATE_MEMORY;
+    goto CLEANUP;
+  }
+  memcpy(_cache_font(e), converted, size);
+  e->hash[0] = hash[0];
+  e->hash[1] = hash[1];
+  e->eotSize = fontSize;
+  e->generateVDMX = opts && opts->generateVDMX;
+  e->stripHinting = opts && opts->stripHinting;
+  e->numCodepoints = numCodepoints;
+  e->codepoints = NULL;
+  if (opts && opts->subsetCodepoints) {
+    uint32_t *codepoints = (uint32_t *)(_cache_font(e) + fontBytes);
+    memcpy(codepoints, opts->subsetCodepoints,
+           numCodepoints * sizeof(uint32_t));
+    e->codepoints = codepoints;
+  }
+  e->result = result;
+  e->chain = e->newer = e->older = NULL;
+  e->cost = cost;
+  e->refs = 1;
+  e->size = size;
+
+CLEANUP:
+  if (!ctx && converted) {
+    eotFree(alloc, converted);
+  }
+  *resultOut = result;
+  return e;
+}
+
+struct EOTCache *EOTcreateCache(size_t maxBytes)
+{
+  struct EOTCache *cache = (struct EOTCache *)calloc(1, sizeof(struct EOTCache));
+  if (!cache) {
+    return NULL;
+  }
+  _cache_seed(cache);
+  cache->maxShardBytes = maxBytes / CACHE_SHARDS;
+  for (unsigned i = 0; i < CACHE_SHARDS; ++i) {
+    pthread_mutex_init(&cache->shards[i].lock, NULL);
+  }
+  return cache;
+}
+
+void EOTfreeCache(struct EOTCache *cache)
+{
+  if (!cache) {
+    return;
+  }
+  for (unsigned i = 0; i < CACHE_SHARDS; ++i) {
+    struct _cache_Shard *shard = &cache->shards[i];
+    while (shard->oldest) {
+      _cache_evictOldest(shard);
+    }
+    free(shard->buckets);
+    pthread_mutex_destroy(&shard->lock);
+  }
+  free(cache);
+}
+
+enum EOTError EOT2ttf_cached(struct EOTCache *cache, struct EOTContext *ctx,
+                             const uint8_t *font, unsigned fontSize,
+                             const struct EOTConversionOptions *opts,
+                             struct EOTMetadata *metadataOut,
+                             const uint8_t **fontOut, unsigned *fontSizeOut)
+{
+  uint64_t hash[2];
+  sipHash128(cache->key, font, fontSize, hash);
+  struct _cache_Shard *shard = &cache->shards[hash[1] % CACHE_SHARDS];
+  enum EOTError result;
+  *fontOut = NULL;
+  *fontSizeOut = 0;
+
+  pthread_mutex_lock(&shard->lock);
+  struct _cache_Entry *e = _cache_find(shard, hash, fontSize, opts);
+  if (e) {
+    __atomic_add_fetch(&e->refs, 1, __ATOMIC_RELAXED);
+    _cache_unlinkLRU(shard, e);
+    _cache_pushLRU(shard, e);
+  }
+  pthread_mutex_unlock(&shard->lock);
+
+  if (e) {
+    /* the same warning as when the font was converted */
+    result = e->result;
+    if (metadataOut) {
+      enum EOTError mdResult =
+          fillConversionMetadata(font, fontSize, opts, false, metadataOut);
+      if (mdResult != EOT_SUCCESS && mdResult < EOT_WARN) {
+        _cache_release(e);
+        return mdResult;
+      }
+    }
+  } else {
+    struct EOTMetadata md;
+    e = _cache_convert(ctx, font, fontSize, opts, hash,
+                       metadataOut ? metadataOut : &md, &result);
+    if (!metadataOut) {
+      EOTfreeMetadata(&md);
+    }
+    if (!e) {
+      return result;
+    }
+    e = _cache_insert(cache, shard, e, opts);
+  }
+  *fontOut = _cache_font(e);
+  *fontSizeOut = e->size;
+  return result;
+}
+
+void EOTreleaseCachedFont(const uint8_t *font)
+{
+  if (font) {
+    _cache_release((struct _cache_Entry *)font - 1);
+  }
+}
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
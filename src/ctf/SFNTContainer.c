@@ -10,6 +10,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "../util/alloc.h"
+#include "../util/checksum.h"
 #include "../util/stream.h"
 
 enum EOTError reserveTables(struct SFNTContainer *ctr, unsigned num)
@@ -17,7 +19,8 @@ enum EOTError reserveTables(struct SFNTContainer *ctr, unsigned num)
   if (ctr->_numTablesReserved >= num) {
     return EOT_SUCCESS;
   }
-  void *allocated = realloc(ctr->tables, sizeof(struct SFNTTable) * num);
+  void *allocated =
+      eotRealloc(ctr->alloc, ctr->tables, sizeof(struct SFNTTable) * num);
   if (!allocated) {
     return EOT_CANT_ALLOCATE_MEMORY;
   }
@@ -26,56 +29,70 @@ enum EOTError reserveTables(struct SFNTContainer *ctr, unsigned num)
   return EOT_SUCCESS;
 }
 
-enum EOTError constructContainer(struct SFNTContainer **out)
+enum EOTError constructContainer(const struct EOTAllocator *alloc,
+                                 struct SFNTContainer **out)
 {
-  *out = (struct SFNTContainer *)malloc(sizeof(struct SFNTContainer));
-  if (!out) {
+  *out = (struct SFNTContainer *)eotMalloc(alloc, sizeof(struct SFNTContainer));
+  if (!*out) {
     return EOT_CANT_ALLOCATE_MEMORY;
   }
   (*out)->numTables = 0;
   (*out)->_numTablesReserved = 0;
   (*out)->tables = NULL;
+  (*out)->_layout = NULL;
+  (*out)->_layoutReserved = 0;
+  (*out)->alloc = alloc;
   return EOT_SUCCESS;
 }
 
 void _freeTable(struct SFNTTable *tbl)
 {
-  free(tbl->buf);
+  if (tbl->ownsBuf) {
+    eotFree(tbl->alloc, tbl->buf);
+  }
   tbl->buf = NULL;
+  tbl->ownsBuf = false;
 }
 
-void freeContainer(struct SFNTContainer *ctr)
+void setTableBuffer(struct SFNTTable *tbl, uint8_t *buf, unsigned bufSize)
+{
+  _freeTable(tbl);
+  tbl->buf = buf;
+  tbl->bufSize = bufSize;
+  tbl->ownsBuf = true;
+}
+
+void borrowTableBuffer(struct SFNTTable *tbl, uint8_t *buf, unsigned bufSize)
+{
+  _freeTable(tbl);
+  tbl->buf = buf;
+  tbl->bufSize = bufSize;
+}
+
+void clearContainer(struct SFNTContainer *ctr)
 {
   for (unsigned i = 0; i < ctr->numTables; ++i) {
     _freeTable(ctr->tables + i);
   }
-  free(ctr->tables);
-  free(ctr);
+  ctr->numTables = 0;
 }
 
-enum StreamResult _writeTblCheckingSum(struct SFNTTable *tbl,
-                                       struct Stream *out)
+void freeContainer(struct SFNTContainer *ctr)
+{
+  clearContainer(ctr);
+  eotFree(ctr->alloc, ctr->tables);
+  eotFree(ctr->alloc, ctr->_layout);
+  eotFree(ctr->alloc, ctr);
+}
+
+/* The only copy a table's bytes go through on their way to the output. */
+void _writeTblCheckingSum(struct SFNTTable *tbl, struct Stream *out)
 {
-  tbl->checksum = 0;
+  unsigned paddedSize = ((tbl->bufSize + 3) / 4) * 4;
   tbl->offset = out->pos;
-  struct Stream tblStream = constructStream(tbl->buf, tbl->bufSize);
-  enum StreamResult sResult = EOT_STREAM_OK;
-  enum StreamResult sResult2;
-  while (true) {
-    uint32_t chunk;
-    sResult = BEReadRestAsU32(&tblStream, &chunk);
-    if (sResult == EOT_STREAM_OK) {
-      tbl->checksum += chunk;
-      sResult2 = BEWriteU32(out, chunk);
-      CHK_RD(sResult2);
-    } else {
-      break;
-    }
-  }
-  if (sResult == EOT_NOT_ENOUGH_DATA) {
-    return EOT_STREAM_OK;
-  }
-  return sResult;
+  tbl->checksum = copyCheckSum32(out->buf + out->pos, tbl->buf, tbl->bufSize);
+  out->pos += paddedSize;
+  out->size = out->pos;
 }
 
 enum StreamResult _writeTableDirectory(struct SFNTContainer *ctr,
@@ -84,9 +101,7 @@ enum StreamResult _writeTableDirectory(struct SFNTContainer *ctr,
   enum StreamResult sResult;
   for (unsigned i = 0; i < ctr->numTables; ++i) {
     struct SFNTTable *tbl = &ctr->tables[i];
-    for (unsigned iTag = 0; iTag < 4; ++iTag) {
-      RD(BEWriteU8, out, (char)(tbl->tag[iTag]), sResult);
-    }
+    RD(BEWriteU32, out, tbl->tag, sResult);
     RD(BEWriteU32, out, tbl->checksum, sResult);
     RD(BEWriteU32, out, tbl->offset, sResult);
     RD(BEWriteU32, out, tbl->bufSize, sResult);
@@ -138,7 +153,7 @@ unsigned _getTableDirectorySize(struct SFNTContainer *ctr)
   return 16 * ctr->numTables;
 }
 
-unsigned _getRequiredSize(struct SFNTContainer *ctr)
+unsigned getContainerSize(struct SFNTContainer *ctr)
 {
   unsigned ret = 12; /* for offset table */
   ret += _getTableDirectorySize(ctr);
@@ -149,16 +164,121 @@ unsigned _getRequiredSize(struct SFNTContainer *ctr)
   return ret;
 }
 
+/* Where a table goes in the file: the load order recommended for TrueType
+ * fonts, except that glyf comes last. Tables not listed go between cvt and
+ * loca. */
+unsigned _tableRank(uint32_t tag)
+{
+  switch (tag) {
+  case SFNT_TAG('h', 'e', 'a', 'd'):
+    return 0;
+  case SFNT_TAG('h', 'h', 'e', 'a'):
+    return 1;
+  case SFNT_TAG('m', 'a', 'x', 'p'):
+    return 2;
+  case SFNT_TAG('O', 'S', '/', '2'):
+    return 3;
+  case SFNT_TAG('h', 'm', 't', 'x'):
+    return 4;
+  case SFNT_TAG('L', 'T', 'S', 'H'):
+    return 5;
+  case SFNT_TAG('V', 'D', 'M', 'X'):
+    return 6;
+  case SFNT_TAG('h', 'd', 'm', 'x'):
+    return 7;
+  case SFNT_TAG('c', 'm', 'a', 'p'):
+    return 8;
+  case SFNT_TAG('f', 'p', 'g', 'm'):
+    return 9;
+  case SFNT_TAG('p', 'r', 'e', 'p'):
+    return 10;
+  case SFNT_TAG('c', 'v', 't', ' '):
+    return 11;
+  case SFNT_TAG('l', 'o', 'c', 'a'):
+    return 13;
+  case SFNT_TAG('g', 'l', 'y', 'f'):
+    return 14;
+  default:
+    return 12;
+  }
+}
+
+int _compareTags(const void *a, const void *b)
+{
+  uint32_t tagA = ((const struct SFNTTable *)a)->tag;
+  uint32_t tagB = ((const struct SFNTTable *)b)->tag;
+  return (tagA > tagB) - (tagA < tagB);
+}
+
+/* qsort has no context argument, hence the indirection through pointers. */
+int _compareLayout(const void *a, const void *b)
+{
+  const struct SFNTTable *tblA = *(const struct SFNTTable *const *)a;
+  const struct SFNTTable *tblB = *(const struct SFNTTable *const *)b;
+  unsigned rankA = _tableRank(tblA->tag), rankB = _tableRank(tblB->tag);
+  if (rankA != rankB) {
+    return (rankA > rankB) - (rankA < rankB);
+  }
+  return _compareTags(tblA, tblB);
+}
+
+/* Sorts the tables by tag, which is the order the directory must be in for
+ * its binary search, and returns them in the order their data is laid out.
+ * The returned array belongs to the container. */
+enum EOTError _layoutTables(struct SFNTContainer *ctr,
+                            struct SFNTTable ***layoutOut)
+{
+  qsort(ctr->tables, ctr->numTables, sizeof(struct SFNTTable), _compareTags);
+  if (ctr->_layoutReserved < ctr->numTables || !ctr->_layout) {
+    unsigned num = ctr->numTables ? ctr->numTables : 1;
+    void *allocated =
+        eotRealloc(ctr->alloc, ctr->_layout, sizeof(struct SFNTTable *) * num);
+    if (!allocated) {
+      return EOT_CANT_ALLOCATE_MEMORY;
+    }
+    ctr->_layout = (struct SFNTTable **)allocated;
+    ctr->_layoutReserved = num;
+  }
+  struct SFNTTable **layout = ctr->_layout;
+  for (unsigned i = 0; i < ctr->numTables; ++i) {
+    layout[i] = &ctr->tables[i];
+  }
+  qsort(layout, ctr->numTables, sizeof(struct SFNTTable *), _compareLayout);
+  *layoutOut = layout;
+  return EOT_SUCCESS;
+}
+
 enum EOTError dumpContainer(struct SFNTContainer *ctr, uint8_t **outBuf,
                             unsigned *outSize)
 {
-  struct Stream s = constructStream(NULL, 0);
-  unsigned requiredSize = _getRequiredSize(ctr);
+  uint8_t *buf = NULL;
+  unsigned bufSize = 0;
+  enum EOTError result = dumpContainerInto(ctr, &buf, &bufSize, outSize);
+  if (result != EOT_SUCCESS) {
+    eotFree(ctr->alloc, buf);
+    return result;
+  }
+  *outBuf = buf;
+  return EOT_SUCCESS;
+}
+
+enum EOTError dumpContainerInto(struct SFNTContainer *ctr, uint8_t **buf,
+                                unsigned *bufSize, unsigned *outSize)
+{
+  struct Stream s = constructStream2(*buf, 0, *bufSize);
+  s.alloc = ctr->alloc;
+  struct SFNTTable **layout = NULL;
+  unsigned requiredSize = getContainerSize(ctr);
   enum StreamResult sResult = reserve(&s, requiredSize);
+  enum EOTError returnedStatus = EOT_SUCCESS;
   if (sResult != EOT_STREAM_OK) {
-    return EOT_CANT_ALLOCATE_MEMORY;
+    returnedStatus = EOT_CANT_ALLOCATE_MEMORY;
+    goto CLEANUP;
+  }
+  returnedStatus = _layoutTables(ctr, &layout);
+  if (returnedStatus != EOT_SUCCESS) {
+    goto CLEANUP;
   }
-  enum EOTError returnedStatus = EOT_SUCCESS;
   sResult = _writeOffsetTable(ctr, &s);
   CHK_CN(sResult, EOT_LOGIC_ERROR);
   unsigned tableDirectoryOffset = s.pos;
@@ -167,46 +287,127 @@ enum EOTError dumpContainer(struct SFNTContainer *ctr, uint8_t **outBuf,
   struct SFNTTable *head = NULL;
   unsigned chk = 0;
   for (unsigned i = 0; i < ctr->numTables; ++i) {
-    struct SFNTTable *tbl = &ctr->tables[i];
-    if (strncmp(tbl->tag, "head", 4) == 0) {
+    struct SFNTTable *tbl = layout[i];
+    if (tbl->tag == SFNT_TAG('h', 'e', 'a', 'd')) {
       head = tbl;
     }
-    tbl->offset = s.pos;
-    sResult = _writeTblCheckingSum(tbl, &s);
-    CHK_CN(sResult, EOT_LOGIC_ERROR);
+    _writeTblCheckingSum(tbl, &s);
     chk += tbl->checksum;
   }
-  if (head == NULL) {
+  if (head == NULL || head->bufSize < 12) {
     returnedStatus = EOT_LOGIC_ERROR; /* should have already caught the lack
                                          of a head table! */
     goto CLEANUP;
   }
+  unsigned endPos = s.pos;
   seekAbsolute(&s, tableDirectoryOffset);
   sResult = _writeTableDirectory(ctr, &s);
   CHK_CN(sResult, EOT_LOGIC_ERROR);
-  unsigned beginningChk;
-  sResult = BEcheckSum32(&s, &beginningChk, 0, s.pos);
-  CHK_CN(sResult, EOT_LOGIC_ERROR);
-  chk += beginningChk;
-  /* now put in the global checksum. It's OK that this will make the head
-   * checksum incorrect! */
+  chk += checkSum32(s.buf, s.pos);
+  /* now put in the global checksum, straight into the output so that the head
+   * table keeps the checksum it had with checkSumAdjustment zeroed. */
   /* this mystical number 0xB1B0AFBA is defined by the TTF standard, dunno why
    * they picked this value. */
   unsigned finalChecksum = 0xB1B0AFBA - chk;
-  struct Stream sChkOut = constructStream(head->buf, head->bufSize);
-  sResult = seekAbsolute(&sChkOut, 8);
+  sResult = seekAbsolute(&s, head->offset + 8);
+  CHK_CN(sResult, EOT_LOGIC_ERROR);
+  sResult = BEWriteU32(&s, finalChecksum);
+  CHK_CN(sResult, EOT_LOGIC_ERROR);
+  returnedStatus = EOT_SUCCESS;
+  *outSize = endPos;
+CLEANUP:
+  *buf = s.buf;
+  *bufSize = s.reserved;
+  return returnedStatus;
+}
+
+enum EOTError dumpContainerToBuffer(struct SFNTContainer *ctr, uint8_t *buf,
+                                    unsigned bufSize, unsigned *outSize)
+{
+  if (bufSize < getContainerSize(ctr)) {
+    *outSize = getContainerSize(ctr);
+    return EOT_BUFFER_TOO_SMALL;
+  }
+  /* there is room, so dumpContainerInto won't try to grow buf */
+  return dumpContainerInto(ctr, &buf, &bufSize, outSize);
+}
+
+enum EOTError dumpContainerToSink(struct SFNTContainer *ctr, SFNTWriteFn write,
+                                  void *userData)
+{
+  static const uint8_t padding[3] = {0, 0, 0};
+  /* the header, each table and its padding, and two more for splitting the
+   * checkSumAdjustment out of head */
+  unsigned maxChunks = 1 + 2 * ctr->numTables + 2;
+  unsigned headerSize = 12 + _getTableDirectorySize(ctr);
+  struct Stream sHeader = constructStream(NULL, 0);
+  sHeader.alloc = ctr->alloc;
+  struct SFNTTable **layout = NULL;
+  struct SFNTChunk *chunks = (struct SFNTChunk *)eotMalloc(
+      ctr->alloc, sizeof(struct SFNTChunk) * maxChunks);
+  enum EOTError returnedStatus = EOT_SUCCESS;
+  if (!chunks || reserve(&sHeader, headerSize) != EOT_STREAM_OK) {
+    returnedStatus = EOT_CANT_ALLOCATE_MEMORY;
+    goto CLEANUP;
+  }
+  returnedStatus = _layoutTables(ctr, &layout);
+  if (returnedStatus != EOT_SUCCESS) {
+    goto CLEANUP;
+  }
+  /* lay the tables out first: the directory comes before any of them */
+  struct SFNTTable *head = NULL;
+  unsigned offset = headerSize;
+  unsigned chk = 0;
+  for (unsigned i = 0; i < ctr->numTables; ++i) {
+    struct SFNTTable *tbl = layout[i];
+    if (tbl->tag == SFNT_TAG('h', 'e', 'a', 'd')) {
+      head = tbl;
+    }
+    tbl->offset = offset;
+    tbl->checksum = checkSum32(tbl->buf, tbl->bufSize);
+    chk += tbl->checksum;
+    offset += ((tbl->bufSize + 3) / 4) * 4;
+  }
+  if (head == NULL || head->bufSize < 12) {
+    returnedStatus = EOT_LOGIC_ERROR;
+    goto CLEANUP;
+  }
+  enum StreamResult sResult = _writeOffsetTable(ctr, &sHeader);
   CHK_CN(sResult, EOT_LOGIC_ERROR);
-  sResult = BEWriteU32(&sChkOut, finalChecksum);
+  sResult = _writeTableDirectory(ctr, &sHeader);
   CHK_CN(sResult, EOT_LOGIC_ERROR);
+  chk += checkSum32(sHeader.buf, sHeader.pos);
+  uint8_t adjustment[4];
+  struct Stream sAdjustment = constructStream2(adjustment, 0, 4);
+  BEWriteU32(&sAdjustment, 0xB1B0AFBA - chk);
+  unsigned numChunks = 0;
+  chunks[numChunks++] = (struct SFNTChunk){sHeader.buf, sHeader.pos};
+  for (unsigned i = 0; i < ctr->numTables; ++i) {
+    struct SFNTTable *tbl = layout[i];
+    if (tbl == head) {
+      /* the head table itself keeps a zero checkSumAdjustment */
+      chunks[numChunks++] = (struct SFNTChunk){tbl->buf, 8};
+      chunks[numChunks++] = (struct SFNTChunk){adjustment, 4};
+      chunks[numChunks++] = (struct SFNTChunk){tbl->buf + 12, tbl->bufSize - 12};
+    } else {
+      chunks[numChunks++] = (struct SFNTChunk){tbl->buf, tbl->bufSize};
+    }
+    if (tbl->bufSize % 4) {
+      chunks[numChunks++] = (struct SFNTChunk){padding, 4 - tbl->bufSize % 4};
+    }
+  }
+  if (!write(userData, chunks, numChunks)) {
+    returnedStatus = EOT_FWRITE_ERROR;
+    goto CLEANUP;
+  }
   returnedStatus = EOT_SUCCESS;
-  *outBuf = s.buf;
-  *outSize = s.size;
 CLEANUP:
-  /* lmao */
+  eotFree(ctr->alloc, sHeader.buf);
+  eotFree(ctr->alloc, chunks);
   return returnedStatus;
 }
 
-enum EOTError addTable(struct SFNTContainer *ctr, const char *tag,
+enum EOTError addTable(struct SFNTContainer *ctr, uint32_t tag,
                        struct SFNTTable **newTableOut)
 {
   if (ctr->numTables == ctr->_numTablesReserved) {
@@ -216,27 +417,31 @@ enum EOTError addTable(struct SFNTContainer *ctr, const char *tag,
     }
   }
   struct SFNTTable *tbl = &ctr->tables[ctr->numTables++];
-  for (unsigned i = 0; i < 4; ++i) {
-    tbl->tag[i] = tag[i];
-  }
+  tbl->tag = tag;
   tbl->buf = NULL;
   tbl->bufSize = 0;
   tbl->offset = 0;
+  tbl->ownsBuf = false;
+  tbl->alloc = ctr->alloc;
   *newTableOut = tbl;
   return EOT_SUCCESS;
 }
 
-#define CHK_RD2(sRes)                                                          \
-  if (sRes != EOT_STREAM_OK)                                                   \
-  return EOT_CORRUPT_FILE
+void removeTable(struct SFNTContainer *ctr, struct SFNTTable *tbl)
+{
+  unsigned index = (unsigned)(tbl - ctr->tables);
+  _freeTable(tbl);
+  memmove(tbl, tbl + 1, sizeof(struct SFNTTable) * (ctr->numTables - index - 1));
+  --ctr->numTables;
+}
+
 enum EOTError loadTableFromStream(struct SFNTTable *tbl, struct Stream *s)
 {
-  enum StreamResult sResult = seekAbsolute(s, tbl->offset);
-  CHK_RD2(sResult);
-  tbl->buf = (uint8_t *)malloc(tbl->bufSize);
-  struct Stream sOut = constructStream2(tbl->buf, 0, tbl->bufSize);
-  sResult = streamCopy(s, &sOut, tbl->bufSize);
-  CHK_RD2(sResult);
+  if (tbl->offset > s->size || tbl->bufSize > s->size - tbl->offset) {
+    return EOT_CORRUPT_FILE;
+  }
+  _freeTable(tbl);
+  tbl->buf = s->buf + tbl->offset;
   return EOT_SUCCESS;
 }
 
@@ -7,31 +7,89 @@
 #define __LIBEOT_SFNT_CONTAINER_H__
 
 #include <libeot/libeot.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "../util/stream.h"
 
+/* Tags are kept as big-endian 32-bit values, so that they compare (and sort)
+ * as integers. */
+#define SFNT_TAG(a, b, c, d)                                                   \
+  (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) |      \
+   (uint32_t)(d))
+
 struct SFNTTable {
-  char tag[4];
+  uint32_t tag;
   uint8_t *buf;
   unsigned bufSize;
   unsigned offset;
   unsigned checksum;
+  /* false if buf is borrowed from the stream the table was loaded from */
+  bool ownsBuf;
+  /* the container's allocator, which an owned buf goes back to */
+  const struct EOTAllocator *alloc;
+};
+
+/* A piece of the output font, as handed to an SFNTWriteFn. */
+struct SFNTChunk {
+  const uint8_t *data;
+  unsigned size;
 };
 
+/* Receives consecutive pieces of the output font; returns false on failure.
+ * The chunks are only valid for the duration of the call. */
+typedef bool (*SFNTWriteFn)(void *userData, const struct SFNTChunk *chunks,
+                            unsigned numChunks);
+
 struct SFNTContainer {
   unsigned numTables;
   unsigned _numTablesReserved;
   struct SFNTTable *tables;
+  /* the tables in output order, kept around for the next dump */
+  struct SFNTTable **_layout;
+  unsigned _layoutReserved;
+  const struct EOTAllocator *alloc;
 };
 
-enum EOTError constructContainer(struct SFNTContainer **out);
+/* Everything the container allocates, including the buffers its tables own
+ * and the output of dumpContainer, comes from alloc. */
+enum EOTError constructContainer(const struct EOTAllocator *alloc,
+                                 struct SFNTContainer **out);
 enum EOTError reserveTables(struct SFNTContainer *ctr, unsigned num);
+/* Removes all the tables, but keeps the memory for holding them. */
+void clearContainer(struct SFNTContainer *ctr);
 void freeContainer(struct SFNTContainer *ctr);
-enum EOTError addTable(struct SFNTContainer *ctr, const char *tag,
+enum EOTError addTable(struct SFNTContainer *ctr, uint32_t tag,
                        struct SFNTTable **newTableOut);
+/* The table takes ownership of buf, which must come from the container's
+ * allocator, releasing any buffer it owned before. */
+void setTableBuffer(struct SFNTTable *tbl, uint8_t *buf, unsigned bufSize);
+/* The table borrows buf, which must outlive the container. */
+void borrowTableBuffer(struct SFNTTable *tbl, uint8_t *buf, unsigned bufSize);
+/* Pointers to tables after the removed one are invalidated. */
+void removeTable(struct SFNTContainer *ctr, struct SFNTTable *tbl);
+/* The table borrows its bytes from s, which must outlive the container. */
 enum EOTError loadTableFromStream(struct SFNTTable *tbl, struct Stream *s);
+/* The exact size of the font dumpContainer would produce. */
+unsigned getContainerSize(struct SFNTContainer *ctr);
+/* The table directory is sorted by tag, and the table data follows the
+ * recommended TrueType load order with glyf last. Both of these reorder
+ * ctr->tables. */
 enum EOTError dumpContainer(struct SFNTContainer *ctr, uint8_t **outBuf,
                             unsigned *outSize);
+/* Like dumpContainer, but writes into *buf, which has room for *bufSize bytes
+ * and is grown as needed, so it must come from the container's allocator.
+ * *buf stays the caller's even on failure. */
+enum EOTError dumpContainerInto(struct SFNTContainer *ctr, uint8_t **buf,
+                                unsigned *bufSize, unsigned *outSize);
+/* Like dumpContainer, but writes into buf, which has room for bufSize bytes.
+ * If that is not enough, returns EOT_BUFFER_TOO_SMALL with the size needed in
+ * *outSize. */
+enum EOTError dumpContainerToBuffer(struct SFNTContainer *ctr, uint8_t *buf,
+                                    unsigned bufSize, unsigned *outSize);
+/* Like dumpContainer, but hands the tables to write straight from their
+ * buffers instead of assembling the font in memory first. */
+enum EOTError dumpContainerToSink(struct SFNTContainer *ctr, SFNTWriteFn write,
+                                  void *userData);
 
 #endif /* #define __LIBEOT_SFNT_CONTAINER_H__ */
@@ -3,6 +3,8 @@
  * version 2.0. For full details, see the file LICENSE
  */
 
+#include "parseCTF.h"
+
 #include <libeot/libeot.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -10,7 +12,7 @@
 #include <string.h>
 
 #include "../triplet_encodings.h"
-#include "../util/logging.h"
+#include "../util/alloc.h"
 #include "../util/max.h"
 #include "../util/stream.h"
 #include "SFNTContainer.h"
@@ -35,12 +37,201 @@ enum StreamResult parseOffsetTable(struct Stream *s,
   RD(BEReadU16, s, &tbl->rangeShift, res);
   return EOT_STREAM_OK;
 }
-/*
-enum EOTError populateHdmx(struct SFNTTable *hdmx, struct TTFmaxpData
-*maxpData, struct TTFheadData *headData, struct TTFhmtxData *hmtxData, struct
-Stream *s)
+
+/* Largest |width - predicted width| the CTF hdmx encoding can express. */
+#define HDMX_MAX_DELTA 16
+
+/* Device widths in CTF are stored as the difference from the width a
+ * rasterizer would give the unhinted glyph: '0' for no difference, otherwise
+ * |delta| one bits, a zero bit and a sign bit (set for negative deltas). */
+enum StreamResult _hdmx_readDelta(struct Stream *s, int *out)
+{
+  enum StreamResult sResult;
+  uint32_t bit;
+  unsigned magnitude = 0;
+  while (true) {
+    sResult = readNBits(s, &bit, 1);
+    CHK_RD(sResult);
+    if (!bit) {
+      break;
+    }
+    if (++magnitude > HDMX_MAX_DELTA) {
+      return EOT_VALUE_OUT_OF_BOUNDS;
+    }
+  }
+  *out = 0;
+  if (magnitude > 0) {
+    sResult = readNBits(s, &bit, 1);
+    CHK_RD(sResult);
+    *out = bit ? -(int)magnitude : (int)magnitude;
+  }
+  return EOT_STREAM_OK;
+}
+
+/* Predicted widths for one ppem: the advance width scaled to 26.6 fixed
+ * point and then rounded to whole pixels. ppem is a byte, so 64 * ppem times
+ * a 16-bit advance fits in 32 bits. */
+void _hdmx_predictRow(const uint16_t *advanceWidths, unsigned numGlyphs,
+                      uint8_t ppem, unsigned unitsPerEm, int32_t *out)
+{
+  const uint32_t scale = 64 * (uint32_t)ppem;
+  const uint32_t half = unitsPerEm / 2;
+  for (unsigned i = 0; i < numGlyphs; ++i) {
+    uint32_t scaled = (scale * advanceWidths[i] + half) / unitsPerEm;
+    out[i] = (int32_t)((scaled + 32) >> 6);
+  }
+}
+
+/* http://www.w3.org/Submission/MTX/#hdmx */
+enum EOTError populateHdmx(struct SFNTTable *hdmx,
+                           struct TTFmaxpData *maxpData,
+                           struct TTFheadData *headData,
+                           struct TTFhmtxData *hmtxData, struct Stream *s)
+{
+  enum StreamResult sResult = seekAbsolute(s, hdmx->offset);
+  CHK_RD2(sResult);
+  uint16_t version;
+  int16_t numRecords;
+  int32_t recordSize;
+  RD2(BEReadU16, s, &version, sResult);
+  RD2(BEReadS16, s, &numRecords, sResult);
+  RD2(BEReadS32, s, &recordSize, sResult);
+  unsigned numGlyphs = maxpData->numGlyphs;
+  /* records are padded to a multiple of 4 bytes */
+  if (numRecords < 0 || recordSize < 2 + (int32_t)numGlyphs ||
+      recordSize > 2 + (int32_t)numGlyphs + 3 || headData->unitsPerEm == 0) {
+    return EOT_CORRUPT_FILE;
+  }
+  unsigned tableSize = 8 + (unsigned)numRecords * (unsigned)recordSize;
+  uint8_t *buf = (uint8_t *)eotCalloc(hdmx->alloc, tableSize, 1);
+  int32_t *predicted = (int32_t *)eotMalloc(
+      hdmx->alloc, sizeof(int32_t) * (numGlyphs + 1));
+  enum EOTError returnedStatus;
+  if (!buf || !predicted) {
+    returnedStatus = EOT_CANT_ALLOCATE_MEMORY;
+    goto CLEANUP;
+  }
+  struct Stream sOut = constructStream2(buf, 0, tableSize);
+  sResult = BEWriteU16(&sOut, version);
+  CHK_CN(sResult, EOT_LOGIC_ERROR);
+  sResult = BEWriteS16(&sOut, numRecords);
+  CHK_CN(sResult, EOT_LOGIC_ERROR);
+  sResult = BEWriteU32(&sOut, (uint32_t)recordSize);
+  CHK_CN(sResult, EOT_LOGIC_ERROR);
+  for (unsigned i = 0; i < (unsigned)numRecords; ++i) {
+    sResult = seekAbsoluteThroughReserve(&sOut, 8 + i * recordSize);
+    CHK_CN(sResult, EOT_LOGIC_ERROR);
+    sResult = streamCopy(s, &sOut, 2); /* pixelSize, maxWidth */
+    CHK_CN(sResult, EOT_CORRUPT_FILE);
+  }
+  for (unsigned i = 0; i < (unsigned)numRecords; ++i) {
+    uint8_t *record = buf + 8 + i * recordSize;
+    _hdmx_predictRow(hmtxData->advanceWidths, numGlyphs, record[0],
+                     headData->unitsPerEm, predicted);
+    uint8_t *widths = record + 2;
+    for (unsigned j = 0; j < numGlyphs; ++j) {
+      int delta;
+      sResult = _hdmx_readDelta(s, &delta);
+      CHK_CN(sResult, EOT_CORRUPT_FILE);
+      int width = predicted[j] + delta;
+      widths[j] = (uint8_t)(width < 0 ? 0 : (width > 255 ? 255 : width));
+    }
+  }
+  setTableBuffer(hdmx, buf, tableSize);
+  buf = NULL;
+  returnedStatus = EOT_SUCCESS;
+CLEANUP:
+  eotFree(hdmx->alloc, buf);
+  eotFree(hdmx->alloc, predicted);
+  return returnedStatus;
+}
+
+/* Parses what populateHdmx needs and rebuilds hdmx from it. */
+enum EOTError _reconstructHdmx(struct SFNTTable *hdmx, struct SFNTTable *hhea,
+                               struct SFNTTable *hmtx,
+                               struct TTFmaxpData *maxpData,
+                               struct TTFheadData *headData, struct Stream *s,
+                               const struct EOTAllocator *alloc)
 {
-}*/
+  if (!hhea) {
+    return EOT_NO_HHEA_TABLE;
+  }
+  struct TTFhheaData hheaData;
+  enum EOTError result = TTFParseHhea(hhea, &hheaData);
+  if (result != EOT_SUCCESS) {
+    return result;
+  }
+  struct TTFhmtxData hmtxData;
+  result = TTFParseHmtx(hmtx, &hheaData, maxpData, alloc, &hmtxData);
+  if (result != EOT_SUCCESS) {
+    return result;
+  }
+  result = populateHdmx(hdmx, maxpData, headData, &hmtxData, s);
+  TTFFreeHmtx(&hmtxData);
+  return result;
+}
+
+/* Vertical extremes over the glyph bounding boxes, used to synthesise VDMX. */
+struct CTFGlyfExtents {
+  bool any;
+  int16_t yMin;
+  int16_t yMax;
+};
+
+#define VDMX_FIRST_PPEM 8
+#define VDMX_LAST_PPEM 255
+
+int16_t _vdmx_clamp(int32_t v)
+{
+  return (int16_t)(v < INT16_MIN ? INT16_MIN : (v > INT16_MAX ? INT16_MAX : v));
+}
+
+/* Fills in a VDMX table with a single group covering every aspect ratio. The
+ * extents are the font-wide ones scaled to each ppem, rounded outwards, which
+ * is what a rasterizer would get from the unhinted outlines. */
+enum EOTError generateVdmx(struct SFNTTable *vdmx, struct TTFheadData *headData,
+                           const struct CTFGlyfExtents *extents)
+{
+  const unsigned numEntries = VDMX_LAST_PPEM - VDMX_FIRST_PPEM + 1;
+  const unsigned groupOffset = 6 + 4 + 2;
+  unsigned tableSize = groupOffset + 4 + 6 * numEntries;
+  int32_t upem = headData->unitsPerEm;
+  if (upem == 0) {
+    return EOT_CORRUPT_FILE;
+  }
+  uint8_t *buf = (uint8_t *)eotMalloc(vdmx->alloc, tableSize);
+  if (!buf) {
+    return EOT_CANT_ALLOCATE_MEMORY;
+  }
+  struct Stream sOut = constructStream2(buf, 0, tableSize);
+  BEWriteU16(&sOut, 1); /* version */
+  BEWriteU16(&sOut, 1); /* numRecs */
+  BEWriteU16(&sOut, 1); /* numRatios */
+  BEWriteU8(&sOut, 0);  /* bCharSet: the extents cover all glyphs */
+  /* xRatio, yStartRatio and yEndRatio of 0 match every aspect ratio */
+  for (unsigned i = 0; i < 3; ++i) {
+    BEWriteU8(&sOut, 0);
+  }
+  BEWriteU16(&sOut, groupOffset);
+  BEWriteU16(&sOut, numEntries);
+  BEWriteU8(&sOut, VDMX_FIRST_PPEM);
+  BEWriteU8(&sOut, VDMX_LAST_PPEM);
+  for (int32_t ppem = VDMX_FIRST_PPEM; ppem <= VDMX_LAST_PPEM; ++ppem) {
+    int32_t top = extents->yMax * ppem, bottom = extents->yMin * ppem;
+    int32_t yMax = top / upem, yMin = bottom / upem;
+    if (top % upem > 0) {
+      ++yMax;
+    }
+    if (bottom % upem < 0) {
+      --yMin;
+    }
+    BEWriteU16(&sOut, (uint16_t)ppem);
+    BEWriteS16(&sOut, _vdmx_clamp(yMax));
+    BEWriteS16(&sOut, _vdmx_clamp(yMin));
+  }
+  setTableBuffer(vdmx, buf, tableSize);
+  return EOT_SUCCESS;
+}
 
 enum StreamResult _ucvt_rdVal(struct Stream *sIn, int16_t *lastValue)
 {
@@ -78,6 +269,7 @@ enum EOTError unpackCVT(struct SFNTTable *out, struct Stream *sIn)
   uint16_t tableLength;
   RD2(BEReadU16, sIn, &tableLength, sResult);
   struct Stream sOut = constructStream(NULL, 0);
+  sOut.alloc = out->alloc;
   sResult = reserve(&sOut, tableLength * sizeof(int16_t));
   CHK_RD2(sResult);
   int16_t lastValue = 0;
@@ -89,8 +281,7 @@ enum EOTError unpackCVT(struct SFNTTable *out, struct Stream *sIn)
       return EOT_LOGIC_ERROR;
     }
   }
-  out->buf = sOut.buf;
-  out->bufSize = sOut.size;
+  setTableBuffer(out, sOut.buf, sOut.size);
   return EOT_SUCCESS;
 }
 
@@ -153,164 +344,187 @@ enum StreamResult read255Short(struct Stream *sIn, int16_t *out)
   return EOT_STREAM_OK;
 }
 
-/* This enum and the following functions prefaced by _dpi_ should only be used
- * by the decodePushInstructions function */
-enum _dpi_TypeRead { BYTE, SHORT };
-
-enum StreamResult _dpi_dump(struct Stream *out, enum _dpi_TypeRead *lastRead,
-                            unsigned *typeLastReadCount, int16_t *data,
-                            unsigned *dataIndex)
-{
-  enum StreamResult sResult;
 #define NPUSHB 0x40
 #define NPUSHW 0x41
 #define PUSHB 0xB0
 #define PUSHW 0xB8
-  if (*typeLastReadCount > 0) {
-    /* write stuff out */
-    if (*typeLastReadCount < 8) {
-      uint8_t op = ((*lastRead == BYTE) ? PUSHB : PUSHW) |
-                   (uint8_t)(*typeLastReadCount - 1);
-      sResult = BEWriteU8(out, op);
-      CHK_RD(sResult);
-    } else {
-      uint8_t op = (*lastRead == BYTE) ? NPUSHB : NPUSHW;
-      sResult = BEWriteU8(out, op);
-      CHK_RD(sResult);
-      sResult = BEWriteU8(out, (uint8_t)*typeLastReadCount);
-      CHK_RD(sResult);
-    }
-    for (unsigned i = 0; i < *typeLastReadCount; ++i) {
-      if (*lastRead == BYTE) {
-        sResult = BEWriteU8(
-            out, (uint8_t)(data[*dataIndex - *typeLastReadCount + i]));
-        CHK_RD(sResult);
-      } else {
-        sResult = BEWriteS16(out, data[*dataIndex - *typeLastReadCount + i]);
-        CHK_RD(sResult);
-      }
-    }
+
+/* This struct and the following functions prefaced by _dpi_ should only be
+ * used by the decodePushInstructions function. The values are written straight
+ * into the output as they are decoded; since the length of a run is only known
+ * once it ends, room for the longest (NPUSHx n) header is left in front of it
+ * and filled in when the run is closed. The output is only ever appended to. */
+struct _dpi_Run {
+  unsigned start; /* position of the reserved header */
+  unsigned count;
+  bool words;
+  int16_t history[2]; /* the last two values pushed, most recent last */
+  unsigned numPushed;
+};
+
+void _dpi_close(struct Stream *out, struct _dpi_Run *run)
+{
+  uint8_t *header = out->buf + run->start;
+  if (run->count == 0) {
+    return;
+  }
+  if (run->count < 8) {
+    /* one-byte PUSHB/PUSHW header: slide the values back over the spare byte */
+    unsigned dataSize = out->pos - (run->start + 2);
+    header[0] = (run->words ? PUSHW : PUSHB) | (uint8_t)(run->count - 1);
+    memmove(header + 1, header + 2, dataSize);
+    --out->pos;
+    out->size = out->pos;
+  } else {
+    header[0] = run->words ? NPUSHW : NPUSHB;
+    header[1] = (uint8_t)run->count;
   }
+  run->count = 0;
+}
+
+enum StreamResult _dpi_put(struct Stream *out, struct _dpi_Run *run,
+                           int16_t value)
+{
+  bool word = !(value >= 0 && value < 256);
+  if (run->count > 0 && (word != run->words || run->count == 255)) {
+    _dpi_close(out, run);
+  }
+  unsigned needed = (run->count == 0 ? 2 : 0) + (word ? 2 : 1);
+  if (out->pos + needed > out->reserved) {
+    return EOT_OUT_OF_RESERVED_SPACE;
+  }
+  if (run->count == 0) {
+    run->start = out->pos;
+    run->words = word;
+    out->pos += 2;
+  }
+  if (word) {
+    out->buf[out->pos++] = (uint8_t)((uint16_t)value >> 8);
+  }
+  out->buf[out->pos++] = (uint8_t)value;
+  out->size = out->pos;
+  ++run->count;
+  run->history[0] = run->history[1];
+  run->history[1] = value;
+  ++run->numPushed;
   return EOT_STREAM_OK;
 }
 
-enum StreamResult _dpi_put(int16_t value, struct Stream *out,
-                           enum _dpi_TypeRead *lastRead,
-                           unsigned *typeLastReadCount, int16_t *data,
-                           unsigned *dataIndex)
+/* Same as read255Short, but straight from a buffer so that a batch of values
+ * can be decoded without going through the stream for every byte. */
+bool _dpi_read255Short(const uint8_t *buf, unsigned size, unsigned *pos,
+                       int16_t *out)
 {
-  enum StreamResult sResult;
-  enum _dpi_TypeRead newType = (value >= 0 && value < 256) ? BYTE : SHORT;
-  if (newType != *lastRead || *typeLastReadCount == 255) {
-    sResult = _dpi_dump(out, lastRead, typeLastReadCount, data, dataIndex);
-    if (sResult != EOT_STREAM_OK) {
-      return sResult;
+  unsigned p = *pos;
+  if (p >= size) {
+    return false;
+  }
+  uint8_t code = buf[p++];
+  if (code == 253) {
+    if (p + 2 > size) {
+      return false;
     }
-    *lastRead = newType;
-    *typeLastReadCount = 0;
+    *out = (int16_t)((buf[p] << 8) | buf[p + 1]);
+    *pos = p + 2;
+    return true;
   }
-  data[(*dataIndex)++] = value;
-  ++*typeLastReadCount;
-  return EOT_STREAM_OK;
+  int sign = 1;
+  if (code == 250) {
+    if (p >= size) {
+      return false;
+    }
+    sign = -1;
+    code = buf[p++];
+  }
+  int value = code;
+  if (code == 255 || code == 254) {
+    if (p >= size) {
+      return false;
+    }
+    value = (code == 255 ? 250 : 250 * 2) + buf[p++];
+  }
+  *out = (int16_t)(sign * value);
+  *pos = p;
+  return true;
 }
 
 /* http://www.w3.org/Submission/MTX/#HopCodes */
 enum EOTError decodePushInstructions(struct Stream *sIn, struct Stream *sOut,
                                      unsigned pushCount)
 {
-  enum StreamResult sResult;
+  const uint8_t *in = sIn->buf;
+  unsigned pos = sIn->pos;
   unsigned remaining = pushCount;
-  enum _dpi_TypeRead typeLastRead =
-      BYTE; /* doesn't actually matter what this is initialized to since it
-               will just get reset with no effect if the first thing is a
-               short */
-  unsigned typeLastReadCount = 0;
-  unsigned dataIndex = 0;
-  int16_t *data = (int16_t *)malloc(sizeof(int16_t) * pushCount);
-  enum EOTError returnedStatus;
-  if (!data) {
-    return EOT_CANT_ALLOCATE_MEMORY;
-  }
+  struct _dpi_Run run = {0};
+  int16_t val;
   while (remaining) {
-    uint8_t code;
-    sResult = BEPeekU8(sIn, &code);
-    CHK_CN(sResult, EOT_SECOND_STREAM_INCOMPLETE);
-    int16_t val, prev;
-    switch (code) {
-    case 0xFB:
-      /* A B 0xFB C -> A B A C A */
-      if (remaining < 3) {
-        returnedStatus = EOT_CORRUPT_HOPCODE_DATA;
-        goto CLEANUP;
+    if (pos >= sIn->size) {
+      return EOT_SECOND_STREAM_INCOMPLETE;
+    }
+    uint8_t code = in[pos];
+    if (code == 0xFB || code == 0xFC) {
+      /* A B 0xFB C -> A B A C A
+       * A B 0xFC C D -> A B A C A D A */
+      unsigned hops = (code == 0xFB) ? 1 : 2;
+      if (remaining < 2 * hops + 1 || run.numPushed < 2) {
+        return EOT_CORRUPT_HOPCODE_DATA;
       }
-      remaining -= 3;
-      if (dataIndex < 2) {
-        returnedStatus = EOT_CORRUPT_HOPCODE_DATA;
-        goto CLEANUP;
+      remaining -= 2 * hops + 1;
+      ++pos;
+      int16_t prev = run.history[0];
+      if (_dpi_put(sOut, &run, prev) != EOT_STREAM_OK) {
+        return EOT_LOGIC_ERROR;
       }
-      prev = data[dataIndex - 2];
-      BEReadU8(sIn, &code);
-      sResult = _dpi_put(prev, sOut, &typeLastRead, &typeLastReadCount, data,
-                         &dataIndex);
-      CHK_CN(sResult, EOT_SECOND_STREAM_INCOMPLETE);
-      sResult = read255Short(sIn, &val);
-      CHK_CN(sResult, EOT_SECOND_STREAM_INCOMPLETE);
-      sResult = _dpi_put(val, sOut, &typeLastRead, &typeLastReadCount, data,
-                         &dataIndex);
-      CHK_CN(sResult, EOT_SECOND_STREAM_INCOMPLETE);
-      sResult = _dpi_put(prev, sOut, &typeLastRead, &typeLastReadCount, data,
-                         &dataIndex);
-      CHK_CN(sResult, EOT_SECOND_STREAM_INCOMPLETE);
-      break;
-    case 0xFC:
-      /* A B 0xFB C D -> A B A C A D A */
-      if (remaining < 5) {
-        returnedStatus = EOT_CORRUPT_HOPCODE_DATA;
-        goto CLEANUP;
+      for (unsigned i = 0; i < hops; ++i) {
+        if (!_dpi_read255Short(in, sIn->size, &pos, &val)) {
+          return EOT_SECOND_STREAM_INCOMPLETE;
+        }
+        if (_dpi_put(sOut, &run, val) != EOT_STREAM_OK ||
+            _dpi_put(sOut, &run, prev) != EOT_STREAM_OK) {
+          return EOT_LOGIC_ERROR;
+        }
       }
-      remaining -= 5;
-      if (dataIndex < 2) {
-        returnedStatus = EOT_CORRUPT_HOPCODE_DATA;
-        goto CLEANUP;
+      continue;
+    }
+    /* a batch of plain values, up to the next hop code */
+    while (remaining && pos < sIn->size && in[pos] != 0xFB &&
+           in[pos] != 0xFC) {
+      if (!_dpi_read255Short(in, sIn->size, &pos, &val)) {
+        return EOT_SECOND_STREAM_INCOMPLETE;
+      }
+      if (_dpi_put(sOut, &run, val) != EOT_STREAM_OK) {
+        return EOT_LOGIC_ERROR;
       }
-      prev = data[dataIndex - 2];
-      BEReadU8(sIn, &code);
-      sResult = _dpi_put(prev, sOut, &typeLastRead, &typeLastReadCount, data,
-                         &dataIndex);
-      CHK_CN(sResult, EOT_SECOND_STREAM_INCOMPLETE);
-      sResult = read255Short(sIn, &val);
-      CHK_CN(sResult, EOT_SECOND_STREAM_INCOMPLETE);
-      sResult = _dpi_put(val, sOut, &typeLastRead, &typeLastReadCount, data,
-                         &dataIndex);
-      CHK_CN(sResult, EOT_SECOND_STREAM_INCOMPLETE);
-      sResult = _dpi_put(prev, sOut, &typeLastRead, &typeLastReadCount, data,
-                         &dataIndex);
-      CHK_CN(sResult, EOT_SECOND_STREAM_INCOMPLETE);
-      sResult = read255Short(sIn, &val);
-      CHK_CN(sResult, EOT_SECOND_STREAM_INCOMPLETE);
-      sResult = _dpi_put(val, sOut, &typeLastRead, &typeLastReadCount, data,
-                         &dataIndex);
-      CHK_CN(sResult, EOT_SECOND_STREAM_INCOMPLETE);
-      sResult = _dpi_put(prev, sOut, &typeLastRead, &typeLastReadCount, data,
-                         &dataIndex);
-      CHK_CN(sResult, EOT_SECOND_STREAM_INCOMPLETE);
-      break;
-    default:
-      sResult = read255Short(sIn, &val);
-      CHK_CN(sResult, EOT_SECOND_STREAM_INCOMPLETE);
-      sResult = _dpi_put(val, sOut, &typeLastRead, &typeLastReadCount, data,
-                         &dataIndex);
       --remaining;
-      break;
     }
   }
-  sResult =
-      _dpi_dump(sOut, &typeLastRead, &typeLastReadCount, data, &dataIndex);
-  CHK_CN(sResult, EOT_SECOND_STREAM_INCOMPLETE);
-  returnedStatus = EOT_SUCCESS;
-CLEANUP:
-  free(data);
-  return returnedStatus;
+  _dpi_close(sOut, &run);
+  sIn->pos = pos;
+  return EOT_SUCCESS;
+}
+
+/* Decodes the instructions of a glyph from the push and code streams. Those
+ * are NULL when hinting is being stripped; the counts are then just consumed
+ * and nothing is written. */
+enum EOTError _decodeInstructions(struct Stream **streams, struct Stream *out)
+{
+  enum StreamResult sResult;
+  uint16_t pushCount, codeSize;
+  /* decode the push instructions for the glyph */
+  RD2(read255UShort, streams[0], &pushCount, sResult);
+  if (streams[1]) {
+    enum EOTError result = decodePushInstructions(streams[1], out, pushCount);
+    if (result != EOT_SUCCESS && result < EOT_WARN) {
+      return result;
+    }
+  }
+  /* copy over the rest of the instructions for the glyph */
+  RD2(read255UShort, streams[0], &codeSize, sResult);
+  if (streams[2]) {
+    sResult = streamCopy(streams[2], out, codeSize);
+    CHK_RD2(sResult);
+  }
+  return EOT_SUCCESS;
 }
 
 uint8_t _dsg_makeFlags(int16_t x, int16_t y, bool onCurve, bool firstTime)
@@ -346,7 +560,36 @@ uint8_t _dsg_makeFlags(int16_t x, int16_t y, bool onCurve, bool firstTime)
   }
   return ret;
 }
+/* Makes room for the points of a glyph with numPoints points. */
+enum EOTError _reservePoints(struct CTFScratch *scratch, unsigned numPoints)
+{
+  if (scratch->pointCapacity >= numPoints) {
+    return EOT_SUCCESS;
+  }
+  uint8_t *flags = (uint8_t *)eotRealloc(scratch->alloc, scratch->flags,
+                                         numPoints);
+  if (flags) {
+    scratch->flags = flags;
+  }
+  int16_t *xCoords = (int16_t *)eotRealloc(scratch->alloc, scratch->xCoords,
+                                           numPoints * sizeof(int16_t));
+  if (xCoords) {
+    scratch->xCoords = xCoords;
+  }
+  int16_t *yCoords = (int16_t *)eotRealloc(scratch->alloc, scratch->yCoords,
+                                           numPoints * sizeof(int16_t));
+  if (yCoords) {
+    scratch->yCoords = yCoords;
+  }
+  if (!flags || !xCoords || !yCoords) {
+    return EOT_CANT_ALLOCATE_MEMORY;
+  }
+  scratch->pointCapacity = numPoints;
+  return EOT_SUCCESS;
+}
+
 enum EOTError decodeSimpleGlyph(int16_t numContours, struct Stream **streams,
+                                struct CTFScratch *scratch,
                                 struct Stream *out, bool calculateBoundingBox,
                                 int16_t minX, int16_t minY, int16_t maxX,
                                 int16_t maxY)
@@ -380,15 +623,12 @@ enum EOTError decodeSimpleGlyph(int16_t numContours, struct Stream **streams,
     totalPoints += pointsInContour;
     RD2(BEWriteS16, out, totalPoints - 1, sResult);
   }
-  uint8_t *flags = NULL;
-  int16_t *xCoords = NULL, *yCoords = NULL;
-  flags = (uint8_t *)malloc(totalPoints * sizeof(uint8_t));
-  xCoords = (int16_t *)malloc(totalPoints * sizeof(int16_t));
-  yCoords = (int16_t *)malloc(totalPoints * sizeof(int16_t));
-  if (!flags || !xCoords || !yCoords) {
-    returnedStatus = EOT_CANT_ALLOCATE_MEMORY;
-    goto CLEANUP;
+  returnedStatus = _reservePoints(scratch, totalPoints);
+  if (returnedStatus != EOT_SUCCESS) {
+    return returnedStatus;
   }
+  uint8_t *flags = scratch->flags;
+  int16_t *xCoords = scratch->xCoords, *yCoords = scratch->yCoords;
   /* Read X-Y coordinates in shitty format described here:
    * http://www.w3.org/Submission/MTX/#TripletEncoding First flags and then
    * actual coordinates. */
@@ -431,21 +671,11 @@ enum EOTError decodeSimpleGlyph(int16_t numContours, struct Stream **streams,
   unsigned codeSizeLocation = out->pos;
   sResult = seekRelativeThroughReserve(out, sizeof(uint16_t));
   CHK_CN(sResult, EOT_CORRUPT_FILE);
-  /* decode the push instructions for the glyph */
-  uint16_t pushCount;
-  sResult = read255UShort(in, &pushCount);
-  CHK_CN(sResult, EOT_CORRUPT_FILE);
-  enum EOTError result = decodePushInstructions(streams[1], out, pushCount);
-  if (result != EOT_SUCCESS && result < EOT_WARN) {
+  enum EOTError result = _decodeInstructions(streams, out);
+  if (result != EOT_SUCCESS) {
     returnedStatus = result;
     goto CLEANUP;
   }
-  /* copy over the rest of the instructions for the glyph */
-  uint16_t codeSize;
-  sResult = read255UShort(in, &codeSize);
-  CHK_CN(sResult, EOT_CORRUPT_FILE);
-  sResult = streamCopy(streams[2], out, codeSize);
-  CHK_CN(sResult, EOT_CORRUPT_FILE);
   /* the below will be zero if we didn't go through the if (numContours > 0)
    * block. */
   unsigned unpackedCodeSize = out->pos - (codeSizeLocation + sizeof(uint16_t));
@@ -504,17 +734,28 @@ enum EOTError decodeSimpleGlyph(int16_t numContours, struct Stream **streams,
   }
   returnedStatus = EOT_SUCCESS;
 CLEANUP:
-  free(flags);
-  free(xCoords);
-  free(yCoords);
   return returnedStatus;
 }
 
+/* composite glyph component flags */
+const uint16_t FLG_ARGS_WORDS = 0x1, FLG_HAVE_SCALE = 0x8,
+               FLG_MORE_COMPONENTS = 0x20, FLG_HAVE_XY_SCALE = 0x40,
+               FLG_HAVE_2_BY_2 = 0x80, FLG_HAVE_INSTR = 0x100;
+
+unsigned _cg_transformBytes(uint16_t flags)
+{
+  if (flags & FLG_HAVE_2_BY_2) {
+    return 8;
+  } else if (flags & FLG_HAVE_XY_SCALE) {
+    return 4;
+  } else if (flags & FLG_HAVE_SCALE) {
+    return 2;
+  }
+  return 0;
+}
+
 enum EOTError decodeCompositeGlyph(struct Stream **streams, struct Stream *out)
 {
-  const uint16_t FLG_ARGS_WORDS = 0x1, FLG_HAVE_SCALE = 0x8,
-                 FLG_MORE_COMPONENTS = 0x20, FLG_HAVE_XY_SCALE = 0x40,
-                 FLG_HAVE_2_BY_2 = 0x80, FLG_HAVE_INSTR = 0x100;
   /* we don't need to interpret very much here, just the flags to know how much
    * to pass along into the output. */
   struct Stream *in = streams[0];
@@ -540,15 +781,7 @@ enum EOTError decodeCompositeGlyph(struct Stream **streams, struct Stream *out)
     unsigned argsLength = (flags & FLG_ARGS_WORDS) ? 4 : 2;
     sResult = streamCopy(in, out, argsLength);
     CHK_RD2(sResult);
-    unsigned transformBytes = 0;
-    if (flags & FLG_HAVE_2_BY_2) {
-      transformBytes = 8;
-    } else if (flags & FLG_HAVE_XY_SCALE) {
-      transformBytes = 4;
-    } else if (flags & FLG_HAVE_SCALE) {
-      transformBytes = 2;
-    }
-    sResult = streamCopy(in, out, transformBytes);
+    sResult = streamCopy(in, out, _cg_transformBytes(flags));
     CHK_RD2(sResult);
   } while (flags & FLG_MORE_COMPONENTS);
   if (flags & FLG_HAVE_INSTR) {
@@ -560,37 +793,26 @@ enum EOTError decodeCompositeGlyph(struct Stream **streams, struct Stream *out)
     unsigned numInstrLocation = out->pos;
     sResult = seekRelativeThroughReserve(out, sizeof(uint16_t));
     CHK_RD2(sResult);
-    
-    /* decode the push instructions for the glyph */
-    uint16_t pushCount;
-    sResult = read255UShort(in, &pushCount);
-    CHK_RD2(sResult);
-    enum EOTError result = decodePushInstructions(streams[1], out, pushCount);
-    if (result != EOT_SUCCESS && result < EOT_WARN) {
+
+    enum EOTError result = _decodeInstructions(streams, out);
+    if (result != EOT_SUCCESS) {
       return result;
     }
-    /* copy over the rest of the instructions for the glyph */
-    uint16_t codeSize;
-    sResult = read255UShort(in, &codeSize);
-    CHK_RD2(sResult);
-    sResult = streamCopy(streams[2], out, codeSize);
-    CHK_RD2(sResult);
 
+    /* always patched: the reserved bytes are not initialised */
     numInstr = out->pos - (numInstrLocation + sizeof(uint16_t));
-    if (numInstr > 0){
-      unsigned currPos = out->pos;
-      sResult = seekAbsoluteThroughReserve(out, numInstrLocation);
-      CHK_RD2(sResult);
-      RD2(BEWriteU16, out, (uint16_t)numInstr, sResult);
-      CHK_RD2(sResult);
-      sResult = seekAbsoluteThroughReserve(out, currPos);
-      CHK_RD2(sResult);
-    }
+    unsigned currPos = out->pos;
+    sResult = seekAbsoluteThroughReserve(out, numInstrLocation);
+    CHK_RD2(sResult);
+    RD2(BEWriteU16, out, (uint16_t)numInstr, sResult);
+    sResult = seekAbsoluteThroughReserve(out, currPos);
+    CHK_RD2(sResult);
   }
   return EOT_SUCCESS;
 }
 
-enum EOTError decodeGlyph(struct Stream **streams, struct Stream *out)
+enum EOTError decodeGlyph(struct Stream **streams, struct CTFScratch *scratch,
+                          struct Stream *out)
 {
   struct Stream *in = streams[0];
   int16_t numContours, xMin = 0, yMin = 0, xMax = 0, yMax = 0;
@@ -615,8 +837,8 @@ enum EOTError decodeGlyph(struct Stream **streams, struct Stream *out)
       calculateBoundingBox = true;
     }
     enum EOTError result =
-        decodeSimpleGlyph(numContours, streams, out, calculateBoundingBox, xMin,
-                          yMin, xMax, yMax);
+        decodeSimpleGlyph(numContours, streams, scratch, out,
+                          calculateBoundingBox, xMin, yMin, xMax, yMax);
     if (result != EOT_SUCCESS && result < EOT_WARN) {
       return result;
     }
@@ -624,13 +846,182 @@ enum EOTError decodeGlyph(struct Stream **streams, struct Stream *out)
   return EOT_SUCCESS;
 }
 
+/* The functions below walk the CTF streams exactly like decodeGlyph does, but
+ * without producing any output. They are used to find where each glyph starts
+ * when only some of the glyphs are going to be reconstructed. */
+enum EOTError skipPushInstructions(struct Stream *sIn, unsigned pushCount)
+{
+  enum StreamResult sResult;
+  unsigned remaining = pushCount;
+  int16_t val;
+  while (remaining) {
+    uint8_t code;
+    RD2(BEPeekU8, sIn, &code, sResult);
+    unsigned values = 1, encoded = 1;
+    if (code == 0xFB || code == 0xFC) {
+      values = (code == 0xFB) ? 3 : 5;
+      encoded = (code == 0xFB) ? 1 : 2;
+      seekRelative(sIn, 1);
+    }
+    if (remaining < values) {
+      return EOT_CORRUPT_HOPCODE_DATA;
+    }
+    remaining -= values;
+    for (unsigned i = 0; i < encoded; ++i) {
+      sResult = read255Short(sIn, &val);
+      if (sResult != EOT_STREAM_OK) {
+        return EOT_SECOND_STREAM_INCOMPLETE;
+      }
+    }
+  }
+  return EOT_SUCCESS;
+}
+
+enum EOTError _skipInstructions(struct Stream **streams)
+{
+  enum StreamResult sResult;
+  uint16_t pushCount, codeSize;
+  RD2(read255UShort, streams[0], &pushCount, sResult);
+  if (streams[1]) {
+    enum EOTError result = skipPushInstructions(streams[1], pushCount);
+    if (result != EOT_SUCCESS) {
+      return result;
+    }
+  }
+  RD2(read255UShort, streams[0], &codeSize, sResult);
+  if (streams[2] && seekRelative(streams[2], codeSize) != EOT_STREAM_OK) {
+    return EOT_THIRD_STREAM_INCOMPLETE;
+  }
+  return EOT_SUCCESS;
+}
+
+/* Walks the component records of a composite glyph, leaving the stream just
+ * past them and the flags of the last component in lastFlags. If keep is
+ * non-NULL, components not yet kept are marked and pushed onto pending. */
+enum EOTError _walkComponents(struct Stream *in, uint16_t *lastFlags,
+                              bool *keep, unsigned numGlyphs,
+                              uint16_t *pending, unsigned *numPending)
+{
+  enum StreamResult sResult;
+  uint16_t flags, glyphIndex;
+  do {
+    RD2(BEReadU16, in, &flags, sResult);
+    RD2(BEReadU16, in, &glyphIndex, sResult);
+    if (keep && glyphIndex < numGlyphs && !keep[glyphIndex]) {
+      keep[glyphIndex] = true;
+      pending[(*numPending)++] = glyphIndex;
+    }
+    unsigned argsLength = (flags & FLG_ARGS_WORDS) ? 4 : 2;
+    sResult = seekRelative(in, argsLength + _cg_transformBytes(flags));
+    CHK_RD2(sResult);
+  } while (flags & FLG_MORE_COMPONENTS);
+  *lastFlags = flags;
+  return EOT_SUCCESS;
+}
+
+enum EOTError skipGlyph(struct Stream **streams)
+{
+  struct Stream *in = streams[0];
+  enum StreamResult sResult;
+  enum EOTError result;
+  int16_t numContours;
+  RD2(BEReadS16, in, &numContours, sResult);
+  if (numContours < 0) {
+    uint16_t flags;
+    sResult = seekRelative(in, 4 * sizeof(int16_t));
+    CHK_RD2(sResult);
+    result = _walkComponents(in, &flags, NULL, 0, NULL, NULL);
+    if (result != EOT_SUCCESS) {
+      return result;
+    }
+    if (!(flags & FLG_HAVE_INSTR)) {
+      return EOT_SUCCESS;
+    }
+    return _skipInstructions(streams);
+  }
+  if (numContours == 0x7FFF) {
+    RD2(BEReadS16, in, &numContours, sResult);
+    sResult = seekRelative(in, 4 * sizeof(int16_t));
+    CHK_RD2(sResult);
+  }
+  if (numContours == 0) {
+    return EOT_SUCCESS;
+  }
+  unsigned totalPoints = 1;
+  for (unsigned i = 0; i < (unsigned)numContours; ++i) {
+    uint16_t pointsInContour;
+    RD2(read255UShort, in, &pointsInContour, sResult);
+    totalPoints += pointsInContour;
+  }
+  if (in->pos + totalPoints > in->size) {
+    return EOT_CORRUPT_FILE;
+  }
+  unsigned coordBytes = 0;
+  for (unsigned i = 0; i < totalPoints; ++i) {
+    coordBytes += tripletEncodings[in->buf[in->pos + i] & 0x7F].byteCount - 1;
+  }
+  sResult = seekRelative(in, totalPoints + coordBytes);
+  CHK_RD2(sResult);
+  return _skipInstructions(streams);
+}
+
+/* Positions of a glyph's data in each of the three CTF streams. */
+struct CTFGlyphPos {
+  unsigned pos[3];
+};
+
+/* Adds every glyph reachable through composite components from the glyphs
+ * already in keep. */
+enum EOTError _computeGlyphClosure(struct Stream *sCTF,
+                                   const struct CTFGlyphPos *positions,
+                                   bool *keep, unsigned numGlyphs,
+                                   const struct EOTAllocator *alloc)
+{
+  enum StreamResult sResult;
+  enum EOTError result = EOT_SUCCESS;
+  uint16_t *pending =
+      (uint16_t *)eotMalloc(alloc, sizeof(uint16_t) * numGlyphs);
+  if (!pending) {
+    return EOT_CANT_ALLOCATE_MEMORY;
+  }
+  unsigned numPending = 0;
+  for (unsigned i = 0; i < numGlyphs; ++i) {
+    if (keep[i]) {
+      pending[numPending++] = (uint16_t)i;
+    }
+  }
+  while (numPending && result == EOT_SUCCESS) {
+    unsigned glyph = pending[--numPending];
+    int16_t numContours;
+    uint16_t flags;
+    sResult = seekAbsolute(sCTF, positions[glyph].pos[0]);
+    if (sResult == EOT_STREAM_OK) {
+      sResult = BEReadS16(sCTF, &numContours);
+    }
+    if (sResult != EOT_STREAM_OK) {
+      result = EOT_CORRUPT_FILE;
+    } else if (numContours < 0) {
+      if (seekRelative(sCTF, 4 * sizeof(int16_t)) != EOT_STREAM_OK) {
+        result = EOT_CORRUPT_FILE;
+      } else {
+        result = _walkComponents(sCTF, &flags, keep, numGlyphs, pending,
+                                 &numPending);
+      }
+    }
+  }
+  eotFree(alloc, pending);
+  return result;
+}
+
 /* https://developer.apple.com/fonts/TTRefMan/RM06/Chap6glyf.html
  * http://www.w3.org/Submission/MTX/#CTFGlyph */
 enum EOTError populateGlyfAndLoca(struct SFNTTable *glyf,
                                   struct SFNTTable *loca,
                                   struct TTFheadData *headData,
                                   struct TTFmaxpData *maxpData,
-                                  struct Stream **streams)
+                                  struct Stream **streams, bool *keep,
+                                  struct CTFGlyfExtents *extents,
+                                  struct CTFScratch *scratch)
 {
   struct Stream *sCTF = streams[0];
   enum StreamResult sResult = seekAbsolute(sCTF, glyf->offset);
@@ -639,17 +1030,56 @@ enum EOTError populateGlyfAndLoca(struct SFNTTable *glyf,
   }
   bool overranAllocatedSpace = false;
   bool notEnoughGlyphs = false;
-  seekAbsolute(streams[1], 0);
-  seekAbsolute(streams[2], 0);
+  for (unsigned j = 1; j < 3; ++j) {
+    if (streams[j]) {
+      seekAbsolute(streams[j], 0);
+    }
+  }
+  /* When subsetting, find where every glyph starts first: glyphs are only
+   * delimited by decoding them, and composites may refer to any glyph. */
+  struct CTFGlyphPos *positions = NULL;
+  unsigned numKept = maxpData->numGlyphs;
+  if (keep) {
+    positions = (struct CTFGlyphPos *)eotMalloc(
+        scratch->alloc, sizeof(struct CTFGlyphPos) * maxpData->numGlyphs);
+    if (!positions) {
+      return EOT_CANT_ALLOCATE_MEMORY;
+    }
+    enum EOTError result = EOT_SUCCESS;
+    for (unsigned i = 0; i < maxpData->numGlyphs && result == EOT_SUCCESS;
+         ++i) {
+      for (unsigned j = 0; j < 3; ++j) {
+        positions[i].pos[j] = streams[j] ? streams[j]->pos : 0;
+      }
+      result = skipGlyph(streams);
+    }
+    if (result == EOT_SUCCESS) {
+      result = _computeGlyphClosure(sCTF, positions, keep, maxpData->numGlyphs,
+                                    scratch->alloc);
+    }
+    if (result != EOT_SUCCESS) {
+      eotFree(scratch->alloc, positions);
+      return result;
+    }
+    numKept = 0;
+    for (unsigned i = 0; i < maxpData->numGlyphs; ++i) {
+      numKept += keep[i];
+    }
+  }
   unsigned maxSimpleGlyphSize = 10 + 2 * maxpData->maxContours + 2 +
                                 maxpData->maxSizeOfInstructions +
                                 maxpData->maxPoints * 5;
   unsigned maxCompoundGlyphSize = 26 + maxpData->maxSizeOfInstructions;
   unsigned maxGlyphSize = umax(maxSimpleGlyphSize, maxCompoundGlyphSize);
-  unsigned maxTableSize = maxpData->numGlyphs * maxGlyphSize;
-  struct Stream sOut = constructStream(NULL, 0);
+  unsigned maxTableSize = numKept * maxGlyphSize;
+  /* both are built in the scratch, and lent to the tables from there */
+  struct Stream sOut =
+      constructStream2(scratch->glyf.buf, 0, scratch->glyf.reserved);
+  sOut.alloc = scratch->alloc;
   reserve(&sOut, maxTableSize);
-  struct Stream sLocaOut = constructStream(NULL, 0);
+  struct Stream sLocaOut =
+      constructStream2(scratch->loca.buf, 0, scratch->loca.reserved);
+  sLocaOut.alloc = scratch->alloc;
   bool shortLoca = !(headData->indexToLocFormat);
   if (shortLoca) {
     reserve(&sLocaOut, 2 * (maxpData->numGlyphs + 1));
@@ -659,14 +1089,44 @@ enum EOTError populateGlyfAndLoca(struct SFNTTable *glyf,
     BEWriteU32(&sLocaOut, 0);
   }
   for (unsigned i = 0; i < maxpData->numGlyphs; ++i) {
-    // decode a glyph outline
-    enum EOTError result = decodeGlyph(streams, &sOut);
-    if (result != EOT_SUCCESS) {
-      return result;
-    }
-    /* do padding */
-    if (sOut.pos % 2) {
-      BEWriteU8(&sOut, 0);
+    if (keep && !keep[i]) {
+      /* leave the glyph empty; its loca entry repeats the previous offset */
+    } else {
+      if (positions) {
+        for (unsigned j = 0; j < 3; ++j) {
+          if (streams[j]) {
+            seekAbsolute(streams[j], positions[i].pos[j]);
+          }
+        }
+      }
+      // decode a glyph outline
+      unsigned glyphStart = sOut.pos;
+      enum EOTError result = decodeGlyph(streams, scratch, &sOut);
+      if (result != EOT_SUCCESS) {
+        eotFree(scratch->alloc, positions);
+        scratch->glyf = sOut;
+        scratch->loca = sLocaOut;
+        return result;
+      }
+      if (extents && sOut.pos >= glyphStart + 10) {
+        /* the glyph header now holds its (possibly computed) bounding box */
+        struct Stream sBox = constructStream(sOut.buf + glyphStart + 4, 6);
+        int16_t yMin, yMax;
+        BEReadS16(&sBox, &yMin);
+        seekRelative(&sBox, 2);
+        BEReadS16(&sBox, &yMax);
+        if (!extents->any || yMin < extents->yMin) {
+          extents->yMin = yMin;
+        }
+        if (!extents->any || yMax > extents->yMax) {
+          extents->yMax = yMax;
+        }
+        extents->any = true;
+      }
+      /* do padding */
+      if (sOut.pos % 2) {
+        BEWriteU8(&sOut, 0);
+      }
     }
     /* add an entry to the location table */
     if (shortLoca) {
@@ -675,10 +1135,11 @@ enum EOTError populateGlyfAndLoca(struct SFNTTable *glyf,
       BEWriteU32(&sLocaOut, sOut.pos);
     }
   }
-  glyf->buf = sOut.buf;
-  glyf->bufSize = sOut.size;
-  loca->buf = sLocaOut.buf;
-  loca->bufSize = sLocaOut.size;
+  eotFree(scratch->alloc, positions);
+  scratch->glyf = sOut;
+  scratch->loca = sLocaOut;
+  borrowTableBuffer(glyf, sOut.buf, sOut.size);
+  borrowTableBuffer(loca, sLocaOut.buf, sLocaOut.size);
   if (notEnoughGlyphs) {
     return EOT_WARN_NOT_ENOUGH_GLYPHS;
   }
@@ -688,33 +1149,101 @@ enum EOTError populateGlyfAndLoca(struct SFNTTable *glyf,
   return EOT_SUCCESS;
 }
 
-enum EOTError parseCTF(struct Stream **streams, struct SFNTContainer **out)
+/* Marks the glyphs that the requested codepoints map to, plus .notdef. The
+ * composite closure is taken later, once glyph positions are known. */
+enum EOTError _markSubsetGlyphs(struct SFNTTable *cmap, unsigned numGlyphs,
+                                const struct EOTConversionOptions *opts,
+                                const struct EOTAllocator *alloc,
+                                bool **keepOut)
 {
-  *out = NULL;
-  enum EOTError result = constructContainer(out);
+  struct TTFcmapData cmapData;
+  enum EOTError result = TTFParseCmap(cmap, &cmapData);
+  if (result != EOT_SUCCESS) {
+    return result;
+  }
+  bool *keep =
+      (bool *)eotCalloc(alloc, numGlyphs ? numGlyphs : 1, sizeof(bool));
+  if (!keep) {
+    return EOT_CANT_ALLOCATE_MEMORY;
+  }
+  if (numGlyphs > 0) {
+    keep[0] = true;
+  }
+  for (unsigned i = 0; i < opts->numSubsetCodepoints; ++i) {
+    uint16_t glyph = TTFcmapLookup(&cmapData, opts->subsetCodepoints[i]);
+    if (glyph < numGlyphs) {
+      keep[glyph] = true;
+    }
+  }
+  *keepOut = keep;
+  return EOT_SUCCESS;
+}
+
+/* Tables that are of no use once the glyph instructions are gone. */
+bool _isHintingTable(uint32_t tag)
+{
+  switch (tag) {
+  case SFNT_TAG('f', 'p', 'g', 'm'):
+  case SFNT_TAG('p', 'r', 'e', 'p'):
+  case SFNT_TAG('c', 'v', 't', ' '):
+  case SFNT_TAG('h', 'd', 'm', 'x'):
+  case SFNT_TAG('L', 'T', 'S', 'H'):
+    return true;
+  default:
+    return false;
+  }
+}
+
+void freeCTFScratch(struct CTFScratch *scratch)
+{
+  eotFree(scratch->alloc, scratch->flags);
+  eotFree(scratch->alloc, scratch->xCoords);
+  eotFree(scratch->alloc, scratch->yCoords);
+  eotFree(scratch->alloc, scratch->glyf.buf);
+  eotFree(scratch->alloc, scratch->loca.buf);
+  if (scratch->ctr) {
+    freeContainer(scratch->ctr);
+  }
+  *scratch = (struct CTFScratch){0};
+}
+
+enum EOTError _parseCTF(struct Stream **streams,
+                        const struct EOTConversionOptions *opts,
+                        struct CTFScratch *scratch, struct SFNTContainer **out)
+{
+  enum EOTError result;
+  if (scratch->ctr) {
+    clearContainer(scratch->ctr);
+  } else {
+    result = constructContainer(scratch->alloc, &scratch->ctr);
+    if (result != EOT_SUCCESS) {
+      return result;
+    }
+  }
+  *out = scratch->ctr;
   struct SFNTOffsetTable offsetTable;
   enum StreamResult sResult = parseOffsetTable(streams[0], &offsetTable);
   if (sResult != EOT_STREAM_OK) {
     return EOT_CORRUPT_FILE;
   }
-  result = reserveTables(*out, offsetTable.numTables);
+  /* leave room for a loca table, so that adding one later doesn't move the
+   * tables we hold pointers to */
+  result = reserveTables(*out, offsetTable.numTables + 1);
   if (result != EOT_SUCCESS) {
     return result;
   }
   for (unsigned i = 0; i < offsetTable.numTables; ++i) {
-    char tag[4];
-    for (unsigned j = 0; j < 4; ++j) {
-      RD2(BEReadChar, streams[0], tag + j, sResult);
-    }
+    uint32_t tag;
+    RD2(BEReadU32, streams[0], &tag, sResult);
     struct SFNTTable *tbl;
-    // TO-DO: Fix hdmx|VDMX table
-    if (strncmp(tag, "hdmx", 4) == 0 || strncmp(tag, "VDMX", 4) == 0 ) {
-      // skip checkSum, offset, length to next table offset
+    if (opts && opts->stripHinting && _isHintingTable(tag)) {
+      /* skip checkSum, offset, length to next table offset */
       sResult = seekRelative(streams[0], 12);
-      logWarning("Ignoring hdmx/VDMX table -- will be fixed in a future release.\n");
+      if (sResult != EOT_STREAM_OK) {
+        return EOT_CORRUPT_FILE;
+      }
       continue;
     }
-    
     result = addTable(*out, tag, &tbl);
     /* skip the checksum, which we are not using for now. */
     sResult = seekRelative(streams[0], 4);
@@ -725,42 +1254,57 @@ enum EOTError parseCTF(struct Stream **streams, struct SFNTContainer **out)
     RD2(BEReadU32, streams[0], &tbl->bufSize, sResult);
   }
   struct SFNTTable *glyf = NULL, *loca = NULL, *maxp = NULL, *head = NULL,
-  *hmtx = NULL;
+  *hmtx = NULL, *cmap = NULL, *hhea = NULL, *hdmx = NULL, *vdmx = NULL;
   for (unsigned i = 0; i < (*out)->numTables; ++i) {
     struct SFNTTable *tbl = &((*out)->tables[i]);
     bool loadTable = true;
-    if (strncmp(tbl->tag, "loca", 4) == 0) {
+    switch (tbl->tag) {
+    case SFNT_TAG('l', 'o', 'c', 'a'):
       loca = tbl;
       loadTable = false;
-    } else if (strncmp(tbl->tag, "glyf", 4) == 0) {
+      break;
+    case SFNT_TAG('g', 'l', 'y', 'f'):
       glyf = tbl;
       loadTable = false;
-    } else if (strncmp(tbl->tag, "maxp", 4) == 0) {
+      break;
+    case SFNT_TAG('m', 'a', 'x', 'p'):
       maxp = tbl;
-    } else if (strncmp(tbl->tag, "head", 4) == 0) {
+      break;
+    case SFNT_TAG('h', 'e', 'a', 'd'):
       head = tbl;
-    } else if (strncmp(tbl->tag, "hmtx", 4) == 0) {
+      break;
+    case SFNT_TAG('h', 'm', 't', 'x'):
       hmtx = tbl;
-    } else if (strncmp(tbl->tag, "hdmx", 4) == 0
-               || strncmp(tbl->tag, "VDMX", 4) == 0) {
-      // this was already checked above
-      return EOT_LOGIC_ERROR;
-    } else if (strncmp(tbl->tag, "cvt ", 4) == 0) {
+      break;
+    case SFNT_TAG('c', 'm', 'a', 'p'):
+      cmap = tbl;
+      break;
+    case SFNT_TAG('h', 'h', 'e', 'a'):
+      hhea = tbl;
+      break;
+    case SFNT_TAG('h', 'd', 'm', 'x'):
+      hdmx = tbl;
+      loadTable = false;
+      break;
+    case SFNT_TAG('V', 'D', 'M', 'X'):
+      vdmx = tbl;
+      break;
+    case SFNT_TAG('c', 'v', 't', ' '):
       result = unpackCVT(tbl, streams[0]);
       if (result != EOT_SUCCESS) {
         return result;
       }
       loadTable = false;
-    } else if (strncmp(tbl->tag, "VDMX", 4) == 0) {
-      loadTable = false;
+      break;
     }
     if (loadTable) {
       result = loadTableFromStream(tbl, streams[0]);
       if (result != EOT_SUCCESS) {
         return result;
       }
-      if (strncmp(tbl->tag, "head", 4) == 0) {
-        /* kill global checksum; we will be recalcultaing it later. */
+      if (tbl == head) {
+        /* kill global checksum; we will be recalcultaing it later. This
+         * writes into the CTF stream the table borrows from. */
         if (tbl->bufSize < 12) {
           return EOT_MALFORMED_HEAD_TABLE;
         }
@@ -771,7 +1315,7 @@ enum EOTError parseCTF(struct Stream **streams, struct SFNTContainer **out)
     }
   }
   if (glyf && !loca) {
-    result = addTable(*out, "loca", &loca);
+    result = addTable(*out, SFNT_TAG('l', 'o', 'c', 'a'), &loca);
     if (result != EOT_SUCCESS) {
       return result;
     }
@@ -798,19 +1342,102 @@ enum EOTError parseCTF(struct Stream **streams, struct SFNTContainer **out)
   if (result != EOT_SUCCESS) {
     return result;
   }
+  /* the first warning, if any; the font is converted regardless */
+  enum EOTError warning = EOT_SUCCESS;
+  bool vdmxValid = vdmx && TTFIsValidVdmx(vdmx);
+  bool generateVDMX = opts && opts->generateVDMX && !vdmxValid;
+  struct CTFGlyfExtents extents = {0};
   if (glyf) {
-    result = populateGlyfAndLoca(glyf, loca, &headData, &maxpData, streams);
+    bool *keep = NULL;
+    if (opts && opts->subsetCodepoints) {
+      if (!cmap) {
+        return EOT_NO_CMAP_TABLE;
+      }
+      result = _markSubsetGlyphs(cmap, maxpData.numGlyphs, opts,
+                                 scratch->alloc, &keep);
+      if (result != EOT_SUCCESS) {
+        return result;
+      }
+    }
+    result = populateGlyfAndLoca(glyf, loca, &headData, &maxpData, streams,
+                                 keep, generateVDMX ? &extents : NULL,
+                                 scratch);
+    eotFree(scratch->alloc, keep);
+    if (result >= EOT_WARN) {
+      warning = result;
+    } else if (result != EOT_SUCCESS) {
+      return result;
+    }
+  }
+  /* hdmx is only a cache of advance widths, so a font whose hdmx can't be
+   * rebuilt is still worth converting without it */
+  bool dropHdmx = false;
+  if (hdmx) {
+    result = _reconstructHdmx(hdmx, hhea, hmtx, &maxpData, &headData,
+                              streams[0], scratch->alloc);
+    if (result == EOT_CANT_ALLOCATE_MEMORY) {
+      return result;
+    }
+    dropHdmx = result != EOT_SUCCESS;
+  }
+  /* This has to come last: adding or removing a table moves the others. */
+  if (dropHdmx) {
+    if (warning == EOT_SUCCESS) {
+      warning = EOT_WARN_DROPPED_HDMX;
+    }
+    if (vdmx && vdmx > hdmx) {
+      --vdmx;
+    }
+    removeTable(*out, hdmx);
+  }
+  if (generateVDMX && extents.any) {
+    if (!vdmx) {
+      result = addTable(*out, SFNT_TAG('V', 'D', 'M', 'X'), &vdmx);
+      if (result != EOT_SUCCESS) {
+        return result;
+      }
+    }
+    result = generateVdmx(vdmx, &headData, &extents);
     if (result != EOT_SUCCESS) {
       return result;
     }
+  } else if (vdmx && !vdmxValid) {
+    if (warning == EOT_SUCCESS) {
+      warning = EOT_WARN_DROPPED_VDMX;
+    }
+    removeTable(*out, vdmx);
   }
-  /* result = populateHdmx(hdmx, &maxpData, &headData, &hmtxData, streams[0]);
-  if (result != EOT_SUCCESS)
-  {
-    return result;
+  return warning;
+}
+
+enum EOTError parseCTF(struct Stream **streams,
+                       const struct EOTConversionOptions *opts,
+                       struct CTFScratch *scratch, struct SFNTContainer **out)
+{
+  *out = NULL;
+  if (scratch) {
+    return _parseCTF(streams, opts, scratch, out);
   }
-  */
-  return EOT_SUCCESS;
+  struct CTFScratch ownScratch = {0};
+  ownScratch.alloc = opts ? opts->allocator : NULL;
+  enum EOTError result = _parseCTF(streams, opts, &ownScratch, out);
+  /* the container is the caller's, along with what its tables borrowed from
+   * the scratch */
+  for (unsigned i = 0; *out && i < (*out)->numTables; ++i) {
+    struct SFNTTable *tbl = &(*out)->tables[i];
+    if (tbl->buf && (tbl->buf == ownScratch.glyf.buf ||
+                     tbl->buf == ownScratch.loca.buf)) {
+      tbl->ownsBuf = true;
+      if (tbl->buf == ownScratch.glyf.buf) {
+        ownScratch.glyf.buf = NULL;
+      } else {
+        ownScratch.loca.buf = NULL;
+      }
+    }
+  }
+  ownScratch.ctr = NULL;
+  freeCTFScratch(&ownScratch);
+  return result;
 }
 
 /* vim:set shiftwidth=2 softtabstop=2 expandtab: */
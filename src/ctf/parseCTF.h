@@ -11,6 +11,30 @@
 #include "../util/stream.h"
 #include "SFNTContainer.h"
 
-enum EOTError parseCTF(struct Stream **streams, struct SFNTContainer **out);
+/* What parseCTF keeps from one call to the next when it is handed one of
+ * these: room for the points of a glyph, the rebuilt glyf and loca tables, and
+ * the container itself. Start from all zeros, apart from alloc, which all of
+ * it is allocated from. */
+struct CTFScratch {
+  uint8_t *flags;
+  int16_t *xCoords;
+  int16_t *yCoords;
+  unsigned pointCapacity;
+  struct Stream glyf;
+  struct Stream loca;
+  struct SFNTContainer *ctr;
+  const struct EOTAllocator *alloc;
+};
+
+void freeCTFScratch(struct CTFScratch *scratch);
+
+/* streams[1] and streams[2] may be NULL if opts->stripHinting is set. With a
+ * scratch, *out belongs to it and is only valid until its next use; without
+ * one, it belongs to the caller and is allocated from opts->allocator. A
+ * warning (>= EOT_WARN) means *out is usable but a table had to be left
+ * out. */
+enum EOTError parseCTF(struct Stream **streams,
+                       const struct EOTConversionOptions *opts,
+                       struct CTFScratch *scratch, struct SFNTContainer **out);
 
 #endif /* #define __LIBEOT_PARSE_CTF_H__ */
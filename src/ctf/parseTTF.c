@@ -6,8 +6,11 @@
 #include "parseTTF.h"
 
 #include <libeot/libeot.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "../util/alloc.h"
 #include "../util/stream.h"
 #include "SFNTContainer.h"
 
@@ -18,11 +21,61 @@ enum EOTError TTFParseHead(struct SFNTTable *tbl, struct TTFheadData *out)
   }
   *out = (struct TTFheadData){0};
   struct Stream s = constructStream(tbl->buf, tbl->bufSize);
+  seekAbsolute(&s, 18);
+  BEReadU16(&s, &out->unitsPerEm);
   seekAbsolute(&s, 50);
   BEReadS16(&s, &out->indexToLocFormat);
   return EOT_SUCCESS;
 }
 
+enum EOTError TTFParseHhea(struct SFNTTable *tbl, struct TTFhheaData *out)
+{
+  if (tbl->bufSize < 36) {
+    return EOT_CORRUPT_FILE;
+  }
+  *out = (struct TTFhheaData){0};
+  struct Stream s = constructStream(tbl->buf, tbl->bufSize);
+  seekAbsolute(&s, 34);
+  BEReadU16(&s, &out->numberOfHMetrics);
+  return EOT_SUCCESS;
+}
+
+enum EOTError TTFParseHmtx(struct SFNTTable *tbl, struct TTFhheaData *hheaData,
+                           struct TTFmaxpData *maxpData,
+                           const struct EOTAllocator *alloc,
+                           struct TTFhmtxData *out)
+{
+  unsigned numHMetrics = hheaData->numberOfHMetrics;
+  *out = (struct TTFhmtxData){0};
+  if (numHMetrics == 0 || numHMetrics > maxpData->numGlyphs ||
+      tbl->bufSize < 4 * numHMetrics) {
+    return EOT_CORRUPT_FILE;
+  }
+  out->alloc = alloc;
+  out->advanceWidths =
+      (uint16_t *)eotMalloc(alloc, sizeof(uint16_t) * maxpData->numGlyphs);
+  if (!out->advanceWidths) {
+    return EOT_CANT_ALLOCATE_MEMORY;
+  }
+  out->numGlyphs = maxpData->numGlyphs;
+  struct Stream s = constructStream(tbl->buf, tbl->bufSize);
+  for (unsigned i = 0; i < numHMetrics; ++i) {
+    BEReadU16(&s, &out->advanceWidths[i]);
+    seekRelative(&s, 2); /* lsb */
+  }
+  /* the remaining glyphs share the last advance width */
+  for (unsigned i = numHMetrics; i < out->numGlyphs; ++i) {
+    out->advanceWidths[i] = out->advanceWidths[numHMetrics - 1];
+  }
+  return EOT_SUCCESS;
+}
+
+void TTFFreeHmtx(struct TTFhmtxData *data)
+{
+  eotFree(data->alloc, data->advanceWidths);
+  data->advanceWidths = NULL;
+}
+
 enum EOTError TTFParseMaxp(struct SFNTTable *tbl, struct TTFmaxpData *out)
 {
   struct Stream s = constructStream(tbl->buf, tbl->bufSize);
@@ -50,4 +103,218 @@ enum EOTError TTFParseMaxp(struct SFNTTable *tbl, struct TTFmaxpData *out)
   return EOT_SUCCESS;
 }
 
+/* Reads a big-endian u16 at an absolute position of a table, failing softly
+ * so that lookups in a malformed cmap just yield the missing glyph. */
+bool _cmap_rdU16(struct SFNTTable *tbl, unsigned pos, uint16_t *out)
+{
+  struct Stream s = constructStream(tbl->buf, tbl->bufSize);
+  return seekAbsolute(&s, pos) == EOT_STREAM_OK &&
+         BEReadU16(&s, out) == EOT_STREAM_OK;
+}
+
+bool _cmap_rdU32(struct SFNTTable *tbl, unsigned pos, uint32_t *out)
+{
+  struct Stream s = constructStream(tbl->buf, tbl->bufSize);
+  return seekAbsolute(&s, pos) == EOT_STREAM_OK &&
+         BEReadU32(&s, out) == EOT_STREAM_OK;
+}
+
+/* Higher is better; -1 means we can't read the subtable at all. */
+int _cmap_rank(uint16_t platformID, uint16_t encodingID, uint16_t format)
+{
+  if (format == 12) {
+    return (platformID == 3 && encodingID == 10) ? 5
+                                                  : (platformID == 0 ? 4 : -1);
+  }
+  if (format == 4 || format == 6) {
+    if (platformID == 3 && encodingID == 1) {
+      return 3;
+    }
+    if (platformID == 0) {
+      return 2;
+    }
+    if (platformID == 3 && encodingID == 0) {
+      return 1;
+    }
+  }
+  if ((format == 0 || format == 6) && platformID == 1 && encodingID == 0) {
+    return 0;
+  }
+  return -1;
+}
+
+/* https://learn.microsoft.com/en-us/typography/opentype/spec/cmap */
+enum EOTError TTFParseCmap(struct SFNTTable *tbl, struct TTFcmapData *out)
+{
+  struct Stream s = constructStream(tbl->buf, tbl->bufSize);
+  enum StreamResult sResult;
+  *out = (struct TTFcmapData){0};
+  out->tbl = tbl;
+  uint16_t version, numSubtables;
+  RD2(BEReadU16, &s, &version, sResult);
+  RD2(BEReadU16, &s, &numSubtables, sResult);
+  int bestRank = -1;
+  for (unsigned i = 0; i < numSubtables; ++i) {
+    uint16_t platformID, encodingID, format;
+    uint32_t offset;
+    RD2(BEReadU16, &s, &platformID, sResult);
+    RD2(BEReadU16, &s, &encodingID, sResult);
+    RD2(BEReadU32, &s, &offset, sResult);
+    if (!_cmap_rdU16(tbl, offset, &format)) {
+      continue;
+    }
+    int rank = _cmap_rank(platformID, encodingID, format);
+    if (rank > bestRank) {
+      bestRank = rank;
+      out->subtableOffset = offset;
+      out->format = format;
+      out->symbol = platformID == 3 && encodingID == 0;
+    }
+  }
+  if (bestRank < 0) {
+    return EOT_CORRUPT_FILE;
+  }
+  return EOT_SUCCESS;
+}
+
+uint16_t _cmap_lookup4(struct SFNTTable *tbl, unsigned base, uint32_t c)
+{
+  uint16_t segCountX2;
+  if (c > 0xFFFF || !_cmap_rdU16(tbl, base + 6, &segCountX2)) {
+    return 0;
+  }
+  unsigned segCount = segCountX2 / 2;
+  unsigned endCodes = base + 14;
+  unsigned startCodes = endCodes + segCountX2 + 2;
+  unsigned idDeltas = startCodes + segCountX2;
+  unsigned idRangeOffsets = idDeltas + segCountX2;
+  /* find the first segment whose endCode is >= c */
+  unsigned lo = 0, hi = segCount;
+  while (lo < hi) {
+    unsigned mid = (lo + hi) / 2;
+    uint16_t endCode;
+    if (!_cmap_rdU16(tbl, endCodes + 2 * mid, &endCode)) {
+      return 0;
+    }
+    if (endCode < c) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  uint16_t startCode, idDelta, idRangeOffset, glyph;
+  if (lo == segCount || !_cmap_rdU16(tbl, startCodes + 2 * lo, &startCode) ||
+      startCode > c || !_cmap_rdU16(tbl, idDeltas + 2 * lo, &idDelta) ||
+      !_cmap_rdU16(tbl, idRangeOffsets + 2 * lo, &idRangeOffset)) {
+    return 0;
+  }
+  if (idRangeOffset == 0) {
+    return (uint16_t)(c + idDelta);
+  }
+  unsigned glyphPos =
+      idRangeOffsets + 2 * lo + idRangeOffset + 2 * (c - startCode);
+  if (!_cmap_rdU16(tbl, glyphPos, &glyph) || glyph == 0) {
+    return 0;
+  }
+  return (uint16_t)(glyph + idDelta);
+}
+
+uint16_t _cmap_lookup12(struct SFNTTable *tbl, unsigned base, uint32_t c)
+{
+  uint32_t numGroups;
+  if (!_cmap_rdU32(tbl, base + 12, &numGroups)) {
+    return 0;
+  }
+  uint32_t lo = 0, hi = numGroups;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    unsigned group = base + 16 + 12 * mid;
+    uint32_t startCode, endCode, startGlyph;
+    if (!_cmap_rdU32(tbl, group, &startCode) ||
+        !_cmap_rdU32(tbl, group + 4, &endCode)) {
+      return 0;
+    }
+    if (endCode < c) {
+      lo = mid + 1;
+    } else if (startCode > c) {
+      hi = mid;
+    } else {
+      if (!_cmap_rdU32(tbl, group + 8, &startGlyph)) {
+        return 0;
+      }
+      return (uint16_t)(startGlyph + (c - startCode));
+    }
+  }
+  return 0;
+}
+
+uint16_t _cmap_lookup(const struct TTFcmapData *cmap, uint32_t c)
+{
+  struct SFNTTable *tbl = cmap->tbl;
+  unsigned base = cmap->subtableOffset;
+  uint16_t glyph, firstCode, entryCount;
+  switch (cmap->format) {
+  case 0:
+    if (c > 0xFF || base + 6 + c >= tbl->bufSize) {
+      return 0;
+    }
+    return tbl->buf[base + 6 + c];
+  case 4:
+    return _cmap_lookup4(tbl, base, c);
+  case 6:
+    if (!_cmap_rdU16(tbl, base + 6, &firstCode) ||
+        !_cmap_rdU16(tbl, base + 8, &entryCount) || c < firstCode ||
+        c - firstCode >= entryCount ||
+        !_cmap_rdU16(tbl, base + 10 + 2 * (c - firstCode), &glyph)) {
+      return 0;
+    }
+    return glyph;
+  case 12:
+    return _cmap_lookup12(tbl, base, c);
+  default:
+    return 0;
+  }
+}
+
+uint16_t TTFcmapLookup(const struct TTFcmapData *cmap, uint32_t codepoint)
+{
+  uint16_t glyph = _cmap_lookup(cmap, codepoint);
+  /* symbol fonts conventionally map their characters into U+F000..U+F0FF */
+  if (glyph == 0 && cmap->symbol && codepoint < 0x100) {
+    glyph = _cmap_lookup(cmap, codepoint + 0xF000);
+  }
+  return glyph;
+}
+
+bool TTFIsValidVdmx(struct SFNTTable *tbl)
+{
+  uint16_t version, numRecs, numRatios;
+  if (!_cmap_rdU16(tbl, 0, &version) || !_cmap_rdU16(tbl, 2, &numRecs) ||
+      !_cmap_rdU16(tbl, 4, &numRatios)) {
+    return false;
+  }
+  if (version > 1) {
+    return false;
+  }
+  /* ratio records, then one group offset per ratio */
+  unsigned offsetsStart = 6 + 4 * numRatios;
+  if (offsetsStart + 2 * numRatios > tbl->bufSize) {
+    return false;
+  }
+  for (unsigned i = 0; i < numRatios; ++i) {
+    uint16_t groupOffset, recs;
+    _cmap_rdU16(tbl, offsetsStart + 2 * i, &groupOffset);
+    if (!_cmap_rdU16(tbl, groupOffset, &recs)) {
+      return false;
+    }
+    if (groupOffset + 4 + 6 * (unsigned)recs > tbl->bufSize) {
+      return false;
+    }
+    if (tbl->buf[groupOffset + 2] > tbl->buf[groupOffset + 3]) {
+      return false;
+    }
+  }
+  return true;
+}
+
 /* vim:set shiftwidth=2 softtabstop=2 expandtab: */
@@ -6,14 +6,27 @@
 #ifndef __LIBEOT_PARSETTF_H__
 #define __LIBEOT_PARSETTF_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "SFNTContainer.h"
 
 struct TTFheadData {
+  uint16_t unitsPerEm;
   int16_t indexToLocFormat;
 };
 
+struct TTFhheaData {
+  uint16_t numberOfHMetrics;
+};
+
+struct TTFhmtxData {
+  /* advance width of every glyph, including those past numberOfHMetrics */
+  uint16_t *advanceWidths;
+  unsigned numGlyphs;
+  const struct EOTAllocator *alloc;
+};
+
 struct TTFmaxpData {
   uint16_t numGlyphs;
   uint16_t maxPoints;
@@ -31,8 +44,34 @@ struct TTFmaxpData {
   uint16_t maxComponentDepth;
 };
 
+struct TTFcmapData {
+  struct SFNTTable *tbl;
+  unsigned subtableOffset;
+  uint16_t format;
+  bool symbol;
+};
+
 enum EOTError TTFParseHead(struct SFNTTable *tbl, struct TTFheadData *out);
 
 enum EOTError TTFParseMaxp(struct SFNTTable *tbl, struct TTFmaxpData *out);
 
+enum EOTError TTFParseHhea(struct SFNTTable *tbl, struct TTFhheaData *out);
+
+/* out is allocated from alloc, and must be released with TTFFreeHmtx. */
+enum EOTError TTFParseHmtx(struct SFNTTable *tbl, struct TTFhheaData *hheaData,
+                           struct TTFmaxpData *maxpData,
+                           const struct EOTAllocator *alloc,
+                           struct TTFhmtxData *out);
+void TTFFreeHmtx(struct TTFhmtxData *data);
+
+/* Picks the best Unicode subtable of a cmap table; the table must outlive
+ * the returned data. */
+enum EOTError TTFParseCmap(struct SFNTTable *tbl, struct TTFcmapData *out);
+
+/* Returns 0 (.notdef) for unmapped codepoints. */
+uint16_t TTFcmapLookup(const struct TTFcmapData *cmap, uint32_t codepoint);
+
+/* Checks that every ratio record and group of a VDMX table lies within it. */
+bool TTFIsValidVdmx(struct SFNTTable *tbl);
+
 #endif /* #define __LIBEOT_PARSETTF_H__ */
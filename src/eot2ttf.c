@@ -3,60 +3,578 @@
  * version 2.0. For full details, see the file LICENSE
  */
 
+/* for copy_file_range */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <libeot/libeot.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #include "flags.h"
+#include "ioEngine.h"
 #include "writeFontFile.h"
 
+/* how many files the batch mode keeps in flight at once */
+#define IO_DEPTH 64
+/* the most threads -j may ask for */
+#define MAX_JOBS 1024
+/* the buffer a font read from a pipe starts out in */
+#define STREAM_INITIAL_SIZE (64 * 1024)
+/* the largest size taken from a piped font's header on trust */
+#define STREAM_MAX_PRESIZE (64 * 1024 * 1024)
+
 void usage(char *progName)
 {
-  fprintf(stderr, "Usage: %s myfont.eot out.ttf\n", progName);
+  fprintf(stderr,
+          "Usage: %s myfont.eot out.ttf\n"
+          "       %s [-j jobs] -o outdir [font.eot...]\n"
+          "In the first form, either file may be -, for standard input or "
+          "output. In the\nsecond form, each font is converted to a .ttf of "
+          "the same name in outdir, using\nthe given number of threads (by "
+          "default one per CPU, and at most %d). Without\nany fonts on the "
+          "command line, their paths are read from standard input, one\nper "
+          "line.\n",
+          progName, progName, MAX_JOBS);
 }
 
-int main(int argc, char **argv)
+/* Writes all of buf to fd. */
+bool writeAll(int fd, const uint8_t *buf, size_t size)
 {
-  if (argc != 3) {
-    usage(argv[0]);
-    return 1;
+  size_t done = 0;
+  while (done < size) {
+    ssize_t written = write(fd, buf + done, size - done);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    done += written;
   }
-  struct stat st;
-  if (stat(argv[1], &st) != 0) {
-    fprintf(stderr, "The file %s could not be opened.\n", argv[1]);
-    return 1;
+  return true;
+}
+
+/* Copies length bytes at offset in inFd to outFd, letting the kernel move them
+ * directly where it can. mapped is inFd mapped into memory, for when it can't.
+ */
+bool copyPayload(int inFd, const uint8_t *mapped, unsigned offset,
+                 unsigned length, int outFd)
+{
+  off_t inOffset = offset;
+  unsigned done = 0;
+#ifdef HAVE_COPY_FILE_RANGE
+  while (done < length) {
+    ssize_t copied =
+        copy_file_range(inFd, &inOffset, outFd, NULL, length - done, 0);
+    if (copied <= 0) {
+      break; /* e.g. across filesystems on older kernels */
+    }
+    done += copied;
+  }
+#endif
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+  while (done < length) {
+    ssize_t copied = sendfile(outFd, inFd, &inOffset, length - done);
+    if (copied <= 0) {
+      break;
+    }
+    done += copied;
   }
-  int fildes = open(argv[1], O_RDONLY);
-  if (fildes == -1) {
-    fprintf(stderr, "The file %s could not be opened.\n", argv[1]);
+#endif
+  return writeAll(outFd, mapped + offset + done, length - done);
+}
+
+/* Maps a whole file for reading it through once. Empty files, which can't
+ * be mapped, come back as a zero-length buffer. */
+const uint8_t *mapInput(int fd, size_t size)
+{
+  static const uint8_t empty[1];
+  if (size == 0) {
+    return empty;
+  }
+  void *mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    return NULL;
+  }
+  madvise(mapped, size, MADV_SEQUENTIAL); /* only a hint */
+  return mapped;
+}
+
+/* Reads all of fd, which need not be seekable, into a malloc'd buffer. An EOT
+ * starts with its own size, so once that has arrived the buffer is grown to
+ * fit the rest in one go. */
+uint8_t *readStream(int fd, size_t *sizeOut)
+{
+  size_t size = 0, allocated = STREAM_INITIAL_SIZE;
+  bool sized = false;
+  uint8_t *buf = malloc(allocated);
+  while (buf) {
+    if (size == allocated) {
+      allocated *= 2;
+      uint8_t *grown = realloc(buf, allocated);
+      if (!grown) {
+        break;
+      }
+      buf = grown;
+    }
+    ssize_t got = read(fd, buf + size, allocated - size);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0) {
+      break;
+    }
+    if (got == 0) {
+      *sizeOut = size;
+      return buf;
+    }
+    size += got;
+    if (!sized && size >= 4) {
+      uint32_t eotSize = buf[0] | buf[1] << 8 | buf[2] << 16 |
+                         (uint32_t)buf[3] << 24;
+      sized = true;
+      /* one more byte to see the end of the stream without growing again */
+      if (eotSize >= allocated && eotSize < STREAM_MAX_PRESIZE) {
+        uint8_t *grown = realloc(buf, eotSize + 1);
+        if (grown) {
+          buf = grown;
+          allocated = eotSize + 1;
+        }
+      }
+    }
+  }
+  free(buf);
+  return NULL;
+}
+
+/* Either name may be "-", for stdin or stdout. */
+int convertOne(const char *inFileName, const char *outFileName)
+{
+  bool fromStdin = strcmp(inFileName, "-") == 0;
+  bool toStdout = strcmp(outFileName, "-") == 0;
+  if (fromStdin) {
+    inFileName = "standard input";
+  }
+  if (toStdout) {
+    outFileName = "standard output";
+  }
+  struct stat st;
+  int fildes = fromStdin ? STDIN_FILENO : open(inFileName, O_RDONLY);
+  if (fildes == -1 || fstat(fildes, &st) != 0) {
+    fprintf(stderr, "The file %s could not be opened.\n", inFileName);
     return 1;
   }
-  // FIXME
-  const char *outFileName = argv[2];
-  FILE *outFile = fopen(outFileName, "wb");
-  if (outFile == NULL) {
+  int outFd = toStdout ? STDOUT_FILENO
+                       : open(outFileName, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (outFd == -1) {
     fprintf(stderr, "The file %s could not be opened for writing.\n",
             outFileName);
     return 1;
   }
 
+  /* pipes and the like can't be mapped, only read through */
+  bool mapped = S_ISREG(st.st_mode);
+  size_t fontSize = st.st_size;
   const uint8_t *font =
-      mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fildes, 0);
-  if (font == MAP_FAILED) {
-    err(1, NULL);
+      mapped ? mapInput(fildes, fontSize) : readStream(fildes, &fontSize);
+  if (!font) {
+    err(1, "%s", inFileName);
   }
   struct EOTMetadata out;
-  enum EOTError result = EOT2ttf_file(font, st.st_size, &out, outFile);
+  enum EOTError result =
+      fillConversionMetadata(font, fontSize, NULL, true, &out);
   if (result != EOT_SUCCESS) {
     EOTprintError(result, stderr);
     return 1;
   }
+  bool compressed = out.flags & TTEMBED_TTCOMPRESSED;
+  bool encrypted = out.flags & TTEMBED_XORENCRYPTDATA;
+  if (!compressed && !encrypted) {
+    /* the payload already is the TTF */
+    bool copied = mapped ? copyPayload(fildes, font, out.fontDataOffset,
+                                       out.fontDataSize, outFd)
+                         : writeAll(outFd, font + out.fontDataOffset,
+                                    out.fontDataSize);
+    if (!copied) {
+      err(1, "%s", outFileName);
+    }
+  } else {
+    result = writeFontFd(font + out.fontDataOffset, out.fontDataSize,
+                         compressed, encrypted, NULL, NULL, outFd);
+    if (result != EOT_SUCCESS) {
+      EOTprintError(result, stderr);
+      if (result < EOT_WARN) {
+        return 1;
+      }
+    }
+  }
   EOTfreeMetadata(&out);
-  fclose(outFile);
+  if (close(outFd) != 0) {
+    err(1, "%s", outFileName);
+  }
+  return 0;
+}
+
+/* outDir/name.ttf for an input path/to/name.eot */
+char *outputPath(const char *outDir, const char *inFileName)
+{
+  const char *name = strrchr(inFileName, '/');
+  name = name ? name + 1 : inFileName;
+  size_t nameLength = strlen(name);
+  if (nameLength > 4 && strcasecmp(name + nameLength - 4, ".eot") == 0) {
+    nameLength -= 4;
+  }
+  size_t dirLength = strlen(outDir);
+  char *path = malloc(dirLength + 1 + nameLength + sizeof(".ttf"));
+  if (!path) {
+    err(1, NULL);
+  }
+  memcpy(path, outDir, dirLength);
+  path[dirLength] = '/';
+  memcpy(path + dirLength + 1, name, nameLength);
+  strcpy(path + dirLength + 1 + nameLength, ".ttf");
+  return path;
+}
+
+/* Reads the paths of the fonts to convert from stdin, one per line. */
+char **readFileList(unsigned *numOut)
+{
+  char **paths = NULL;
+  unsigned num = 0, allocated = 0;
+  char *line = NULL;
+  size_t lineAllocated = 0;
+  ssize_t length;
+  while ((length = getline(&line, &lineAllocated, stdin)) != -1) {
+    if (length > 0 && line[length - 1] == '\n') {
+      line[--length] = '\0';
+    }
+    if (length == 0) {
+      continue;
+    }
+    if (num == allocated) {
+      allocated = allocated ? 2 * allocated : 64;
+      paths = realloc(paths, allocated * sizeof(char *));
+      if (!paths) {
+        err(1, NULL);
+      }
+    }
+    paths[num] = strdup(line);
+    if (!paths[num]) {
+      err(1, NULL);
+    }
+    ++num;
+  }
+  free(line);
+  *numOut = num;
+  return paths;
+}
+
+struct OutputName {
+  char *path;
+  unsigned index; /* of the font it would be converted from */
+};
+
+int compareOutputNames(const void *a, const void *b)
+{
+  const struct OutputName *x = a, *y = b;
+  int order = strcmp(x->path, y->path);
+  if (order != 0) {
+    return order;
+  }
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* Drops the fonts that would be converted to the same file as an earlier one,
+ * such as a/f.eot and b/f.eot, or f.eot and f.EOT, so that neither is
+ * silently lost. The rest stay at the front of paths, in order. Returns how
+ * many were dropped. */
+unsigned dropDuplicateOutputs(char **paths, unsigned *numPaths,
+                              const char *outDir)
+{
+  unsigned n = *numPaths;
+  struct OutputName *names = calloc(n ? n : 1, sizeof(struct OutputName));
+  bool *dropped = calloc(n ? n : 1, sizeof(bool));
+  if (!names || !dropped) {
+    err(1, NULL);
+  }
+  for (unsigned i = 0; i < n; ++i) {
+    names[i].path = outputPath(outDir, paths[i]);
+    names[i].index = i;
+  }
+  qsort(names, n, sizeof(struct OutputName), compareOutputNames);
+  unsigned numDropped = 0;
+  unsigned first = 0; /* the first of the names equal to names[i] */
+  for (unsigned i = 1; i < n; ++i) {
+    if (strcmp(names[first].path, names[i].path) != 0) {
+      first = i;
+      continue;
+    }
+    const char *path = paths[names[i].index];
+    const char *firstPath = paths[names[first].index];
+    if (strcmp(path, firstPath) == 0) {
+      fprintf(stderr, "The file %s is listed more than once.\n", path);
+    } else {
+      fprintf(stderr, "The file %s would be converted to %s, as %s is.\n",
+              path, names[i].path, firstPath);
+    }
+    dropped[names[i].index] = true;
+    ++numDropped;
+  }
+  unsigned kept = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    if (!dropped[i]) {
+      paths[kept++] = paths[i];
+    }
+    free(names[i].path);
+  }
+  free(names);
+  free(dropped);
+  *numPaths = kept;
+  return numDropped;
+}
+
+/* One chunk of the fonts, on its way from being read, through being
+ * converted, to being written out. */
+struct Chunk {
+  struct IOJob *reads;
+  unsigned numReads;
+  struct EOTBatchItem *items;
+  const char **itemPaths;
+  unsigned numItems;
+  struct IOJob *writes;
+  unsigned numWrites;
+  unsigned numThreads;
+};
+
+void *convertChunk(void *arg)
+{
+  struct Chunk *chunk = (struct Chunk *)arg;
+  EOT2ttf_batch(chunk->items, chunk->numItems, chunk->numThreads);
+  return NULL;
+}
+
+/* Makes the inputs that could be read into items to convert. Returns how many
+ * could not. */
+unsigned startConverting(struct Chunk *chunk)
+{
+  unsigned failed = 0;
+  chunk->numItems = 0;
+  for (unsigned i = 0; i < chunk->numReads; ++i) {
+    struct IOJob *read = &chunk->reads[i];
+    if (!read->opened) {
+      fprintf(stderr, "The file %s could not be opened.\n", read->path);
+      ++failed;
+      continue;
+    }
+    if (read->error) {
+      errno = read->error;
+      warn("%s", read->path);
+      ++failed;
+      continue;
+    }
+    struct EOTBatchItem item = {.font = read->data, .fontSize = read->size};
+    chunk->items[chunk->numItems] = item;
+    chunk->itemPaths[chunk->numItems] = read->path;
+    ++chunk->numItems;
+  }
+  return failed;
+}
+
+/* Frees the inputs, now converted, and sets up writing out the fonts that
+ * converted. Returns how many did not. */
+unsigned startWriting(struct Chunk *chunk, const char *outDir)
+{
+  unsigned failed = 0;
+  chunk->numWrites = 0;
+  for (unsigned i = 0; i < chunk->numItems; ++i) {
+    struct EOTBatchItem *item = &chunk->items[i];
+    /* warnings too, as a single font's would be */
+    if (item->result != EOT_SUCCESS) {
+      fprintf(stderr, "%s: ", chunk->itemPaths[i]);
+      EOTprintError(item->result, stderr);
+    }
+    if (item->result != EOT_SUCCESS && item->result < EOT_WARN) {
+      ++failed;
+    } else {
+      struct IOJob write = {.path = outputPath(outDir, chunk->itemPaths[i]),
+                            .data = item->fontOut,
+                            .size = item->fontSizeOut};
+      chunk->writes[chunk->numWrites++] = write;
+    }
+    EOTfreeMetadata(&item->metadata);
+  }
+  for (unsigned i = 0; i < chunk->numReads; ++i) {
+    free(chunk->reads[i].data);
+  }
+  return failed;
+}
+
+/* Frees the rest of a chunk once it has been written out. Returns how many of
+ * its fonts could not be. */
+unsigned finishWriting(struct Chunk *chunk)
+{
+  unsigned failed = 0;
+  for (unsigned i = 0; i < chunk->numWrites; ++i) {
+    struct IOJob *write = &chunk->writes[i];
+    if (!write->opened) {
+      fprintf(stderr, "The file %s could not be opened for writing.\n",
+              write->path);
+      ++failed;
+    } else if (write->error) {
+      errno = write->error;
+      warn("%s", write->path);
+      ++failed;
+    }
+    free((char *)write->path);
+  }
+  for (unsigned i = 0; i < chunk->numItems; ++i) {
+    EOTfreeBuffer(chunk->items[i].fontOut);
+  }
+  return failed;
+}
+
+/* Converts the fonts a chunk at a time, so that only a few chunks' inputs and
+ * outputs are held at once. While one chunk converts, the next is read and
+ * the one before written out. Returns how many of the fonts failed. */
+unsigned convertBatch(char **paths, unsigned numPaths, const char *outDir,
+                      unsigned numThreads)
+{
+  unsigned chunkSize = 32 * numThreads;
+  struct IOEngine *engine = ioEngineCreate(IO_DEPTH);
+  struct Chunk chunks[3];
+  if (!engine) {
+    err(1, NULL);
+  }
+  for (unsigned i = 0; i < 3; ++i) {
+    struct Chunk chunk = {
+        .reads = calloc(chunkSize, sizeof(struct IOJob)),
+        .items = calloc(chunkSize, sizeof(struct EOTBatchItem)),
+        .itemPaths = calloc(chunkSize, sizeof(const char *)),
+        .writes = calloc(chunkSize, sizeof(struct IOJob)),
+        .numThreads = numThreads};
+    if (!chunk.reads || !chunk.items || !chunk.itemPaths || !chunk.writes) {
+      err(1, NULL);
+    }
+    chunks[i] = chunk;
+  }
+  unsigned numChunks = numPaths / chunkSize + (numPaths % chunkSize != 0);
+  unsigned failed = 0;
+  /* in step k, chunk k is read, k - 1 converted and k - 2 written out */
+  for (unsigned k = 0; k < numChunks + 2; ++k) {
+    struct Chunk *reading = k < numChunks ? &chunks[k % 3] : NULL;
+    struct Chunk *converting =
+        k >= 1 && k <= numChunks ? &chunks[(k - 1) % 3] : NULL;
+    struct Chunk *writing = k >= 2 ? &chunks[(k - 2) % 3] : NULL;
+    if (reading) {
+      unsigned start = k * chunkSize;
+      reading->numReads =
+          numPaths - start < chunkSize ? numPaths - start : chunkSize;
+      for (unsigned i = 0; i < reading->numReads; ++i) {
+        struct IOJob read = {.path = paths[start + i]};
+        reading->reads[i] = read;
+      }
+    }
+    pthread_t converter;
+    bool threaded =
+        converting &&
+        pthread_create(&converter, NULL, convertChunk, converting) == 0;
+    if (converting && !threaded) {
+      convertChunk(converting);
+    }
+    ioEngineRun(engine, reading ? reading->reads : NULL,
+                reading ? reading->numReads : 0,
+                writing ? writing->writes : NULL,
+                writing ? writing->numWrites : 0);
+    if (threaded) {
+      pthread_join(converter, NULL);
+    }
+    if (writing) {
+      failed += finishWriting(writing);
+    }
+    if (converting) {
+      failed += startWriting(converting, outDir);
+    }
+    if (reading) {
+      failed += startConverting(reading);
+    }
+  }
+  for (unsigned i = 0; i < 3; ++i) {
+    free(chunks[i].reads);
+    free(chunks[i].items);
+    free(chunks[i].itemPaths);
+    free(chunks[i].writes);
+  }
+  ioEngineFree(engine);
+  return failed;
+}
+
+int main(int argc, char **argv)
+{
+  const char *outDir = NULL;
+  long jobs = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:o:")) != -1) {
+    switch (opt) {
+    case 'j': {
+      char *end;
+      jobs = strtol(optarg, &end, 10);
+      if (*end != '\0' || jobs < 1 || jobs > MAX_JOBS) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    }
+    case 'o':
+      outDir = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!outDir) {
+    if (jobs != 0 || argc - optind != 2) {
+      usage(argv[0]);
+      return 1;
+    }
+    return convertOne(argv[optind], argv[optind + 1]);
+  }
+
+  unsigned numPaths = argc - optind;
+  char **paths = argv + optind;
+  if (numPaths == 0) {
+    paths = readFileList(&numPaths);
+  }
+  if (jobs == 0) {
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    jobs = jobs < 1 ? 1 : (jobs > MAX_JOBS ? MAX_JOBS : jobs);
+  }
+  unsigned numToConvert = numPaths;
+  unsigned failed = dropDuplicateOutputs(paths, &numToConvert, outDir);
+  failed += convertBatch(paths, numToConvert, outDir, (unsigned)jobs);
+  if (failed > 0) {
+    fprintf(stderr, "%u of %u files could not be converted.\n", failed,
+            numPaths);
+    return 1;
+  }
+  return 0;
 }
 /* vim:set shiftwidth=2 softtabstop=2 expandtab: */
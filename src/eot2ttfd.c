@@ -0,0 +1,521 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+/* A daemon converting fonts for local clients, so that they don't pay for
+ * starting eot2ttf over again for each font.
+ *
+ * Clients connect to a SOCK_SEQPACKET Unix socket and send one message per
+ * font: a struct EOTDaemonRequest, with a file descriptor for the EOT
+ * attached through SCM_RIGHTS. The EOT is the whole of that file. A memfd
+ * sealed against shrinking and writing is mapped as it is; anything else is
+ * read into memory first, as the client could change it under the
+ * conversion otherwise.
+ *
+ * Each request gets a struct EOTDaemonReply back. Unless result is an error,
+ * that is, neither EOT_SUCCESS nor a warning, the reply comes with a sealed
+ * memfd holding the fontSize bytes of the TTF. A connection can carry any
+ * number of requests, one after the other.
+ *
+ * The main thread waits on all the connections at once with epoll, and hands
+ * each one that has a request waiting to a worker, which serves that one
+ * request. So a client that keeps its connection open without sending
+ * anything doesn't hold up a worker. Each worker keeps its EOTContext from
+ * one font to the next, whichever connection it came in on.
+ */
+
+/* for memfd_create, and the sealing and SCM_RIGHTS definitions */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libeot/libeot.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "flags.h"
+#include "writeFontFile.h"
+
+/* the most workers -j may ask for, as in eot2ttf */
+#define MAX_JOBS 1024
+/* how many seconds a reply may wait for the client to make room for it */
+#define SEND_TIMEOUT 10
+/* how many events the main thread takes from epoll at once */
+#define MAX_EVENTS 64
+
+/* flags of a request */
+#define EOTD_GENERATE_VDMX 1 /* EOTConversionOptions.generateVDMX */
+#define EOTD_STRIP_HINTING 2 /* EOTConversionOptions.stripHinting */
+
+struct EOTDaemonRequest {
+  uint32_t flags;
+};
+
+struct EOTDaemonReply {
+  int32_t result; /* an enum EOTError */
+  uint32_t fontSize;
+};
+
+void usage(char *progName)
+{
+  fprintf(stderr,
+          "Usage: %s [-j workers] socket\n"
+          "Converts the fonts sent to the Unix socket at the given path, "
+          "using the given\nnumber of workers (by default one per CPU, and "
+          "at most %d).\n",
+          progName, MAX_JOBS);
+}
+
+/* Receives a request into *request, and the descriptor sent with it into
+ * *fdOut, or -1 if there was none. Returns the full size of the message, or
+ * 0 once the client has hung up, or -1, with errno EAGAIN if there was no
+ * request waiting after all. */
+ssize_t receiveRequest(int conn, struct EOTDaemonRequest *request,
+                       int *fdOut)
+{
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct iovec iov = {.iov_base = request, .iov_len = sizeof(*request)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  ssize_t got;
+  do {
+    got = recvmsg(conn, &msg, MSG_TRUNC | MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+  } while (got < 0 && errno == EINTR);
+  *fdOut = -1;
+  if (got < 0) {
+    return got;
+  }
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    unsigned numFds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (unsigned i = 0; i < numFds; ++i) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+      if (*fdOut == -1) {
+        *fdOut = fd;
+      } else {
+        close(fd);
+      }
+    }
+  }
+  return got;
+}
+
+/* Sends reply, with fd attached unless it is -1. */
+bool sendReply(int conn, const struct EOTDaemonReply *reply, int fd)
+{
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct iovec iov = {.iov_base = (void *)reply, .iov_len = sizeof(*reply)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (fd != -1) {
+    memset(&control, 0, sizeof(control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+  }
+  ssize_t sent;
+  do {
+    sent = sendmsg(conn, &msg, MSG_NOSIGNAL);
+  } while (sent < 0 && errno == EINTR);
+  return sent == sizeof(*reply);
+}
+
+/* Gets at the font in fd, either by mapping it, in which case *mappedOut is
+ * set, or by reading it into a malloc'd buffer. */
+uint8_t *loadFont(int fd, unsigned *sizeOut, bool *mappedOut)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > UINT32_MAX) {
+    return NULL;
+  }
+  unsigned size = st.st_size;
+  *mappedOut = false;
+#ifdef F_GET_SEALS
+  int seals = fcntl(fd, F_GET_SEALS);
+  if (size > 0 && seals != -1 && (seals & F_SEAL_SHRINK) &&
+      (seals & F_SEAL_WRITE)) {
+    void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped != MAP_FAILED) {
+      *mappedOut = true;
+      *sizeOut = size;
+      return mapped;
+    }
+  }
+#endif
+  uint8_t *font = malloc(size ? size : 1);
+  unsigned done = 0;
+  while (font && done < size) {
+    ssize_t got = pread(fd, font + done, size - done, done);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0) {
+      free(font);
+      return NULL;
+    }
+    if (got == 0) {
+      break; /* it shrank since */
+    }
+    done += got;
+  }
+  *sizeOut = done;
+  return font;
+}
+
+int createOutput(void)
+{
+#ifdef HAVE_MEMFD_CREATE
+  return memfd_create("ttf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+  char path[] = "/tmp/eot2ttfd.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd != -1) {
+    unlink(path);
+  }
+  return fd;
+#endif
+}
+
+/* Converts the font in fontFd and replies. Returns false if the reply could
+ * not be sent. */
+bool serveRequest(struct EOTContext *ctx, int conn,
+                  const struct EOTDaemonRequest *request, int fontFd)
+{
+  struct EOTDaemonReply reply = {.result = EOT_OTHER_STDLIB_ERROR};
+  struct EOTMetadata md;
+  unsigned fontSize = 0;
+  bool mapped = false;
+  uint8_t *font = NULL;
+  int outFd = -1;
+  if (fontFd == -1 ||
+      (request->flags & ~(EOTD_GENERATE_VDMX | EOTD_STRIP_HINTING))) {
+    reply.result = EOT_LOGIC_ERROR;
+    goto REPLY;
+  }
+  font = loadFont(fontFd, &fontSize, &mapped);
+  outFd = createOutput();
+  if (!font || outFd == -1) {
+    goto REPLY;
+  }
+  struct EOTConversionOptions opts = {
+      .generateVDMX = request->flags & EOTD_GENERATE_VDMX,
+      .stripHinting = request->flags & EOTD_STRIP_HINTING};
+  enum EOTError result =
+      fillConversionMetadata(font, fontSize, &opts, false, &md);
+  if (result == EOT_SUCCESS || result >= EOT_WARN) {
+    enum EOTError writeResult = writeFontFd(
+        font + md.fontDataOffset, md.fontDataSize,
+        md.flags & TTEMBED_TTCOMPRESSED, md.flags & TTEMBED_XORENCRYPTDATA,
+        &opts, ctx, outFd);
+    if (writeResult != EOT_SUCCESS) {
+      result = writeResult;
+    }
+  }
+  EOTfreeMetadata(&md);
+  reply.result = result;
+  if (result == EOT_SUCCESS || result >= EOT_WARN) {
+    off_t end = lseek(outFd, 0, SEEK_CUR);
+    if (end < 0 || end > UINT32_MAX || lseek(outFd, 0, SEEK_SET) != 0) {
+      reply.result = EOT_OTHER_STDLIB_ERROR;
+    } else {
+      reply.fontSize = end;
+#if defined(HAVE_MEMFD_CREATE) && defined(F_ADD_SEALS)
+      /* only a hint to the client that the font won't change under it */
+      fcntl(outFd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+#endif
+    }
+  }
+
+REPLY:;
+  bool converted = reply.result == EOT_SUCCESS || reply.result >= EOT_WARN;
+  bool sent = sendReply(conn, &reply, converted ? outFd : -1);
+  if (mapped) {
+    munmap(font, fontSize);
+  } else {
+    free(font);
+  }
+  if (outFd != -1) {
+    close(outFd);
+  }
+  if (fontFd != -1) {
+    close(fontFd);
+  }
+  return sent;
+}
+
+/* Serves the request waiting on conn, if there is one. Returns false once
+ * the connection is done with: the client has hung up, or could not be sent
+ * its reply. */
+bool serveNextRequest(struct EOTContext *ctx, int conn)
+{
+  struct EOTDaemonRequest request = {0};
+  int fontFd;
+  ssize_t got = receiveRequest(conn, &request, &fontFd);
+  if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return true;
+  }
+  if (got <= 0) {
+    if (fontFd != -1) {
+      close(fontFd);
+    }
+    return false;
+  }
+  if (got != sizeof(request) && fontFd != -1) {
+    close(fontFd);
+    fontFd = -1; /* answered with EOT_LOGIC_ERROR */
+  }
+  return serveRequest(ctx, conn, &request, fontFd);
+}
+
+/* The connections with a request waiting, in the order epoll reported them.
+ * Each is reported once until it is watched again, so a connection is never
+ * in here twice, nor in here while a worker serves it. */
+struct ReadyQueue {
+  pthread_mutex_t lock;
+  pthread_cond_t nonEmpty;
+  int *conns; /* a ring of capacity, count of them from head on */
+  unsigned head;
+  unsigned count;
+  unsigned capacity;
+};
+
+void pushReady(struct ReadyQueue *q, int conn)
+{
+  pthread_mutex_lock(&q->lock);
+  if (q->count == q->capacity) {
+    unsigned capacity = q->capacity ? 2 * q->capacity : MAX_EVENTS;
+    int *conns = malloc(capacity * sizeof(int));
+    if (!conns) {
+      err(1, NULL);
+    }
+    for (unsigned i = 0; i < q->count; ++i) {
+      conns[i] = q->conns[(q->head + i) % q->capacity];
+    }
+    free(q->conns);
+    q->conns = conns;
+    q->head = 0;
+    q->capacity = capacity;
+  }
+  q->conns[(q->head + q->count) % q->capacity] = conn;
+  ++q->count;
+  pthread_cond_signal(&q->nonEmpty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+int popReady(struct ReadyQueue *q)
+{
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0) {
+    pthread_cond_wait(&q->nonEmpty, &q->lock);
+  }
+  int conn = q->conns[q->head];
+  q->head = (q->head + 1) % q->capacity;
+  --q->count;
+  pthread_mutex_unlock(&q->lock);
+  return conn;
+}
+
+struct Server {
+  int listenFd;
+  int epollFd;
+  struct ReadyQueue ready;
+};
+
+/* Has epoll report conn, once, when it next has a request waiting. op is
+ * EPOLL_CTL_ADD for a new connection, and EPOLL_CTL_MOD to watch it again. */
+bool watchConnection(struct Server *server, int conn, int op)
+{
+  struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT,
+                              .data = {.fd = conn}};
+  return epoll_ctl(server->epollFd, op, conn, &event) == 0;
+}
+
+void *runWorker(void *arg)
+{
+  struct Server *server = (struct Server *)arg;
+  /* without a context of its own, a worker still converts, only slower */
+  struct EOTContext *ctx = EOTcreateContext();
+  while (true) {
+    int conn = popReady(&server->ready);
+    if (!serveNextRequest(ctx, conn) ||
+        !watchConnection(server, conn, EPOLL_CTL_MOD)) {
+      close(conn);
+    }
+  }
+  EOTfreeContext(ctx);
+  return NULL;
+}
+
+/* Accepts the connections waiting on the listening socket, and starts
+ * watching them. */
+void acceptConnections(struct Server *server)
+{
+  while (true) {
+    int conn = accept4(server->listenFd, NULL, NULL, SOCK_CLOEXEC);
+    if (conn == -1) {
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+          errno == ENOMEM) {
+        /* the socket stays readable, so don't just come straight back */
+        warn("accept");
+        sleep(1);
+        return;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      if (errno != EINTR && errno != ECONNABORTED && errno != EPROTO) {
+        err(1, "accept");
+      }
+      continue;
+    }
+    /* a client that doesn't read its replies can't hold up a worker */
+    struct timeval timeout = {.tv_sec = SEND_TIMEOUT};
+    if (setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                   sizeof(timeout)) != 0 ||
+        !watchConnection(server, conn, EPOLL_CTL_ADD)) {
+      warn("accept");
+      close(conn);
+    }
+  }
+}
+
+/* Waits for new connections and for requests on the ones there are, and
+ * hands the latter to the workers. */
+void runEventLoop(struct Server *server)
+{
+  struct epoll_event events[MAX_EVENTS];
+  while (true) {
+    int numEvents = epoll_wait(server->epollFd, events, MAX_EVENTS, -1);
+    if (numEvents < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      err(1, "epoll_wait");
+    }
+    for (int i = 0; i < numEvents; ++i) {
+      if (events[i].data.fd == server->listenFd) {
+        acceptConnections(server);
+      } else {
+        /* hang-ups too, for the worker to find out about and close */
+        pushReady(&server->ready, events[i].data.fd);
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv)
+{
+  long workers = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:")) != -1) {
+    if (opt != 'j') {
+      usage(argv[0]);
+      return 1;
+    }
+    char *end;
+    workers = strtol(optarg, &end, 10);
+    if (*end != '\0' || workers < 1 || workers > MAX_JOBS) {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *socketPath = argv[optind];
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+    errx(1, "%s: the path is too long for a socket", socketPath);
+  }
+  strcpy(addr.sun_path, socketPath);
+
+  struct Server server = {
+      .listenFd =
+          socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0),
+      .epollFd = epoll_create1(EPOLL_CLOEXEC),
+      .ready = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                .nonEmpty = PTHREAD_COND_INITIALIZER}};
+  if (server.listenFd == -1) {
+    err(1, "socket");
+  }
+  if (server.epollFd == -1) {
+    err(1, "epoll_create1");
+  }
+  struct stat st;
+  if (lstat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    unlink(socketPath); /* left behind by an earlier run */
+  }
+  if (bind(server.listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(server.listenFd, SOMAXCONN) != 0) {
+    err(1, "%s", socketPath);
+  }
+  struct epoll_event event = {.events = EPOLLIN,
+                              .data = {.fd = server.listenFd}};
+  if (epoll_ctl(server.epollFd, EPOLL_CTL_ADD, server.listenFd, &event) != 0) {
+    err(1, "epoll_ctl");
+  }
+
+  if (workers == 0) {
+    workers = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = workers < 1 ? 1 : (workers > MAX_JOBS ? MAX_JOBS : workers);
+  }
+  long started = 0;
+  for (long i = 0; i < workers; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, runWorker, &server) != 0) {
+      break;
+    }
+    pthread_detach(thread);
+    ++started;
+  }
+  if (started == 0) {
+    errx(1, "no workers could be started");
+  }
+  if (started < workers) {
+    warnx("only %ld of %ld workers could be started", started, workers);
+  }
+  runEventLoop(&server);
+  return 0;
+}
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
@@ -0,0 +1,482 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+/* for struct statx and AT_EMPTY_PATH */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "ioEngine.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) &&           \
+    defined(__NR_io_uring_register)
+#define IO_URING
+#endif
+#endif
+
+/* the most threads the fallback uses, however deep the engine */
+#define IO_MAX_THREADS 16
+/* the most a single read or write asks for */
+#define IO_MAX_TRANSFER (1u << 30)
+
+/* The blocking fallback. */
+
+void _io_readFile(struct IOJob *job)
+{
+  int fd = open(job->path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    job->error = errno;
+    return;
+  }
+  job->opened = true;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    job->error = errno;
+  } else if (!(job->data = malloc(st.st_size ? st.st_size : 1))) {
+    job->error = ENOMEM;
+  } else {
+    job->size = st.st_size;
+    size_t done = 0;
+    while (done < job->size) {
+      size_t want = job->size - done;
+      ssize_t got = pread(fd, job->data + done,
+                          want < IO_MAX_TRANSFER ? want : IO_MAX_TRANSFER, done);
+      if (got < 0 && errno == EINTR) {
+        continue;
+      }
+      if (got < 0) {
+        job->error = errno;
+        break;
+      }
+      if (got == 0) {
+        job->size = done; /* it shrank since */
+        break;
+      }
+      done += got;
+    }
+  }
+  close(fd);
+}
+
+void _io_writeFile(struct IOJob *job)
+{
+  int fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd == -1) {
+    job->error = errno;
+    return;
+  }
+  job->opened = true;
+  size_t done = 0;
+  while (done < job->size) {
+    size_t want = job->size - done;
+    ssize_t written =
+        write(fd, job->data + done,
+              want < IO_MAX_TRANSFER ? want : IO_MAX_TRANSFER);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written < 0) {
+      job->error = errno;
+      break;
+    }
+    done += written;
+  }
+  if (close(fd) != 0 && !job->error) {
+    job->error = errno;
+  }
+}
+
+struct _io_Pool {
+  pthread_mutex_t lock;
+  struct IOJob *reads;
+  unsigned numReads;
+  struct IOJob *writes;
+  unsigned numWrites;
+  unsigned next;
+};
+
+void *_io_runPool(void *arg)
+{
+  struct _io_Pool *pool = (struct _io_Pool *)arg;
+  while (true) {
+    pthread_mutex_lock(&pool->lock);
+    unsigned job = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if (job < pool->numReads) {
+      _io_readFile(&pool->reads[job]);
+    } else if (job - pool->numReads < pool->numWrites) {
+      _io_writeFile(&pool->writes[job - pool->numReads]);
+    } else {
+      return NULL;
+    }
+  }
+}
+
+void _io_runThreads(unsigned depth, struct IOJob *reads, unsigned numReads,
+                    struct IOJob *writes, unsigned numWrites)
+{
+  struct _io_Pool pool = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                          .reads = reads,
+                          .numReads = numReads,
+                          .writes = writes,
+                          .numWrites = numWrites};
+  unsigned numThreads = depth < IO_MAX_THREADS ? depth : IO_MAX_THREADS;
+  if (numThreads > numReads + numWrites) {
+    numThreads = numReads + numWrites;
+  }
+  pthread_t threads[IO_MAX_THREADS];
+  bool started[IO_MAX_THREADS];
+  /* this thread is one of them */
+  for (unsigned i = 1; i < numThreads; ++i) {
+    started[i] = pthread_create(&threads[i], NULL, _io_runPool, &pool) == 0;
+  }
+  _io_runPool(&pool);
+  for (unsigned i = 1; i < numThreads; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+}
+
+#ifdef IO_URING
+/* io_uring, through the raw system calls. Every file goes through a chain of
+ * steps, each a single request: open, for reads find out the size, read or
+ * write (more than once if short), close. A file has at most one request in
+ * flight, so with at most as many files in flight as the ring has entries,
+ * neither queue can overflow. */
+
+struct _io_Ring {
+  int fd;
+  unsigned entries;
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  struct io_uring_sqe *sqes;
+  unsigned *cqHead, *cqTail, *cqMask;
+  struct io_uring_cqe *cqes;
+  void *sqRing, *cqRing;
+  size_t sqRingSize, cqRingSize, sqesSize;
+  unsigned toSubmit;
+};
+
+enum _io_Step { IO_OPEN, IO_STAT, IO_TRANSFER, IO_CLOSE };
+
+struct _io_Op {
+  struct IOJob *job;
+  bool write;
+  enum _io_Step step;
+  int fd;
+  size_t done;
+  struct statx stx;
+};
+
+bool _io_supportsOps(int fd)
+{
+  const uint8_t needed[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+                            IORING_OP_WRITE, IORING_OP_CLOSE};
+  struct io_uring_probe *probe = (struct io_uring_probe *)calloc(
+      1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+  if (!probe) {
+    return false;
+  }
+  bool supported =
+      syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) ==
+      0;
+  for (unsigned i = 0; supported && i < sizeof(needed); ++i) {
+    supported = needed[i] <= probe->last_op &&
+                (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+  }
+  free(probe);
+  return supported;
+}
+
+void _io_ringFree(struct _io_Ring *r)
+{
+  if (r->sqes && r->sqes != MAP_FAILED) {
+    munmap(r->sqes, r->sqesSize);
+  }
+  if (r->cqRing && r->cqRing != MAP_FAILED && r->cqRing != r->sqRing) {
+    munmap(r->cqRing, r->cqRingSize);
+  }
+  if (r->sqRing && r->sqRing != MAP_FAILED) {
+    munmap(r->sqRing, r->sqRingSize);
+  }
+  close(r->fd);
+}
+
+bool _io_ringSetup(struct _io_Ring *r, unsigned entries)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  memset(r, 0, sizeof(*r));
+  r->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (r->fd < 0) {
+    return false;
+  }
+  r->entries = p.sq_entries;
+  r->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single && r->cqRingSize > r->sqRingSize) {
+    r->sqRingSize = r->cqRingSize;
+  }
+  r->sqRing = mmap(NULL, r->sqRingSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->cqRing = single ? r->sqRing
+                     : mmap(NULL, r->cqRingSize, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, r->fd,
+                            IORING_OFF_CQ_RING);
+  r->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = (struct io_uring_sqe *)mmap(NULL, r->sqesSize,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, r->fd,
+                                        IORING_OFF_SQES);
+  if (r->sqRing == MAP_FAILED || r->cqRing == MAP_FAILED ||
+      r->sqes == MAP_FAILED || !_io_supportsOps(r->fd)) {
+    _io_ringFree(r);
+    return false;
+  }
+  uint8_t *sq = (uint8_t *)r->sqRing, *cq = (uint8_t *)r->cqRing;
+  r->sqHead = (unsigned *)(sq + p.sq_off.head);
+  r->sqTail = (unsigned *)(sq + p.sq_off.tail);
+  r->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sqArray = (unsigned *)(sq + p.sq_off.array);
+  r->cqHead = (unsigned *)(cq + p.cq_off.head);
+  r->cqTail = (unsigned *)(cq + p.cq_off.tail);
+  r->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return true;
+}
+
+/* Queues the request for the step op is at. */
+void _io_queue(struct _io_Ring *r, struct _io_Op *op)
+{
+  unsigned tail = *r->sqTail;
+  unsigned index = tail & *r->sqMask;
+  struct io_uring_sqe *sqe = &r->sqes[index];
+  struct IOJob *job = op->job;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = (uintptr_t)op;
+  switch (op->step) {
+  case IO_OPEN:
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)job->path;
+    sqe->open_flags = op->write ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC
+                                : O_RDONLY | O_CLOEXEC;
+    sqe->len = 0666;
+    break;
+  case IO_STAT:
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = op->fd;
+    sqe->addr = (uintptr_t) "";
+    sqe->statx_flags = AT_EMPTY_PATH;
+    sqe->len = STATX_SIZE;
+    sqe->off = (uintptr_t)&op->stx;
+    break;
+  case IO_TRANSFER: {
+    size_t want = job->size - op->done;
+    sqe->opcode = op->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = op->fd;
+    sqe->addr = (uintptr_t)(job->data + op->done);
+    sqe->len = want < IO_MAX_TRANSFER ? want : IO_MAX_TRANSFER;
+    sqe->off = op->done;
+    break;
+  }
+  case IO_CLOSE:
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = op->fd;
+    break;
+  }
+  r->sqArray[index] = index;
+  __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+  ++r->toSubmit;
+}
+
+/* Moves op on to its next step, given the result of the last one. Returns
+ * true once the file is done with. */
+bool _io_advance(struct _io_Op *op, int res)
+{
+  struct IOJob *job = op->job;
+  switch (op->step) {
+  case IO_OPEN:
+    if (res < 0) {
+      job->error = -res;
+      return true;
+    }
+    job->opened = true;
+    op->fd = res;
+    if (op->write) {
+      op->step = job->size > 0 ? IO_TRANSFER : IO_CLOSE;
+    } else {
+      op->step = IO_STAT;
+    }
+    return false;
+  case IO_STAT:
+    if (res < 0) {
+      job->error = -res;
+      op->step = IO_CLOSE;
+      return false;
+    }
+    job->size = op->stx.stx_size;
+    job->data = malloc(job->size ? job->size : 1);
+    if (!job->data) {
+      job->error = ENOMEM;
+      op->step = IO_CLOSE;
+    } else {
+      op->step = job->size > 0 ? IO_TRANSFER : IO_CLOSE;
+    }
+    return false;
+  case IO_TRANSFER:
+    if (res == -EINTR || res == -EAGAIN) {
+      return false; /* again */
+    }
+    if (res < 0) {
+      job->error = -res;
+      op->step = IO_CLOSE;
+    } else if (res == 0) {
+      if (op->write) {
+        job->error = EIO;
+      } else {
+        job->size = op->done; /* it shrank since */
+      }
+      op->step = IO_CLOSE;
+    } else {
+      op->done += res;
+      if (op->done == job->size) {
+        op->step = IO_CLOSE;
+      }
+    }
+    return false;
+  case IO_CLOSE:
+    if (res < 0 && !job->error) {
+      job->error = -res;
+    }
+    return true;
+  }
+  return true;
+}
+
+void _io_runRing(struct _io_Ring *r, struct IOJob *reads, unsigned numReads,
+                 struct IOJob *writes, unsigned numWrites)
+{
+  unsigned total = numReads + numWrites;
+  unsigned numSlots = r->entries < total ? r->entries : total;
+  struct _io_Op *ops =
+      (struct _io_Op *)calloc(numSlots, sizeof(struct _io_Op));
+  struct _io_Op **freeSlots =
+      (struct _io_Op **)calloc(numSlots, sizeof(struct _io_Op *));
+  if (!ops || !freeSlots) {
+    free(ops);
+    free(freeSlots);
+    _io_runThreads(numSlots, reads, numReads, writes, numWrites);
+    return;
+  }
+  unsigned numFree = numSlots;
+  for (unsigned i = 0; i < numSlots; ++i) {
+    freeSlots[i] = &ops[i];
+  }
+  unsigned next = 0;
+  while (next < total || numFree < numSlots) {
+    while (numFree > 0 && next < total) {
+      struct _io_Op *op = freeSlots[--numFree];
+      memset(op, 0, sizeof(*op));
+      op->write = next >= numReads;
+      op->job = op->write ? &writes[next - numReads] : &reads[next];
+      op->step = IO_OPEN;
+      _io_queue(r, op);
+      ++next;
+    }
+    int submitted = syscall(__NR_io_uring_enter, r->fd, r->toSubmit, 1,
+                            IORING_ENTER_GETEVENTS, NULL, 0);
+    if (submitted < 0) {
+      if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        err(1, "io_uring_enter");
+      }
+    } else {
+      r->toSubmit -= submitted;
+    }
+    unsigned head = *r->cqHead;
+    unsigned tail = __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+      struct io_uring_cqe *cqe = &r->cqes[head & *r->cqMask];
+      struct _io_Op *op = (struct _io_Op *)(uintptr_t)cqe->user_data;
+      if (_io_advance(op, cqe->res)) {
+        freeSlots[numFree++] = op;
+      } else {
+        _io_queue(r, op);
+      }
+    }
+    __atomic_store_n(r->cqHead, head, __ATOMIC_RELEASE);
+  }
+  free(ops);
+  free(freeSlots);
+}
+#endif
+
+struct IOEngine {
+  unsigned depth;
+#ifdef IO_URING
+  bool hasRing;
+  struct _io_Ring ring;
+#endif
+};
+
+struct IOEngine *ioEngineCreate(unsigned depth)
+{
+  struct IOEngine *engine =
+      (struct IOEngine *)calloc(1, sizeof(struct IOEngine));
+  if (!engine) {
+    return NULL;
+  }
+  engine->depth = depth ? depth : 1;
+#ifdef IO_URING
+  engine->hasRing = _io_ringSetup(&engine->ring, engine->depth);
+#endif
+  return engine;
+}
+
+void ioEngineFree(struct IOEngine *engine)
+{
+  if (!engine) {
+    return;
+  }
+#ifdef IO_URING
+  if (engine->hasRing) {
+    _io_ringFree(&engine->ring);
+  }
+#endif
+  free(engine);
+}
+
+void ioEngineRun(struct IOEngine *engine, struct IOJob *reads,
+                 unsigned numReads, struct IOJob *writes, unsigned numWrites)
+{
+  if (numReads + numWrites == 0) {
+    return;
+  }
+#ifdef IO_URING
+  if (engine->hasRing) {
+    _io_runRing(&engine->ring, reads, numReads, writes, numWrites);
+    return;
+  }
+#endif
+  _io_runThreads(engine->depth, reads, numReads, writes, numWrites);
+}
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
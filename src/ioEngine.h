@@ -0,0 +1,38 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+#ifndef __LIBEOT_IO_ENGINE_H__
+#define __LIBEOT_IO_ENGINE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A whole file to be read into memory, or written out. */
+struct IOJob {
+  const char *path;
+  /* for reads, allocated by the engine, to be given back to free() even if
+   * the read failed */
+  uint8_t *data;
+  size_t size;
+  /* the errno of the first thing that went wrong, or 0 */
+  int error;
+  /* whether the file could be opened at all */
+  bool opened;
+};
+
+/* Does the file I/O of eot2ttf's batch mode, keeping up to depth files in
+ * flight: through io_uring where the kernel supports it, and otherwise on a
+ * pool of threads doing blocking I/O. */
+struct IOEngine;
+struct IOEngine *ioEngineCreate(unsigned depth);
+void ioEngineFree(struct IOEngine *engine);
+/* Reads and writes the given files, returning once all of them are done. */
+void ioEngineRun(struct IOEngine *engine, struct IOJob *reads,
+                 unsigned numReads, struct IOJob *writes, unsigned numWrites);
+
+#endif /* #define __LIBEOT_IO_ENGINE_H__ */
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
@@ -5,6 +5,7 @@
 
 #include <err.h>
 #include <libeot/libeot.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,6 +32,30 @@ void EOTprintError(enum EOTError error, FILE *out)
   case EOT_OTHER_STDLIB_ERROR:
     fputs("There was an unknown system error.\n", out);
     break;
+  case EOT_BUFFER_TOO_SMALL:
+    fputs("The buffer is too small for the converted font.\n", out);
+    break;
+  case EOT_NO_CMAP_TABLE:
+    fputs("The font has no cmap table, so it could not be subset.\n", out);
+    break;
+  case EOT_NO_HHEA_TABLE:
+    fputs("The font has no hhea table.\n", out);
+    break;
+  case EOT_WARN_NOT_ENOUGH_SPACE_RESERVED:
+  case EOT_WARN_NOT_ENOUGH_GLYPHS:
+    fputs("The glyph data of the font appears incomplete.\n", out);
+    break;
+  case EOT_WARN_BAD_VERSION:
+    fputs("The font's header is laid out for another version of EOT than the "
+          "one it claims.\n",
+          out);
+    break;
+  case EOT_WARN_DROPPED_HDMX:
+    fputs("The hdmx table could not be decoded, so it was left out.\n", out);
+    break;
+  case EOT_WARN_DROPPED_VDMX:
+    fputs("The VDMX table was malformed, so it was left out.\n", out);
+    break;
   case EOT_COMPRESSION_NOT_YET_IMPLEMENTED:
     fputs("MTX Compression has not yet been implemented in this version of "
           "libeot. The font could therefore not be converted.\n",
@@ -44,47 +69,291 @@ void EOTprintError(enum EOTError error, FILE *out)
   }
 }
 
-enum EOTError EOT2ttf_file(const uint8_t *font, unsigned fontSize,
-                           struct EOTMetadata *metadataOut, FILE *out)
+/* Prints result if it is a warning, for the entry points that print theirs,
+ * and returns EOT_SUCCESS in its place. */
+enum EOTError _libeot_printWarning(enum EOTError result)
 {
-  enum EOTError result = EOTfillMetadata(font, fontSize, metadataOut);
   if (result >= EOT_WARN) {
     EOTprintError(result, stderr);
-  } else if (result != EOT_SUCCESS) {
+    return EOT_SUCCESS;
+  }
+  return result;
+}
+
+enum EOTError fillConversionMetadata(const uint8_t *font, unsigned fontSize,
+                                     const struct EOTConversionOptions *opts,
+                                     bool printWarnings,
+                                     struct EOTMetadata *metadataOut)
+{
+  enum EOTError result = EOTfillMetadataWithAllocator(
+      font, fontSize, opts ? opts->allocator : NULL, metadataOut);
+  return printWarnings ? _libeot_printWarning(result) : result;
+}
+
+enum EOTError EOT2ttf_file(const uint8_t *font, unsigned fontSize,
+                           struct EOTMetadata *metadataOut, FILE *out)
+{
+  enum EOTError result =
+      fillConversionMetadata(font, fontSize, NULL, true, metadataOut);
+  if (result != EOT_SUCCESS) {
     return result;
   }
 
   enum EOTError writeResult = writeFontFile(
       font + metadataOut->fontDataOffset, metadataOut->fontDataSize,
       metadataOut->flags & TTEMBED_TTCOMPRESSED,
-      metadataOut->flags & TTEMBED_XORENCRYPTDATA, out);
-  if (writeResult != EOT_SUCCESS) {
-    return writeResult;
+      metadataOut->flags & TTEMBED_XORENCRYPTDATA, NULL, NULL, out);
+  return _libeot_printWarning(writeResult);
+}
+
+enum EOTError EOT2ttf_fd(const uint8_t *font, unsigned fontSize,
+                         const struct EOTConversionOptions *opts,
+                         struct EOTMetadata *metadataOut, int fd)
+{
+  enum EOTError result =
+      fillConversionMetadata(font, fontSize, opts, true, metadataOut);
+  if (result != EOT_SUCCESS) {
+    return result;
+  }
+  result = writeFontFd(font + metadataOut->fontDataOffset,
+                       metadataOut->fontDataSize,
+                       metadataOut->flags & TTEMBED_TTCOMPRESSED,
+                       metadataOut->flags & TTEMBED_XORENCRYPTDATA, opts, NULL,
+                       fd);
+  return _libeot_printWarning(result);
+}
+
+enum EOTError EOT2ttf_callback(const uint8_t *font, unsigned fontSize,
+                               const struct EOTConversionOptions *opts,
+                               struct EOTMetadata *metadataOut,
+                               EOTWriteCallback write, void *userData)
+{
+  enum EOTError result =
+      fillConversionMetadata(font, fontSize, opts, true, metadataOut);
+  if (result != EOT_SUCCESS) {
+    return result;
   }
-  return EOT_SUCCESS;
+  result = writeFontCallback(font + metadataOut->fontDataOffset,
+                             metadataOut->fontDataSize,
+                             metadataOut->flags & TTEMBED_TTCOMPRESSED,
+                             metadataOut->flags & TTEMBED_XORENCRYPTDATA, opts,
+                             NULL, write, userData);
+  return _libeot_printWarning(result);
 }
 
 enum EOTError EOT2ttf_buffer(const uint8_t *font, unsigned fontSize,
                              struct EOTMetadata *metadataOut, uint8_t **fontOut,
                              unsigned *fontSizeOut)
 {
-  enum EOTError result = EOTfillMetadata(font, fontSize, metadataOut);
-  if (result >= EOT_WARN) {
-    EOTprintError(result, stderr);
-  } else if (result != EOT_SUCCESS) {
+  return EOT2ttf_buffer_opts(font, fontSize, NULL, metadataOut, fontOut,
+                             fontSizeOut);
+}
+
+enum EOTError EOT2ttf_buffer_subset(const uint8_t *font, unsigned fontSize,
+                                    const uint32_t *codepoints,
+                                    unsigned numCodepoints,
+                                    struct EOTMetadata *metadataOut,
+                                    uint8_t **fontOut, unsigned *fontSizeOut)
+{
+  struct EOTConversionOptions opts = {0};
+  opts.subsetCodepoints = codepoints;
+  opts.numSubsetCodepoints = numCodepoints;
+  return EOT2ttf_buffer_opts(font, fontSize, &opts, metadataOut, fontOut,
+                             fontSizeOut);
+}
+
+enum EOTError EOT2ttf_buffer_opts(const uint8_t *font, unsigned fontSize,
+                                  const struct EOTConversionOptions *opts,
+                                  struct EOTMetadata *metadataOut,
+                                  uint8_t **fontOut, unsigned *fontSizeOut)
+{
+  enum EOTError result =
+      fillConversionMetadata(font, fontSize, opts, true, metadataOut);
+  if (result != EOT_SUCCESS) {
     return result;
   }
 
   enum EOTError writeResult = writeFontBuffer(
       font + metadataOut->fontDataOffset, metadataOut->fontDataSize,
       metadataOut->flags & TTEMBED_TTCOMPRESSED,
-      metadataOut->flags & TTEMBED_XORENCRYPTDATA, fontOut, fontSizeOut);
-  if (result >= EOT_WARN) {
-    EOTprintError(result, stderr);
-  } else if (writeResult != EOT_SUCCESS) {
-    return writeResult;
+      metadataOut->flags & TTEMBED_XORENCRYPTDATA, opts, NULL, fontOut,
+      fontSizeOut);
+  return _libeot_printWarning(writeResult);
+}
+
+enum EOTError EOT2ttf_buffer_borrow(const uint8_t *font, unsigned fontSize,
+                                    const struct EOTConversionOptions *opts,
+                                    struct EOTMetadata *metadataOut,
+                                    const uint8_t **fontOut,
+                                    unsigned *fontSizeOut, bool *borrowedOut)
+{
+  enum EOTError result =
+      fillConversionMetadata(font, fontSize, opts, true, metadataOut);
+  if (result != EOT_SUCCESS) {
+    return result;
+  }
+  if (!(metadataOut->flags &
+        (TTEMBED_TTCOMPRESSED | TTEMBED_XORENCRYPTDATA))) {
+    *fontOut = font + metadataOut->fontDataOffset;
+    *fontSizeOut = metadataOut->fontDataSize;
+    *borrowedOut = true;
+    return EOT_SUCCESS;
+  }
+  uint8_t *converted = NULL;
+  *borrowedOut = false;
+  result = writeFontBuffer(font + metadataOut->fontDataOffset,
+                           metadataOut->fontDataSize,
+                           metadataOut->flags & TTEMBED_TTCOMPRESSED,
+                           metadataOut->flags & TTEMBED_XORENCRYPTDATA, opts,
+                           NULL, &converted, fontSizeOut);
+  *fontOut = converted;
+  return _libeot_printWarning(result);
+}
+
+enum EOTError EOT2ttf_buffer_inplace(uint8_t *font, unsigned fontSize,
+                                     const struct EOTConversionOptions *opts,
+                                     struct EOTMetadata *metadataOut,
+                                     const uint8_t **fontOut,
+                                     unsigned *fontSizeOut, bool *borrowedOut)
+{
+  enum EOTError result =
+      fillConversionMetadata(font, fontSize, opts, true, metadataOut);
+  if (result != EOT_SUCCESS) {
+    return result;
+  }
+  bool encrypted = metadataOut->flags & TTEMBED_XORENCRYPTDATA;
+  if (!(metadataOut->flags & TTEMBED_TTCOMPRESSED)) {
+    if (encrypted) {
+      decryptFontInPlace(font + metadataOut->fontDataOffset,
+                         metadataOut->fontDataSize);
+    }
+    *fontOut = font + metadataOut->fontDataOffset;
+    *fontSizeOut = metadataOut->fontDataSize;
+    *borrowedOut = true;
+    return EOT_SUCCESS;
+  }
+  /* MTX data is decrypted while it is decoded, so it is left alone */
+  uint8_t *converted = NULL;
+  *borrowedOut = false;
+  result = writeFontBuffer(font + metadataOut->fontDataOffset,
+                           metadataOut->fontDataSize, true, encrypted, opts,
+                           NULL, &converted, fontSizeOut);
+  *fontOut = converted;
+  return _libeot_printWarning(result);
+}
+
+enum EOTError EOT2ttf_size(const uint8_t *font, unsigned fontSize,
+                           const struct EOTConversionOptions *opts,
+                           struct EOTMetadata *metadataOut,
+                           unsigned *fontSizeOut)
+{
+  return EOT2ttf_size_ctx(NULL, font, fontSize, opts, metadataOut,
+                          fontSizeOut);
+}
+
+enum EOTError EOT2ttf_into(const uint8_t *font, unsigned fontSize,
+                           const struct EOTConversionOptions *opts,
+                           struct EOTMetadata *metadataOut, uint8_t *buf,
+                           unsigned bufSize, unsigned *fontSizeOut)
+{
+  return EOT2ttf_into_ctx(NULL, font, fontSize, opts, metadataOut, buf,
+                          bufSize, fontSizeOut);
+}
+
+enum EOTError EOT2ttf_size_ctx(struct EOTContext *ctx, const uint8_t *font,
+                               unsigned fontSize,
+                               const struct EOTConversionOptions *opts,
+                               struct EOTMetadata *metadataOut,
+                               unsigned *fontSizeOut)
+{
+  enum EOTError result =
+      fillConversionMetadata(font, fontSize, opts, true, metadataOut);
+  if (result != EOT_SUCCESS) {
+    return result;
+  }
+  result = measureFont(font + metadataOut->fontDataOffset,
+                       metadataOut->fontDataSize,
+                       metadataOut->flags & TTEMBED_TTCOMPRESSED,
+                       metadataOut->flags & TTEMBED_XORENCRYPTDATA, opts, ctx,
+                       fontSizeOut);
+  return _libeot_printWarning(result);
+}
+
+enum EOTError EOT2ttf_into_ctx(struct EOTContext *ctx, const uint8_t *font,
+                               unsigned fontSize,
+                               const struct EOTConversionOptions *opts,
+                               struct EOTMetadata *metadataOut, uint8_t *buf,
+                               unsigned bufSize, unsigned *fontSizeOut)
+{
+  enum EOTError result =
+      fillConversionMetadata(font, fontSize, opts, true, metadataOut);
+  if (result != EOT_SUCCESS) {
+    return result;
+  }
+  result = writeFontInto(font + metadataOut->fontDataOffset,
+                         metadataOut->fontDataSize,
+                         metadataOut->flags & TTEMBED_TTCOMPRESSED,
+                         metadataOut->flags & TTEMBED_XORENCRYPTDATA, opts,
+                         ctx, buf, bufSize, fontSizeOut);
+  return _libeot_printWarning(result);
+}
+
+enum EOTError EOT2ttf_buffer_ctx(struct EOTContext *ctx, const uint8_t *font,
+                                 unsigned fontSize,
+                                 const struct EOTConversionOptions *opts,
+                                 struct EOTMetadata *metadataOut,
+                                 const uint8_t **fontOut, unsigned *fontSizeOut)
+{
+  enum EOTError result =
+      fillConversionMetadata(font, fontSize, opts, true, metadataOut);
+  if (result != EOT_SUCCESS) {
+    return result;
+  }
+  uint8_t *converted = NULL;
+  result = writeFontBuffer(font + metadataOut->fontDataOffset,
+                           metadataOut->fontDataSize,
+                           metadataOut->flags & TTEMBED_TTCOMPRESSED,
+                           metadataOut->flags & TTEMBED_XORENCRYPTDATA, opts,
+                           ctx, &converted, fontSizeOut);
+  *fontOut = converted;
+  return _libeot_printWarning(result);
+}
+
+enum EOTError EOT2ttf_fd_ctx(struct EOTContext *ctx, const uint8_t *font,
+                             unsigned fontSize,
+                             const struct EOTConversionOptions *opts,
+                             struct EOTMetadata *metadataOut, int fd)
+{
+  enum EOTError result =
+      fillConversionMetadata(font, fontSize, opts, true, metadataOut);
+  if (result != EOT_SUCCESS) {
+    return result;
+  }
+  result = writeFontFd(font + metadataOut->fontDataOffset,
+                       metadataOut->fontDataSize,
+                       metadataOut->flags & TTEMBED_TTCOMPRESSED,
+                       metadataOut->flags & TTEMBED_XORENCRYPTDATA, opts, ctx,
+                       fd);
+  return _libeot_printWarning(result);
+}
+
+enum EOTError EOT2ttf_callback_ctx(struct EOTContext *ctx, const uint8_t *font,
+                                   unsigned fontSize,
+                                   const struct EOTConversionOptions *opts,
+                                   struct EOTMetadata *metadataOut,
+                                   EOTWriteCallback write, void *userData)
+{
+  enum EOTError result =
+      fillConversionMetadata(font, fontSize, opts, true, metadataOut);
+  if (result != EOT_SUCCESS) {
+    return result;
   }
-  return EOT_SUCCESS;
+  result = writeFontCallback(font + metadataOut->fontDataOffset,
+                             metadataOut->fontDataSize,
+                             metadataOut->flags & TTEMBED_TTCOMPRESSED,
+                             metadataOut->flags & TTEMBED_XORENCRYPTDATA, opts,
+                             ctx, write, userData);
+  return _libeot_printWarning(result);
 }
 
 void EOTfreeBuffer(const uint8_t *buffer) { free((void *)buffer); }
@@ -314,14 +314,23 @@ static short MapCodeToIndex(AHUFF *t, register short code)
 
 /* Constructor */
 AHUFF *MTX_AHUFF_Create(MTX_MemHandler *mem, BITIO *bio, short rangeIn)
+{
+  AHUFF *t = (AHUFF *)MTX_mem_malloc(mem, sizeof(AHUFF));
+  t->mem = mem;
+  t->symbolIndex = NULL;
+  t->tree = NULL;
+  t->capacity = 0;
+  MTX_AHUFF_Reset(t, bio, rangeIn);
+  return t; /*****/
+}
+
+/* Re-initializer, reusing the tables when they are large enough */
+void MTX_AHUFF_Reset(AHUFF *t, BITIO *bio, short rangeIn)
 {
   short i, limit, range;
   long j;
   const short ROOT = 1;
 
-  AHUFF *t = (AHUFF *)MTX_mem_malloc(mem, sizeof(AHUFF));
-  t->mem = mem;
-
   t->bio = bio;
   range = rangeIn;
   t->range = rangeIn;
@@ -339,10 +348,15 @@ AHUFF *MTX_AHUFF_Create(MTX_MemHandler *mem, BITIO *bio, short rangeIn)
 
   t->sym_count = 0;
   t->countA = t->countB = 100;
-  /*t->symbolIndex = new short[ range ]; */
-  t->symbolIndex = (short *)MTX_mem_malloc(mem, sizeof(short) * range);
-  /*t->tree  = new nodeType [ 2*range ]; */
-  t->tree = (nodeType *)MTX_mem_malloc(mem, sizeof(nodeType) * 2 * range);
+  if (t->capacity < range) {
+    /*t->symbolIndex = new short[ range ]; */
+    t->symbolIndex = (short *)MTX_mem_realloc(t->mem, t->symbolIndex,
+                                              sizeof(short) * range);
+    /*t->tree  = new nodeType [ 2*range ]; */
+    t->tree = (nodeType *)MTX_mem_realloc(t->mem, t->tree,
+                                          sizeof(nodeType) * 2 * range);
+    t->capacity = range;
+  }
 
   /* Initialize the Huffman tree */
 
@@ -394,7 +408,6 @@ AHUFF *MTX_AHUFF_Create(MTX_MemHandler *mem, BITIO *bio, short rangeIn)
     }
   }
   t->countA = t->countB = 0;
-  return t; /*****/
 }
 
 /* Deconstructor */
@@ -42,7 +42,7 @@ short MTX_BITIO_input_bit(register BITIO *t)
 {
   /*assert( t->ReadOrWrite == 'r' ); */
   if (t->input_bit_count-- == 0) {
-    t->input_bit_buffer = t->mem_bytes[t->mem_index++];
+    t->input_bit_buffer = t->mem_bytes[t->mem_index++] ^ t->input_key;
     if (t->mem_index > t->mem_size) {
       longjmp(t->mem->env, ERR_BITIO_end_of_file);
     }
@@ -53,6 +53,13 @@ short MTX_BITIO_input_bit(register BITIO *t)
   return (t->input_bit_buffer & 0x100); /******/
 }
 
+/* Makes the input be read as if every byte had been XORed with key */
+void MTX_BITIO_SetInputKey(BITIO *t, unsigned char key)
+{
+  assert(t->ReadOrWrite == 'r');
+  t->input_key = key;
+}
+
 /* Write one bit to the output memory */
 void MTX_BITIO_output_bit(register BITIO *t, unsigned long bit)
 {
@@ -116,7 +123,13 @@ BITIO *MTX_BITIO_Create(MTX_MemHandler *mem, void *memPtr, long memSize,
 {
   BITIO *t = (BITIO *)MTX_mem_malloc(mem, sizeof(BITIO));
   t->mem = mem;
+  MTX_BITIO_Reset(t, memPtr, memSize, param);
+  return t; /******/
+}
 
+/* Re-initializer for new memory */
+void MTX_BITIO_Reset(BITIO *t, void *memPtr, long memSize, const char param)
+{
   t->mem_bytes = (unsigned char *)memPtr;
   t->mem_index = 0;
   t->mem_size = memSize;
@@ -124,13 +137,12 @@ BITIO *MTX_BITIO_Create(MTX_MemHandler *mem, void *memPtr, long memSize,
 
   t->input_bit_count = 0;
   t->input_bit_buffer = 0;
+  t->input_key = 0;
   t->bytes_in = 0;
 
   t->output_bit_count = 0;
   t->output_bit_buffer = 0;
   t->bytes_out = 0;
-
-  return t; /******/
 }
 
 /* Destructor */
@@ -3,12 +3,16 @@
  * version 2.0. For full details, see the file LICENSE
  */
 
+#include "liblzcomp.h"
+
 #include <libeot/libeot.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "../util/alloc.h"
 #include "../util/stream.h"
+#include "../util/xor.h"
 #include "AHUFF.H"
 #include "BITIO.H"
 #include "ERRCODES.H"
@@ -20,55 +24,100 @@ unsigned be24ToCpu(const uint8_t *buf)
   return ((unsigned)buf[2]) | (((unsigned)buf[1]) << 8) |
          (((unsigned)buf[0]) << 16);
 }
-enum EOTError unpackMtx(struct Stream *buf, unsigned size, uint8_t **bufsOut,
+void freeMTXScratch(struct MTXScratch *scratch)
+{
+  if (scratch->lzcomp) {
+    MTX_LZCOMP_Destroy(scratch->lzcomp);
+  }
+  if (scratch->mem) {
+    for (unsigned i = 0; i < 3; ++i) {
+      MTX_mem_free(scratch->mem, scratch->bufs[i]);
+    }
+    MTX_mem_Destroy(scratch->mem);
+  }
+  *scratch = (struct MTXScratch){0};
+}
+
+enum EOTError unpackMtx(struct Stream *buf, unsigned size, unsigned numBlocks,
+                        uint8_t key, const struct EOTAllocator *alloc,
+                        struct MTXScratch *scratch, uint8_t **bufsOut,
                         unsigned *bufSizesOut)
 {
   for (unsigned i = 0; i < 3; ++i) {
     bufsOut[i] = NULL;
+    bufSizesOut[i] = 0;
   }
   enum StreamResult sResult;
   enum EOTError returnedStatus = EOT_SUCCESS;
-  LZCOMP *lzcomp = NULL;
-  MTX_MemHandler *mem = MTX_mem_Create(&malloc, &realloc, &free);
-  if (!mem) {
-    goto CLEANUP;
+  struct MTXScratch ownScratch = {0};
+  struct MTXScratch *s = scratch ? scratch : &ownScratch;
+  if (!s->mem) {
+    alloc = resolveAllocator(alloc);
+    s->mem = MTX_mem_Create(alloc->malloc, alloc->realloc, alloc->free,
+                            alloc->userData);
+    if (!s->mem) {
+      returnedStatus = EOT_CANT_ALLOCATE_MEMORY;
+      goto CLEANUP;
+    }
   }
-  lzcomp = MTX_LZCOMP_Create1(mem);
-  if (!lzcomp) {
+  if (!s->lzcomp) {
+    s->lzcomp = MTX_LZCOMP_Create1(s->mem);
+    if (!s->lzcomp) {
+      returnedStatus = EOT_CANT_ALLOCATE_MEMORY;
+      goto CLEANUP;
+    }
+  }
+  MTX_LZCOMP_SetInputKey(s->lzcomp, key);
+  /* only the header is decrypted up front; the blocks are decrypted by the
+   * decoder as it reads them */
+  uint8_t headerBytes[10];
+  if (buf->size < sizeof(headerBytes)) {
+    returnedStatus = EOT_MTX_ERROR;
     goto CLEANUP;
   }
+  xorBuffer(headerBytes, buf->buf, sizeof(headerBytes), key);
+  struct Stream header = constructStream(headerBytes, sizeof(headerBytes));
   uint8_t versionMagic;
   uint32_t offsets[3];
   offsets[0] = 10;
   uint32_t copyLimit;
-  sResult = BEReadU8(buf, &versionMagic);
+  sResult = BEReadU8(&header, &versionMagic);
   CHK_CN(sResult, EOT_MTX_ERROR);
-  sResult = BEReadU24(buf, &copyLimit);
+  sResult = BEReadU24(&header, &copyLimit);
   CHK_CN(sResult, EOT_MTX_ERROR);
   for (unsigned i = 1 /* sic */; i < 3; ++i) {
-    sResult = BEReadU24(buf, &offsets[i]);
+    sResult = BEReadU24(&header, &offsets[i]);
     CHK_CN(sResult, EOT_MTX_ERROR);
   }
   unsigned sizes[] = {offsets[1] - offsets[0], offsets[2] - offsets[1],
                       buf->size - offsets[2]};
-  for (unsigned i = 0; i < 3; ++i) {
+  for (unsigned i = 0; i < numBlocks && i < 3; ++i) {
     if (offsets[i] + sizes[i] > buf->size) {
       returnedStatus = EOT_MTX_ERROR;
       goto CLEANUP;
     }
     long sizeOut;
-    bufsOut[i] = (uint8_t *)MTX_LZCOMP_UnPackMemory(
-        lzcomp, buf->buf + offsets[i], sizes[i], &sizeOut, versionMagic);
-    bufSizesOut[i] = sizeOut;
-    if (!bufsOut[i]) {
+    if (!MTX_LZCOMP_UnPackMemoryInto(s->lzcomp, buf->buf + offsets[i],
+                                     sizes[i], &s->bufs[i], &s->bufSizes[i],
+                                     &sizeOut, versionMagic)) {
       returnedStatus = EOT_MTX_ERROR;
       goto CLEANUP;
     }
+    bufsOut[i] = s->bufs[i];
+    bufSizesOut[i] = sizeOut;
   }
 CLEANUP:
-  if (lzcomp)
-    MTX_LZCOMP_Destroy(lzcomp);
-  free(mem);
+  if (!scratch) {
+    /* hand the buffers over, or drop them along with everything else */
+    for (unsigned i = 0; i < 3; ++i) {
+      if (returnedStatus == EOT_SUCCESS) {
+        ownScratch.bufs[i] = NULL;
+      } else {
+        bufsOut[i] = NULL;
+      }
+    }
+    freeMTXScratch(&ownScratch);
+  }
   return returnedStatus;
 }
 #ifdef LZCOMP_MAIN
@@ -79,7 +128,9 @@ int main(int argc, char **argv)
     usage(argv[0]);
     return 1;
   }
-  MTX_MemHandler *mem = MTX_mem_Create(&malloc, &realloc, &free);
+  const struct EOTAllocator *libc = resolveAllocator(NULL);
+  MTX_MemHandler *mem =
+      MTX_mem_Create(libc->malloc, libc->realloc, libc->free, NULL);
   LZCOMP *lzcomp = MTX_LZCOMP_Create1(mem);
   FILE *in = fopen(argv[1], "rb");
   if (in == NULL) {
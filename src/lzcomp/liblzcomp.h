@@ -9,8 +9,29 @@
 #include <libeot/libeot.h>
 
 #include "../util/stream.h"
+#include "LZCOMP.H"
+#include "MTXMEM.H"
 
-enum EOTError unpackMtx(struct Stream *buf, unsigned size, uint8_t **bufsOut,
+/* The decoder and the buffers it unpacks into, which unpackMtx keeps from one
+ * call to the next when it is handed one of these. Start from all zeros. */
+struct MTXScratch {
+  MTX_MemHandler *mem;
+  LZCOMP *lzcomp;
+  uint8_t *bufs[3];
+  long bufSizes[3]; /* bytes allocated for each of bufs */
+};
+
+void freeMTXScratch(struct MTXScratch *scratch);
+
+/* Only the first numBlocks blocks are unpacked; the other buffers are left
+ * NULL. buf is read as if every byte had been XORed with key, which is 0 for
+ * unencrypted data. The decoder and the buffers are allocated from alloc,
+ * which must be the same every time a given scratch is used. With a scratch,
+ * the buffers belong to it and are only valid until its next use; without
+ * one, they belong to the caller. */
+enum EOTError unpackMtx(struct Stream *buf, unsigned size, unsigned numBlocks,
+                        uint8_t key, const struct EOTAllocator *alloc,
+                        struct MTXScratch *scratch, uint8_t **bufsOut,
                         unsigned *bufSizesOut);
 
 #endif
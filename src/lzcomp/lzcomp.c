@@ -774,7 +774,8 @@ static void Encode(LZCOMP *t)
 /* This method does the de-compression work */
 /* There is potential to save some memory in the future by uniting */
 /* dataOut and ptr1 only when the run length encoding is not used. */
-static unsigned char *Decode(register LZCOMP *t, long *size)
+static unsigned char *Decode(register LZCOMP *t, unsigned char *dataOut,
+                             long dataOutSize, long *size, long *sizeAllocated)
 {
   register int symbol;
   long j, length, distance, start, pos = 0;
@@ -782,11 +783,13 @@ static unsigned char *Decode(register LZCOMP *t, long *size)
   register unsigned char *ptr1;
   register unsigned char value;
   register int usingRunLength = t->usingRunLength;
-  long dataOutSize, index = 0;
-  unsigned char *dataOut;
+  long index = 0;
   const long preLoadSize = 2 * 32 * 96 + 4 * 256;
 
-  dataOut = (unsigned char *)MTX_mem_malloc(t->mem, dataOutSize = t->out_len);
+  if (dataOut == NULL || dataOutSize < t->out_len) {
+    dataOut = (unsigned char *)MTX_mem_realloc(t->mem, dataOut,
+                                               dataOutSize = t->out_len);
+  }
 
   InitializeModel(t, false);
   if (!t->ptr1_IsSizeLimited) {
@@ -932,16 +935,34 @@ static unsigned char *Decode(register LZCOMP *t, long *size)
   if (pos != t->out_len)
     longjmp(t->mem->env, ERR_LZCOMP_Decode_bounds);
   *size = index;
+  *sizeAllocated = dataOutSize;
   assert(dataOutSize >= *size);
-  if (t->usingRunLength) {
-    dataOut = (unsigned char *)MTX_mem_realloc(
-        t->mem, dataOut, *size); /* Free up some memory if possible */
-  }
   return dataOut; /******/
 }
 
 #endif /*DECOMPRESS_ON */
 
+/* Frees the objects UnPackMemory keeps between calls */
+static void FreeCoders(LZCOMP *t)
+{
+  if (t->dist_ecoder != NULL) {
+    MTX_AHUFF_Destroy(t->dist_ecoder);
+    MTX_AHUFF_Destroy(t->len_ecoder);
+  }
+  if (t->sym_ecoder != NULL) {
+    MTX_AHUFF_Destroy(t->sym_ecoder);
+  }
+  if (t->bitIn != NULL) {
+    MTX_BITIO_Destroy(t->bitIn);
+  }
+  if (t->rlComp != NULL) {
+    MTX_RUNLENGTHCOMP_Destroy(t->rlComp);
+  }
+  t->dist_ecoder = t->len_ecoder = t->sym_ecoder = NULL;
+  t->bitIn = NULL;
+  t->rlComp = NULL;
+}
+
 #ifdef COMPRESS_ON
 void *memcpyHuge(void *object2, void *object1, unsigned long size)
 {
@@ -973,10 +994,12 @@ unsigned char *MTX_LZCOMP_PackMemory(register LZCOMP *t, void *dataIn,
   t->length1 = size_in;
 
   /* DeAllocate Memory */
+  FreeCoders(t);
   if (t->ptr1 != NULL) {
     MTX_mem_free(t->mem, t->ptr1);
   }
   t->ptr1 = NULL;
+  t->ptr1Size = 0;
 
   /* Allocate Memory */
   t->ptr1 = (unsigned char *)MTX_mem_malloc(
@@ -1054,60 +1077,86 @@ unsigned char *MTX_LZCOMP_UnPackMemory(register LZCOMP *t, void *dataIn,
                                        long dataInSize, long *sizeOut,
                                        unsigned char version)
 {
-  long maxOutSize;
-  unsigned char *dataOut;
+  unsigned char *dataOut = NULL;
+  long dataOutSize = 0;
+
+  MTX_LZCOMP_UnPackMemoryInto(t, dataIn, dataInSize, &dataOut, &dataOutSize,
+                              sizeOut, version);
+  if (t->usingRunLength) {
+    dataOut = (unsigned char *)MTX_mem_realloc(
+        t->mem, dataOut, *sizeOut); /* Free up some memory if possible */
+  }
+  return dataOut; /******/
+}
+
+/* Call this method to un-compress memory into a buffer that is reused */
+unsigned char *MTX_LZCOMP_UnPackMemoryInto(register LZCOMP *t, void *dataIn,
+                                           long dataInSize,
+                                           unsigned char **dataOut,
+                                           long *dataOutSize, long *sizeOut,
+                                           unsigned char version)
+{
+  long maxOutSize, ptr1Size;
   const long len_width = 3;
   const long dist_width = 3;
   const long preLoadSize = 2 * 32 * 96 + 4 * 256;
 
   assert(dataIn != NULL);
 
-  /* DeAllocate Memory */
-  if (t->ptr1 != NULL) {
-    MTX_mem_free(t->mem, t->ptr1);
+  /* The objects below are kept from the previous call, if there was one */
+  if (t->rlComp == NULL) {
+    t->rlComp = MTX_RUNLENGTHCOMP_Create(t->mem);
+  } else {
+    MTX_RUNLENGTHCOMP_Reset(t->rlComp);
   }
-  t->ptr1 = NULL;
-  t->rlComp = MTX_RUNLENGTHCOMP_Create(t->mem);
 
-  t->bitIn = MTX_BITIO_Create(t->mem, dataIn, dataInSize, 'r');
+  if (t->bitIn == NULL) {
+    t->bitIn = MTX_BITIO_Create(t->mem, dataIn, dataInSize, 'r');
+  } else {
+    MTX_BITIO_Reset(t->bitIn, dataIn, dataInSize, 'r');
+  }
   assert(t->bitIn != NULL);
+  MTX_BITIO_SetInputKey(t->bitIn, t->inputKey);
   if (version == 1) { /* 5-Aug-96 awr */
     t->usingRunLength = false;
   } else {
     t->usingRunLength = MTX_BITIO_input_bit(t->bitIn);
   }
 
-  t->dist_ecoder =
-      MTX_AHUFF_Create(t->mem, t->bitIn, (short)(1L << dist_width));
+  if (t->dist_ecoder == NULL) {
+    t->dist_ecoder =
+        MTX_AHUFF_Create(t->mem, t->bitIn, (short)(1L << dist_width));
+    t->len_ecoder =
+        MTX_AHUFF_Create(t->mem, t->bitIn, (short)(1L << len_width));
+  } else {
+    MTX_AHUFF_Reset(t->dist_ecoder, t->bitIn, (short)(1L << dist_width));
+    MTX_AHUFF_Reset(t->len_ecoder, t->bitIn, (short)(1L << len_width));
+  }
   assert(t->dist_ecoder != NULL);
-  t->len_ecoder = MTX_AHUFF_Create(t->mem, t->bitIn, (short)(1L << len_width));
   assert(t->len_ecoder != NULL);
 
   t->out_len = MTX_BITIO_ReadValue(t->bitIn, 24);
   SetDistRange(t, t->out_len); /* Sets t->NUM_SYMS */
   /* Allocate Memory, but never more than t->maxCopyDistance bytes */
   maxOutSize = t->out_len + preLoadSize;
-  t->ptr1 = (unsigned char *)MTX_mem_malloc(
-      t->mem, sizeof(unsigned char) * (t->maxCopyDistance < maxOutSize
-                                       ? t->ptr1_IsSizeLimited = true,
-                                       t->maxCopyDistance : maxOutSize));
+  t->ptr1_IsSizeLimited = t->maxCopyDistance < maxOutSize;
+  ptr1Size = t->ptr1_IsSizeLimited ? t->maxCopyDistance : maxOutSize;
+  if (t->ptr1Size < ptr1Size) {
+    MTX_mem_free(t->mem, t->ptr1);
+    t->ptr1 = (unsigned char *)MTX_mem_malloc(
+        t->mem, sizeof(unsigned char) * ptr1Size);
+    t->ptr1Size = ptr1Size;
+  }
 
-  t->sym_ecoder = MTX_AHUFF_Create(t->mem, t->bitIn, (short)t->NUM_SYMS);
+  if (t->sym_ecoder == NULL) {
+    t->sym_ecoder = MTX_AHUFF_Create(t->mem, t->bitIn, (short)t->NUM_SYMS);
+  } else {
+    MTX_AHUFF_Reset(t->sym_ecoder, t->bitIn, (short)t->NUM_SYMS);
+  }
 
   assert(t->sym_ecoder != NULL);
-  dataOut = Decode(t, sizeOut); /* Do the work ! */
-
-  MTX_AHUFF_Destroy(t->dist_ecoder);
-  t->dist_ecoder = NULL;
-  MTX_AHUFF_Destroy(t->len_ecoder);
-  t->len_ecoder = NULL;
-  MTX_AHUFF_Destroy(t->sym_ecoder);
-  t->sym_ecoder = NULL;
-
-  MTX_BITIO_Destroy(t->bitIn);
-  t->bitIn = NULL;
-  MTX_RUNLENGTHCOMP_Destroy(t->rlComp);
-  t->rlComp = NULL;
+  *dataOut = Decode(t, *dataOut, *dataOutSize, sizeOut,
+                    dataOutSize); /* Do the work ! */
 
   assert(t->usingRunLength || *sizeOut < maxOutSize);
 
@@ -1116,11 +1165,17 @@ unsigned char *MTX_LZCOMP_UnPackMemory(register LZCOMP *t, void *dataIn,
    * endl; */
   printf("Wrote %ld Bytes to file <%s>\n", (long)*sizeOut, outName);
 #endif
-  return dataOut; /******/
+  return *dataOut; /******/
 }
 
 #endif /* DECOMPRESS_ON */
 
+/* Sets the key the input of MTX_LZCOMP_UnPackMemory is XOR-encrypted with */
+void MTX_LZCOMP_SetInputKey(LZCOMP *t, unsigned char key)
+{
+  t->inputKey = key;
+}
+
 /* Constructor */
 LZCOMP *MTX_LZCOMP_Create1(MTX_MemHandler *mem)
 {
@@ -1129,8 +1184,13 @@ LZCOMP *MTX_LZCOMP_Create1(MTX_MemHandler *mem)
   t->mem = mem;
 
   t->ptr1 = NULL;
+  t->ptr1Size = 0;
+  t->rlComp = NULL;
+  t->dist_ecoder = t->len_ecoder = t->sym_ecoder = NULL;
+  t->bitIn = t->bitOut = NULL;
   t->maxCopyDistance = 0x7fffffff;
   t->ptr1_IsSizeLimited = false;
+  t->inputKey = 0;
 #ifdef COMPRESS_ON
   t->freeList = NULL;
   t->hashTable = NULL;
@@ -1148,10 +1208,15 @@ LZCOMP *MTX_LZCOMP_Create2(MTX_MemHandler *mem, long maxCopyDistance)
   t->mem = mem;
 
   t->ptr1 = NULL;
+  t->ptr1Size = 0;
+  t->rlComp = NULL;
+  t->dist_ecoder = t->len_ecoder = t->sym_ecoder = NULL;
+  t->bitIn = t->bitOut = NULL;
   t->maxCopyDistance = maxCopyDistance;
   if (t->maxCopyDistance < (preLoadSize + 64))
     t->maxCopyDistance = preLoadSize + 64;
   t->ptr1_IsSizeLimited = false;
+  t->inputKey = 0;
 #ifdef COMPRESS_ON
   t->freeList = NULL;
   t->hashTable = NULL;
@@ -1164,6 +1229,7 @@ LZCOMP *MTX_LZCOMP_Create2(MTX_MemHandler *mem, long maxCopyDistance)
 /* Deconstructor */
 void MTX_LZCOMP_Destroy(LZCOMP *t)
 {
+  FreeCoders(t);
   MTX_mem_free(t->mem, t->ptr1);
 #ifdef COMPRESS_ON
   FreeAllHashNodes(t);
@@ -1337,6 +1403,9 @@ RUNLENGTHCOMP *MTX_RUNLENGTHCOMP_Create(MTX_MemHandler *mem)
   return t;                /*****/
 }
 
+/* Re-initializer */
+void MTX_RUNLENGTHCOMP_Reset(RUNLENGTHCOMP *t) { t->state = initialState; }
+
 /* Deconstructor */
 void MTX_RUNLENGTHCOMP_Destroy(RUNLENGTHCOMP *t) { MTX_mem_free(t->mem, t); }
 
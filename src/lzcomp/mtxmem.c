@@ -9,23 +9,42 @@
 
 void *MTX_mem_malloc(MTX_MemHandler *t, unsigned long size)
 {
-  return t->malloc(size);
+  return t->malloc(t->userData, size);
 }
 
 void *MTX_mem_realloc(MTX_MemHandler *t, void *p, unsigned long size)
 {
-  return t->realloc(p, size);
+  if (p == NULL) {
+    return t->malloc(t->userData, size);
+  }
+  return t->realloc(t->userData, p, size);
 }
 
-void MTX_mem_free(MTX_MemHandler *t, void *deadObject) { t->free(deadObject); }
+void MTX_mem_free(MTX_MemHandler *t, void *deadObject)
+{
+  if (deadObject != NULL) {
+    t->free(t->userData, deadObject);
+  }
+}
 
 MTX_MemHandler *MTX_mem_Create(MTX_MALLOCPTR mptr, MTX_REALLOCPTR rptr,
-                               MTX_FREEPTR fptr)
+                               MTX_FREEPTR fptr, void *userData)
 {
-  MTX_MemHandler *t = (MTX_MemHandler *)malloc(sizeof(MTX_MemHandler));
+  MTX_MemHandler *t = (MTX_MemHandler *)mptr(userData, sizeof(MTX_MemHandler));
+  if (t == NULL) {
+    return NULL;
+  }
   *t = (MTX_MemHandler){0};
   t->malloc = mptr;
   t->realloc = rptr;
   t->free = fptr;
+  t->userData = userData;
   return t;
 }
+
+void MTX_mem_Destroy(MTX_MemHandler *t)
+{
+  if (t != NULL) {
+    t->free(t->userData, t);
+  }
+}
@@ -0,0 +1,206 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+#include <libeot/libeot.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/alloc.h"
+#include "util/utf8.h"
+
+#define RS_FNV_OFFSET 0xcbf29ce484222325ull
+#define RS_FNV_PRIME 0x100000001b3ull
+
+struct _rs_Slot {
+  uint64_t hash;
+  unsigned offset; /* of the key in keys */
+  unsigned length; /* of the key; 0 if the slot is free */
+};
+
+struct EOTRootStringMatcher {
+  const struct EOTAllocator *alloc;
+  /* the distinct key lengths, ascending */
+  unsigned numLengths;
+  unsigned *lengths;
+  /* open addressing with linear probing; the slot count is a power of 2 */
+  unsigned mask;
+  struct _rs_Slot *slots;
+  /* the keys back to back, as UTF-8 folded to lower case */
+  char *keys;
+};
+
+uint8_t _rs_fold(uint8_t c) { return c >= 'A' && c <= 'Z' ? c + 32 : c; }
+
+uint64_t _rs_step(uint64_t hash, uint8_t c)
+{
+  return (hash ^ _rs_fold(c)) * RS_FNV_PRIME;
+}
+
+/* Whether the first length bytes of url, whose hash is hash, are a key. */
+bool _rs_find(const struct EOTRootStringMatcher *m, uint64_t hash,
+              const char *url, unsigned length)
+{
+  for (unsigned i = hash & m->mask; m->slots[i].length != 0;
+       i = (i + 1) & m->mask) {
+    const struct _rs_Slot *slot = &m->slots[i];
+    if (slot->hash != hash || slot->length != length) {
+      continue;
+    }
+    const char *key = m->keys + slot->offset;
+    unsigned j = 0;
+    while (j < length && key[j] == (char)_rs_fold(url[j])) {
+      ++j;
+    }
+    if (j == length) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Adds the key at offset in m->keys unless it is already there. */
+void _rs_insert(struct EOTRootStringMatcher *m, unsigned offset,
+                unsigned length)
+{
+  const char *key = m->keys + offset;
+  uint64_t hash = RS_FNV_OFFSET;
+  for (unsigned i = 0; i < length; ++i) {
+    hash = _rs_step(hash, key[i]);
+  }
+  if (_rs_find(m, hash, key, length)) {
+    return;
+  }
+  unsigned i = hash & m->mask;
+  while (m->slots[i].length != 0) {
+    i = (i + 1) & m->mask;
+  }
+  m->slots[i].hash = hash;
+  m->slots[i].offset = offset;
+  m->slots[i].length = length;
+  unsigned at = 0;
+  while (at < m->numLengths && m->lengths[at] < length) {
+    ++at;
+  }
+  if (at == m->numLengths || m->lengths[at] != length) {
+    memmove(m->lengths + at + 1, m->lengths + at,
+            (m->numLengths - at) * sizeof(unsigned));
+    m->lengths[at] = length;
+    ++m->numLengths;
+  }
+}
+
+enum EOTError EOTcompileRootStrings(const struct EOTMetadata *metadata,
+                                    struct EOTRootStringMatcher **out)
+{
+  const struct EOTAllocator *alloc = metadata->allocator;
+  enum EOTError result = EOT_CANT_ALLOCATE_MEMORY;
+  uint8_t *scratch = NULL;
+  *out = NULL;
+  struct EOTRootStringMatcher *m = (struct EOTRootStringMatcher *)eotCalloc(
+      alloc, 1, sizeof(struct EOTRootStringMatcher));
+  if (!m) {
+    return EOT_CANT_ALLOCATE_MEMORY;
+  }
+  m->alloc = alloc;
+  unsigned n = metadata->numRootStrings;
+  unsigned keysSize = 0, longest = 0, offset = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    unsigned size = metadata->rootStrings[i].rootStringSize;
+    keysSize += size / 2 * 3;
+    longest = size > longest ? size : longest;
+  }
+  unsigned numSlots = 1;
+  while (numSlots < 2 * n) {
+    numSlots *= 2;
+  }
+  m->mask = numSlots - 1;
+  m->slots =
+      (struct _rs_Slot *)eotCalloc(alloc, numSlots, sizeof(struct _rs_Slot));
+  m->lengths = (unsigned *)eotMalloc(alloc, (n + 1) * sizeof(unsigned));
+  m->keys = (char *)eotMalloc(alloc, keysSize + 1);
+  scratch = (uint8_t *)eotMalloc(alloc, longest + 1);
+  if (!m->slots || !m->lengths || !m->keys || !scratch) {
+    goto CLEANUP;
+  }
+  for (unsigned i = 0; i < n; ++i) {
+    const struct EOTRootStringInfo *info = &metadata->rootStrings[i];
+    unsigned units = info->rootStringSize / 2;
+    /* the strings are in host order; the converter reads little-endian */
+    for (unsigned j = 0; j < units; ++j) {
+      scratch[2 * j] = info->rootString[j] & 0xFF;
+      scratch[2 * j + 1] = info->rootString[j] >> 8;
+    }
+    unsigned length =
+        utf16leToUTF8(scratch, units, (uint8_t *)m->keys + offset);
+    if (length == 0) {
+      continue;
+    }
+    for (unsigned j = 0; j < length; ++j) {
+      m->keys[offset + j] = _rs_fold(m->keys[offset + j]);
+    }
+    _rs_insert(m, offset, length);
+    offset += length;
+  }
+  result = EOT_SUCCESS;
+
+CLEANUP:
+  eotFree(alloc, scratch);
+  if (result != EOT_SUCCESS) {
+    EOTfreeRootStringMatcher(m);
+    return result;
+  }
+  *out = m;
+  return EOT_SUCCESS;
+}
+
+bool _rs_isBoundary(char c)
+{
+  return c == '/' || c == ':' || c == '?' || c == '#';
+}
+
+/* Whether a key of keyLength bytes matching the start of url ends at a
+ * boundary of url, so that http://a.com doesn't match http://a.com.evil.net. */
+bool _rs_endsAtBoundary(const char *url, size_t length, unsigned keyLength)
+{
+  return keyLength == length || _rs_isBoundary(url[keyLength - 1]) ||
+         _rs_isBoundary(url[keyLength]);
+}
+
+bool EOTmatchRootString(const struct EOTRootStringMatcher *matcher,
+                        const char *url, size_t length)
+{
+  uint64_t hash = RS_FNV_OFFSET;
+  size_t hashed = 0;
+  for (unsigned i = 0; i < matcher->numLengths; ++i) {
+    unsigned keyLength = matcher->lengths[i];
+    if (keyLength > length) {
+      break;
+    }
+    for (; hashed < keyLength; ++hashed) {
+      hash = _rs_step(hash, url[hashed]);
+    }
+    if (_rs_endsAtBoundary(url, length, keyLength) &&
+        _rs_find(matcher, hash, url, keyLength)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void EOTfreeRootStringMatcher(struct EOTRootStringMatcher *matcher)
+{
+  if (!matcher) {
+    return;
+  }
+  const struct EOTAllocator *alloc = matcher->alloc;
+  eotFree(alloc, matcher->slots);
+  eotFree(alloc, matcher->lengths);
+  eotFree(alloc, matcher->keys);
+  eotFree(alloc, matcher);
+}
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
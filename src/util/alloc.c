@@ -0,0 +1,84 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+#include "alloc.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+void *_alloc_libcMalloc(void *userData, size_t size)
+{
+  (void)userData;
+  return malloc(size);
+}
+
+void *_alloc_libcRealloc(void *userData, void *ptr, size_t size)
+{
+  (void)userData;
+  return realloc(ptr, size);
+}
+
+void _alloc_libcFree(void *userData, void *ptr)
+{
+  (void)userData;
+  free(ptr);
+}
+
+const struct EOTAllocator _alloc_libc = {_alloc_libcMalloc, _alloc_libcRealloc,
+                                         _alloc_libcFree, NULL};
+
+const struct EOTAllocator *resolveAllocator(const struct EOTAllocator *alloc)
+{
+  return alloc ? alloc : &_alloc_libc;
+}
+
+void *eotMalloc(const struct EOTAllocator *alloc, size_t size)
+{
+  if (!alloc) {
+    return malloc(size);
+  }
+  return alloc->malloc(alloc->userData, size);
+}
+
+void *eotCalloc(const struct EOTAllocator *alloc, size_t num, size_t size)
+{
+  if (!alloc) {
+    return calloc(num, size);
+  }
+  if (size != 0 && num > SIZE_MAX / size) {
+    return NULL;
+  }
+  void *ptr = alloc->malloc(alloc->userData, num * size);
+  if (ptr) {
+    memset(ptr, 0, num * size);
+  }
+  return ptr;
+}
+
+void *eotRealloc(const struct EOTAllocator *alloc, void *ptr, size_t size)
+{
+  if (!alloc) {
+    return realloc(ptr, size);
+  }
+  if (!ptr) {
+    return alloc->malloc(alloc->userData, size);
+  }
+  return alloc->realloc(alloc->userData, ptr, size);
+}
+
+void eotFree(const struct EOTAllocator *alloc, void *ptr)
+{
+  if (!ptr) {
+    return;
+  }
+  if (!alloc) {
+    free(ptr);
+    return;
+  }
+  alloc->free(alloc->userData, ptr);
+}
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
@@ -0,0 +1,23 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+#ifndef __LIBEOT_ALLOC_H__
+#define __LIBEOT_ALLOC_H__
+
+#include <libeot/EOTAllocator.h>
+#include <stddef.h>
+
+/* Returns the C library's allocator if alloc is NULL, else alloc. */
+const struct EOTAllocator *resolveAllocator(const struct EOTAllocator *alloc);
+
+/* These behave like their C library namesakes, only through alloc. */
+void *eotMalloc(const struct EOTAllocator *alloc, size_t size);
+void *eotCalloc(const struct EOTAllocator *alloc, size_t num, size_t size);
+void *eotRealloc(const struct EOTAllocator *alloc, void *ptr, size_t size);
+void eotFree(const struct EOTAllocator *alloc, void *ptr);
+
+#endif /* #define __LIBEOT_ALLOC_H__ */
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
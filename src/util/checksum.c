@@ -0,0 +1,120 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+#include "checksum.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CHECKSUM_X86
+#include <immintrin.h>
+#endif
+
+uint32_t _cs_readBE32(const uint8_t *buf)
+{
+  return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+         ((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+}
+
+/* The kernels below sum the first size bytes of src (a multiple of their word
+ * or vector size), copying them to dst on the way if dst is not NULL. */
+uint32_t _cs_scalar(uint8_t *dst, const uint8_t *src, unsigned size)
+{
+  uint32_t sum = 0;
+  for (unsigned i = 0; i < size; i += 4) {
+    sum += _cs_readBE32(src + i);
+  }
+  if (dst && size > 0) {
+    memcpy(dst, src, size);
+  }
+  return sum;
+}
+
+#ifdef CHECKSUM_X86
+__attribute__((target("ssse3"))) uint32_t
+_cs_ssse3(uint8_t *dst, const uint8_t *src, unsigned size)
+{
+  /* byte-swaps each 32-bit lane */
+  const __m128i swap =
+      _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  __m128i acc = _mm_setzero_si128();
+  for (unsigned i = 0; i < size; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    if (dst) {
+      _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi8(v, swap));
+  }
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (uint32_t)_mm_cvtsi128_si32(acc);
+}
+
+__attribute__((target("avx2"))) uint32_t
+_cs_avx2(uint8_t *dst, const uint8_t *src, unsigned size)
+{
+  const __m256i swap = _mm256_setr_epi8(
+      3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12, 3, 2, 1, 0, 7, 6, 5,
+      4, 11, 10, 9, 8, 15, 14, 13, 12);
+  __m256i acc = _mm256_setzero_si256();
+  for (unsigned i = 0; i < size; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    if (dst) {
+      _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+    acc = _mm256_add_epi32(acc, _mm256_shuffle_epi8(v, swap));
+  }
+  __m128i acc128 = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                                 _mm256_extracti128_si256(acc, 1));
+  acc128 = _mm_add_epi32(acc128,
+                         _mm_shuffle_epi32(acc128, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc128 = _mm_add_epi32(acc128,
+                         _mm_shuffle_epi32(acc128, _MM_SHUFFLE(2, 3, 0, 1)));
+  return (uint32_t)_mm_cvtsi128_si32(acc128);
+}
+#endif
+
+uint32_t _cs_run(uint8_t *dst, const uint8_t *src, unsigned size)
+{
+  uint32_t sum = 0;
+  unsigned done = 0;
+  if (size == 0) {
+    return 0;
+  }
+#ifdef CHECKSUM_X86
+  if (__builtin_cpu_supports("avx2")) {
+    done = size & ~31u;
+    sum = _cs_avx2(dst, src, done);
+  } else if (__builtin_cpu_supports("ssse3")) {
+    done = size & ~15u;
+    sum = _cs_ssse3(dst, src, done);
+  }
+#endif
+  unsigned words = (size - done) & ~3u;
+  sum += _cs_scalar(dst ? dst + done : NULL, src + done, words);
+  done += words;
+  if (done < size) {
+    uint8_t last[4] = {0, 0, 0, 0};
+    memcpy(last, src + done, size - done);
+    sum += _cs_readBE32(last);
+    if (dst) {
+      memcpy(dst + done, last, 4);
+    }
+  }
+  return sum;
+}
+
+uint32_t checkSum32(const uint8_t *buf, unsigned size)
+{
+  return _cs_run(NULL, buf, size);
+}
+
+uint32_t copyCheckSum32(uint8_t *dst, const uint8_t *src, unsigned size)
+{
+  return _cs_run(dst, src, size);
+}
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
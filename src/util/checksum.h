@@ -0,0 +1,21 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+#ifndef __LIBEOT_CHECKSUM_H__
+#define __LIBEOT_CHECKSUM_H__
+
+#include <stdint.h>
+
+/* Sums buf as big-endian 32-bit words, the way SFNT table checksums are
+ * defined. A trailing partial word is padded with zeros. */
+uint32_t checkSum32(const uint8_t *buf, unsigned size);
+
+/* Copies size bytes from src to dst, zero-fills dst up to the next multiple
+ * of 4 and returns the checksum of the padded copy, reading src only once. */
+uint32_t copyCheckSum32(uint8_t *dst, const uint8_t *src, unsigned size);
+
+#endif /* #define __LIBEOT_CHECKSUM_H__ */
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
@@ -0,0 +1,75 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+#include "siphash.h"
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+struct _sip_State {
+  uint64_t v0, v1, v2, v3;
+};
+
+void _sip_round(struct _sip_State *s)
+{
+  s->v0 += s->v1;
+  s->v1 = SIP_ROTL(s->v1, 13);
+  s->v1 ^= s->v0;
+  s->v0 = SIP_ROTL(s->v0, 32);
+  s->v2 += s->v3;
+  s->v3 = SIP_ROTL(s->v3, 16);
+  s->v3 ^= s->v2;
+  s->v0 += s->v3;
+  s->v3 = SIP_ROTL(s->v3, 21);
+  s->v3 ^= s->v0;
+  s->v2 += s->v1;
+  s->v1 = SIP_ROTL(s->v1, 17);
+  s->v1 ^= s->v2;
+  s->v2 = SIP_ROTL(s->v2, 32);
+}
+
+void _sip_compress(struct _sip_State *s, uint64_t m)
+{
+  s->v3 ^= m;
+  _sip_round(s);
+  _sip_round(s);
+  s->v0 ^= m;
+}
+
+uint64_t _sip_finish(struct _sip_State *s)
+{
+  for (unsigned i = 0; i < 4; ++i) {
+    _sip_round(s);
+  }
+  return s->v0 ^ s->v1 ^ s->v2 ^ s->v3;
+}
+
+void sipHash128(const uint64_t key[2], const uint8_t *data, size_t size,
+                uint64_t out[2])
+{
+  struct _sip_State s = {0x736f6d6570736575ull ^ key[0],
+                         0x646f72616e646f6dull ^ key[1] ^ 0xee,
+                         0x6c7967656e657261ull ^ key[0],
+                         0x7465646279746573ull ^ key[1]};
+  size_t words = size / 8;
+  for (size_t i = 0; i < words; ++i) {
+    const uint8_t *p = data + 8 * i;
+    uint64_t m = 0;
+    for (unsigned j = 0; j < 8; ++j) {
+      m |= (uint64_t)p[j] << (8 * j);
+    }
+    _sip_compress(&s, m);
+  }
+  uint64_t last = (uint64_t)size << 56;
+  for (unsigned j = 0; j < size % 8; ++j) {
+    last |= (uint64_t)data[8 * words + j] << (8 * j);
+  }
+  _sip_compress(&s, last);
+  s.v2 ^= 0xee;
+  out[0] = _sip_finish(&s);
+  s.v1 ^= 0xdd;
+  out[1] = _sip_finish(&s);
+}
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
@@ -0,0 +1,19 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+#ifndef __LIBEOT_SIPHASH_H__
+#define __LIBEOT_SIPHASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* SipHash-2-4 of size bytes at data, with the 128-bit result, under the
+ * 128-bit key. Without the key, inputs can't be made to collide on purpose. */
+void sipHash128(const uint64_t key[2], const uint8_t *data, size_t size,
+                uint64_t out[2]);
+
+#endif /* #define __LIBEOT_SIPHASH_H__ */
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
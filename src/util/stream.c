@@ -9,6 +9,9 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "alloc.h"
+#include "checksum.h"
+
 enum StreamResult BEReadRestAsU32(struct Stream *s, uint32_t *out)
 {
   if (s->pos >= s->size) {
@@ -50,6 +53,7 @@ struct Stream constructStream2(uint8_t *buf, unsigned size, unsigned reserved)
   ret.pos = 0;
   ret.reserved = reserved;
   ret.bitPos = 0;
+  ret.alloc = NULL;
   return ret;
 }
 
@@ -202,7 +206,7 @@ enum StreamResult reserve(struct Stream *s, unsigned toReserve)
   if (s->reserved >= toReserve) {
     return EOT_STREAM_OK;
   }
-  uint8_t *newBuf = realloc(s->buf, toReserve);
+  uint8_t *newBuf = (uint8_t *)eotRealloc(s->alloc, s->buf, toReserve);
   if (!newBuf) {
     return EOT_CANT_ALLOCATE_MEMORY_FOR_STREAM;
   }
@@ -321,17 +325,7 @@ enum StreamResult BEcheckSum32(struct Stream *s, uint32_t *out,
   if (endPos > s->size) {
     return EOT_NOT_ENOUGH_DATA;
   }
-  struct Stream slice = constructStream(s->buf + beginPos, endPos - beginPos);
-  enum StreamResult sResult = EOT_STREAM_OK;
-  *out = 0;
-  while (sResult == EOT_STREAM_OK) {
-    uint32_t chunk;
-    sResult = BEReadRestAsU32(&slice, &chunk);
-    *out += chunk;
-  }
-  if (sResult == EOT_NOT_ENOUGH_DATA) {
-    sResult = EOT_STREAM_OK;
-  }
-  return sResult;
+  *out = checkSum32(s->buf + beginPos, endPos - beginPos);
+  return EOT_STREAM_OK;
 }
 /* vim:set shiftwidth=2 softtabstop=2 expandtab: */
@@ -8,6 +8,8 @@
 
 #include <stdint.h>
 
+struct EOTAllocator;
+
 enum StreamResult {
   EOT_STREAM_OK,
   EOT_NOT_ENOUGH_DATA,
@@ -25,6 +27,8 @@ struct Stream {
   unsigned reserved;
   unsigned pos;
   unsigned bitPos;
+  /* what reserve grows buf with; NULL for the C library */
+  const struct EOTAllocator *alloc;
 };
 
 struct Stream constructStream(uint8_t *buf, unsigned size);
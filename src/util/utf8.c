@@ -0,0 +1,113 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+#include "utf8.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UTF8_X86
+#include <immintrin.h>
+#endif
+
+#ifdef UTF8_X86
+/* Converts the ASCII units at the start of src eight at a time, stopping at
+ * the first group of eight that isn't all ASCII. Returns how many units were
+ * converted, which is also how many bytes were written. */
+__attribute__((target("sse2"))) unsigned
+_utf8_ascii_sse2(const uint8_t *src, unsigned units, uint8_t *dst)
+{
+  const __m128i nonAscii = _mm_set1_epi16((short)0xFF80);
+  const __m128i zero = _mm_setzero_si128();
+  unsigned i = 0;
+  for (; i + 8 <= units; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+    __m128i high = _mm_and_si128(v, nonAscii);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi16(high, zero)) != 0xFFFF) {
+      break;
+    }
+    _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(v, v));
+  }
+  return i;
+}
+#endif
+
+/* Reads the code point at units[*i], advancing *i past it. */
+uint32_t _utf8_next(const uint8_t *src, unsigned units, unsigned *i)
+{
+  uint32_t c = (uint32_t)src[2 * *i] | ((uint32_t)src[2 * *i + 1] << 8);
+  ++*i;
+  if (c >= 0xD800 && c < 0xDC00 && *i < units) {
+    uint32_t low = (uint32_t)src[2 * *i] | ((uint32_t)src[2 * *i + 1] << 8);
+    if (low >= 0xDC00 && low < 0xE000) {
+      ++*i;
+      return 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+    }
+  }
+  if (c >= 0xD800 && c < 0xE000) {
+    return 0xFFFD;
+  }
+  return c;
+}
+
+unsigned _utf8_size(uint32_t c)
+{
+  return c < 0x80 ? 1 : (c < 0x800 ? 2 : (c < 0x10000 ? 3 : 4));
+}
+
+unsigned utf16leUTF8Length(const uint8_t *src, unsigned units)
+{
+  unsigned length = 0;
+  for (unsigned i = 0; i < units;) {
+    length += _utf8_size(_utf8_next(src, units, &i));
+  }
+  return length;
+}
+
+unsigned utf16leToUTF8(const uint8_t *src, unsigned units, uint8_t *dst)
+{
+  unsigned out = 0;
+  unsigned i = 0;
+#ifdef UTF8_X86
+  bool sse2 = __builtin_cpu_supports("sse2");
+#endif
+  while (i < units) {
+#ifdef UTF8_X86
+    if (sse2) {
+      unsigned run = _utf8_ascii_sse2(src + 2 * i, units - i, dst + out);
+      i += run;
+      out += run;
+      if (i == units) {
+        break;
+      }
+    }
+#endif
+    uint32_t c = _utf8_next(src, units, &i);
+    switch (_utf8_size(c)) {
+    case 1:
+      dst[out++] = (uint8_t)c;
+      break;
+    case 2:
+      dst[out++] = (uint8_t)(0xC0 | (c >> 6));
+      dst[out++] = (uint8_t)(0x80 | (c & 0x3F));
+      break;
+    case 3:
+      dst[out++] = (uint8_t)(0xE0 | (c >> 12));
+      dst[out++] = (uint8_t)(0x80 | ((c >> 6) & 0x3F));
+      dst[out++] = (uint8_t)(0x80 | (c & 0x3F));
+      break;
+    default:
+      dst[out++] = (uint8_t)(0xF0 | (c >> 18));
+      dst[out++] = (uint8_t)(0x80 | ((c >> 12) & 0x3F));
+      dst[out++] = (uint8_t)(0x80 | ((c >> 6) & 0x3F));
+      dst[out++] = (uint8_t)(0x80 | (c & 0x3F));
+      break;
+    }
+  }
+  return out;
+}
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
@@ -0,0 +1,21 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+#ifndef __LIBEOT_UTF8_H__
+#define __LIBEOT_UTF8_H__
+
+#include <stdint.h>
+
+/* The number of bytes utf16leToUTF8 produces for the same input. */
+unsigned utf16leUTF8Length(const uint8_t *src, unsigned units);
+
+/* Converts units UTF-16LE code units at src to UTF-8 in dst, which needs room
+ * for utf16leUTF8Length bytes, and never more than 3 per unit. Unpaired
+ * surrogates become U+FFFD. Returns the number of bytes written. */
+unsigned utf16leToUTF8(const uint8_t *src, unsigned units, uint8_t *dst);
+
+#endif /* #define __LIBEOT_UTF8_H__ */
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
@@ -0,0 +1,58 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+#include "xor.h"
+
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define XOR_X86
+#include <immintrin.h>
+#endif
+
+/* Like the checksum kernels, these handle the first size bytes, which must be
+ * a multiple of their vector size. Loads precede stores, so dst may be src. */
+#ifdef XOR_X86
+__attribute__((target("sse2"))) void _xor_sse2(uint8_t *dst,
+                                                const uint8_t *src,
+                                                unsigned size, uint8_t key)
+{
+  const __m128i k = _mm_set1_epi8((char)key);
+  for (unsigned i = 0; i < size; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(v, k));
+  }
+}
+
+__attribute__((target("avx2"))) void _xor_avx2(uint8_t *dst,
+                                                const uint8_t *src,
+                                                unsigned size, uint8_t key)
+{
+  const __m256i k = _mm256_set1_epi8((char)key);
+  for (unsigned i = 0; i < size; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(v, k));
+  }
+}
+#endif
+
+void xorBuffer(uint8_t *dst, const uint8_t *src, unsigned size, uint8_t key)
+{
+  unsigned done = 0;
+#ifdef XOR_X86
+  if (__builtin_cpu_supports("avx2")) {
+    done = size & ~31u;
+    _xor_avx2(dst, src, done, key);
+  } else if (__builtin_cpu_supports("sse2")) {
+    done = size & ~15u;
+    _xor_sse2(dst, src, done, key);
+  }
+#endif
+  for (unsigned i = done; i < size; ++i) {
+    dst[i] = src[i] ^ key;
+  }
+}
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
@@ -0,0 +1,16 @@
+/* Copyright (c) 2013 Brennan T. Vincent <brennanv@email.arizona.edu>
+ * This file is a part of libeot, which is licensed under the MPL license,
+ * version 2.0. For full details, see the file LICENSE
+ */
+
+#ifndef __LIBEOT_XOR_H__
+#define __LIBEOT_XOR_H__
+
+#include <stdint.h>
+
+/* Stores src[i] ^ key in dst[i] for the first size bytes. dst may be src. */
+void xorBuffer(uint8_t *dst, const uint8_t *src, unsigned size, uint8_t key);
+
+#endif /* #define __LIBEOT_XOR_H__ */
+
+/* vim:set shiftwidth=2 softtabstop=2 expandtab: */
@@ -3,98 +3,547 @@
  * version 2.0. For full details, see the file LICENSE
  */
 
+#include "writeFontFile.h"
+
+#include <errno.h>
 #include <libeot/libeot.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
 
+#include "ctf/SFNTContainer.h"
 #include "ctf/parseCTF.h"
 #include "lzcomp/liblzcomp.h"
+#include "util/alloc.h"
 #include "util/stream.h"
+#include "util/xor.h"
 const uint8_t ENCRYPTION_KEY = 0x50;
 
-enum EOTError writeFontBuffer(const uint8_t *font, unsigned fontSize,
-                              bool compressed, bool encrypted,
-                              uint8_t **finalOutBuffer, unsigned *finalFontSize)
+/* What a font was decoded from, to tell whether the font a context kept is
+ * the one asked for. */
+struct _wff_Source {
+  const uint8_t *font;
+  unsigned fontSize;
+  bool encrypted;
+  const uint32_t *subsetCodepoints;
+  unsigned numSubsetCodepoints;
+  bool generateVDMX;
+  bool stripHinting;
+};
+
+struct EOTContext {
+  struct MTXScratch mtx;
+  struct CTFScratch ctf;
+  /* the output of the last conversion into a buffer, or decrypted font data */
+  uint8_t *out;
+  unsigned outSize; /* bytes allocated for out */
+  const struct EOTAllocator *alloc;
+  /* Whether ctf.ctr still holds the font measureFont decoded, for a
+   * writeFontInto of the same font to write out without decoding it again.
+   * It is given up by any other conversion. */
+  bool kept;
+  struct _wff_Source keptSource;
+  enum EOTError keptWarning;
+};
+
+struct EOTContext *EOTcreateContext(void)
+{
+  return EOTcreateContextWithAllocator(NULL);
+}
+
+struct EOTContext *
+EOTcreateContextWithAllocator(const struct EOTAllocator *allocator)
+{
+  struct EOTContext *ctx = (struct EOTContext *)eotCalloc(
+      allocator, 1, sizeof(struct EOTContext));
+  if (ctx) {
+    ctx->alloc = allocator;
+    ctx->ctf.alloc = allocator;
+  }
+  return ctx;
+}
+
+void EOTfreeContext(struct EOTContext *ctx)
+{
+  if (!ctx) {
+    return;
+  }
+  const struct EOTAllocator *alloc = ctx->alloc;
+  freeMTXScratch(&ctx->mtx);
+  freeCTFScratch(&ctx->ctf);
+  eotFree(alloc, ctx->out);
+  eotFree(alloc, ctx);
+}
+
+enum EOTError _wff_reserveOut(struct EOTContext *ctx, unsigned size)
+{
+  if (ctx->outSize >= size && ctx->out) {
+    return EOT_SUCCESS;
+  }
+  uint8_t *out = (uint8_t *)eotRealloc(ctx->alloc, ctx->out, size ? size : 1);
+  if (!out) {
+    return EOT_CANT_ALLOCATE_MEMORY;
+  }
+  ctx->out = out;
+  ctx->outSize = size;
+  return EOT_SUCCESS;
+}
+
+/* Everything a conversion holds on to until the output has been written: the
+ * font data (the caller's own unless it had to be decrypted), and for MTX fonts
+ * the CTF streams together with the container whose tables borrow from them.
+ * With a context, all of that is lent by the context instead. */
+struct _wff_Unpacked {
+  struct EOTContext *ctx;
+  const struct EOTAllocator *alloc; /* what any of it was allocated from */
+  const uint8_t *data;
+  unsigned dataSize;
+  uint8_t *buf; /* owned copy of data, if one was needed */
+  uint8_t *ctfs[3];
+  struct SFNTContainer *ctr;
+  /* a warning from decoding the CTF data, or EOT_SUCCESS */
+  enum EOTError warning;
+};
+
+void _wff_free(struct _wff_Unpacked *u)
+{
+  if (u->ctx) {
+    /* let go of the tables' own buffers now, rather than at the next use */
+    if (u->ctr) {
+      clearContainer(u->ctr);
+    }
+    return;
+  }
+  eotFree(u->alloc, u->buf);
+  for (unsigned i = 0; i < 3; ++i) {
+    eotFree(u->alloc, u->ctfs[i]);
+  }
+  if (u->ctr) {
+    freeContainer(u->ctr);
+  }
+}
+
+struct _wff_Source _wff_source(const uint8_t *font, unsigned fontSize,
+                               bool encrypted,
+                               const struct EOTConversionOptions *opts)
+{
+  struct _wff_Source source = {.font = font,
+                               .fontSize = fontSize,
+                               .encrypted = encrypted};
+  if (opts) {
+    source.subsetCodepoints = opts->subsetCodepoints;
+    source.numSubsetCodepoints = opts->numSubsetCodepoints;
+    source.generateVDMX = opts->generateVDMX;
+    source.stripHinting = opts->stripHinting;
+  }
+  return source;
+}
+
+bool _wff_sameSource(const struct _wff_Source *a, const struct _wff_Source *b)
+{
+  return a->font == b->font && a->fontSize == b->fontSize &&
+         a->encrypted == b->encrypted &&
+         a->subsetCodepoints == b->subsetCodepoints &&
+         a->numSubsetCodepoints == b->numSubsetCodepoints &&
+         a->generateVDMX == b->generateVDMX &&
+         a->stripHinting == b->stripHinting;
+}
+
+/* Leaves the font in u, which was decoded with a context, to the context. */
+void _wff_keep(struct _wff_Unpacked *u, const struct _wff_Source *source)
+{
+  u->ctx->kept = true;
+  u->ctx->keptSource = *source;
+  u->ctx->keptWarning = u->warning;
+}
+
+/* Takes back the font ctx kept, if it was decoded from source. */
+bool _wff_takeKept(struct EOTContext *ctx, const struct _wff_Source *source,
+                   struct _wff_Unpacked *u)
+{
+  if (!ctx || !ctx->kept || !_wff_sameSource(&ctx->keptSource, source)) {
+    return false;
+  }
+  *u = (struct _wff_Unpacked){.ctx = ctx,
+                              .alloc = ctx->alloc,
+                              .ctr = ctx->ctf.ctr,
+                              .warning = ctx->keptWarning};
+  ctx->kept = false;
+  return true;
+}
+
+/* Undoes the XOR encryption and MTX compression. Afterwards either u->ctr
+ * holds the font, or it is NULL and u->data is the TTF as-is. MTX data is
+ * decrypted by the decoder as it goes, so only plain TTFs are ever copied. */
+enum EOTError _wff_unpack(const uint8_t *font, unsigned fontSize,
+                          bool compressed, bool encrypted,
+                          const struct EOTConversionOptions *opts,
+                          struct EOTContext *ctx, struct _wff_Unpacked *u)
 {
   enum EOTError result;
-  uint8_t *buf = (uint8_t *)malloc(fontSize);
-  for (unsigned i = 0; i < fontSize; ++i) {
-    if (encrypted) {
-      buf[i] = font[i] ^ ENCRYPTION_KEY;
+  const struct EOTAllocator *alloc =
+      ctx ? ctx->alloc : (opts ? opts->allocator : NULL);
+  *u = (struct _wff_Unpacked){.ctx = ctx,
+                              .alloc = alloc,
+                              .data = font,
+                              .dataSize = fontSize,
+                              .warning = EOT_SUCCESS};
+  if (ctx && ctx->kept) {
+    ctx->kept = false;
+    clearContainer(ctx->ctf.ctr);
+  }
+  if (encrypted && !compressed) {
+    if (ctx) {
+      result = _wff_reserveOut(ctx, fontSize);
+      if (result != EOT_SUCCESS) {
+        return result;
+      }
+      xorBuffer(ctx->out, font, fontSize, ENCRYPTION_KEY);
+      u->data = ctx->out;
     } else {
-      buf[i] = font[i];
+      u->buf = (uint8_t *)eotMalloc(alloc, fontSize);
+      if (!u->buf) {
+        return EOT_CANT_ALLOCATE_MEMORY;
+      }
+      xorBuffer(u->buf, font, fontSize, ENCRYPTION_KEY);
+      u->data = u->buf;
     }
   }
-  uint8_t *ctfs[3] = {NULL, NULL, NULL};
-  struct SFNTContainer *ctr = NULL;
   if (compressed) {
 #ifndef DONT_UNCOMPRESS
     unsigned sizes[3];
-    struct Stream sBuf = constructStream(buf, fontSize);
-    result = unpackMtx(&sBuf, fontSize, ctfs, sizes);
+    /* blocks 2 and 3 only hold glyph instructions */
+    unsigned numBlocks = (opts && opts->stripHinting) ? 1 : 3;
+    /* only ever read from */
+    struct Stream sBuf = constructStream((uint8_t *)u->data, fontSize);
+    result = unpackMtx(&sBuf, fontSize, numBlocks,
+                       encrypted ? ENCRYPTION_KEY : 0, alloc,
+                       ctx ? &ctx->mtx : NULL, u->ctfs, sizes);
     if (result != EOT_SUCCESS) {
-      goto CLEANUP;
+      return result;
     }
     struct Stream streams[3];
-    for (unsigned i = 0; i < 3; ++i) {
-      streams[i] = constructStream(ctfs[i], sizes[i]);
+    struct Stream *streamPtrs[3] = {NULL, NULL, NULL};
+    for (unsigned i = 0; i < numBlocks; ++i) {
+      streams[i] = constructStream(u->ctfs[i], sizes[i]);
+      streamPtrs[i] = &streams[i];
+    }
+    result = parseCTF(streamPtrs, opts, ctx ? &ctx->ctf : NULL, &u->ctr);
+    if (result >= EOT_WARN) {
+      u->warning = result;
+    } else if (result != EOT_SUCCESS) {
+      return result;
+    }
+#endif
+  }
+  return EOT_SUCCESS;
+}
+
+void decryptFontInPlace(uint8_t *font, unsigned fontSize)
+{
+  xorBuffer(font, font, fontSize, ENCRYPTION_KEY);
+}
+
+enum EOTError writeFontBuffer(const uint8_t *font, unsigned fontSize,
+                              bool compressed, bool encrypted,
+                              const struct EOTConversionOptions *opts,
+                              struct EOTContext *ctx, uint8_t **finalOutBuffer,
+                              unsigned *finalFontSize)
+{
+  struct _wff_Unpacked u;
+  enum EOTError result =
+      _wff_unpack(font, fontSize, compressed, encrypted, opts, ctx, &u);
+  if (result != EOT_SUCCESS) {
+    goto CLEANUP;
+  }
+  if (ctx) {
+    /* the result is lent by the context */
+    if (u.ctr) {
+      result = dumpContainerInto(u.ctr, &ctx->out, &ctx->outSize,
+                                 finalFontSize);
+    } else if (u.data != ctx->out) {
+      result = _wff_reserveOut(ctx, u.dataSize);
+      if (result == EOT_SUCCESS) {
+        memcpy(ctx->out, u.data, u.dataSize);
+      }
+      *finalFontSize = u.dataSize;
+    } else {
+      *finalFontSize = u.dataSize;
     }
-    struct Stream *streamPtrs[3] = {streams, streams + 1,
-                                    streams + 2}; /* ugh */
-    result = parseCTF(streamPtrs, &ctr);
     if (result != EOT_SUCCESS) {
       goto CLEANUP;
     }
-    result = dumpContainer(ctr, finalOutBuffer, finalFontSize);
+    *finalOutBuffer = ctx->out;
+  } else if (u.ctr) {
+    result = dumpContainer(u.ctr, finalOutBuffer, finalFontSize);
     if (result != EOT_SUCCESS) {
       goto CLEANUP;
     }
-#else
-    *finalOutBuffer = buf;
-    *finalFontSize = fontSize;
-#endif
+  } else if (u.buf) {
+    *finalOutBuffer = u.buf;
+    *finalFontSize = u.dataSize;
+    u.buf = NULL;
   } else {
-    *finalOutBuffer = buf;
-    *finalFontSize = fontSize;
+    /* the caller owns the result, so the font can't be handed back as-is */
+    *finalOutBuffer =
+        (uint8_t *)eotMalloc(u.alloc, u.dataSize ? u.dataSize : 1);
+    if (!*finalOutBuffer) {
+      result = EOT_CANT_ALLOCATE_MEMORY;
+      goto CLEANUP;
+    }
+    memcpy(*finalOutBuffer, u.data, u.dataSize);
+    *finalFontSize = u.dataSize;
   }
-  result = EOT_SUCCESS;
+  result = u.warning;
 CLEANUP:
-  if (*finalOutBuffer != buf) {
-    free(buf);
+  _wff_free(&u);
+  return result;
+}
+
+enum EOTError measureFont(const uint8_t *font, unsigned fontSize,
+                          bool compressed, bool encrypted,
+                          const struct EOTConversionOptions *opts,
+                          struct EOTContext *ctx, unsigned *finalFontSize)
+{
+  if (!compressed) {
+    *finalFontSize = fontSize;
+    return EOT_SUCCESS;
   }
-  for (unsigned i = 0; i < 3; ++i) {
-    free(ctfs[i]);
+  struct _wff_Source source = _wff_source(font, fontSize, encrypted, opts);
+  struct _wff_Unpacked u;
+  enum EOTError result =
+      _wff_takeKept(ctx, &source, &u)
+          ? EOT_SUCCESS
+          : _wff_unpack(font, fontSize, compressed, encrypted, opts, ctx, &u);
+  if (result == EOT_SUCCESS) {
+    *finalFontSize = getContainerSize(u.ctr);
+    result = u.warning;
+    if (ctx) {
+      _wff_keep(&u, &source);
+      return result;
+    }
   }
-  if (ctr) {
-    freeContainer(ctr);
+  _wff_free(&u);
+  return result;
+}
+
+enum EOTError writeFontInto(const uint8_t *font, unsigned fontSize,
+                            bool compressed, bool encrypted,
+                            const struct EOTConversionOptions *opts,
+                            struct EOTContext *ctx, uint8_t *buf,
+                            unsigned bufSize, unsigned *finalFontSize)
+{
+  if (!compressed) {
+    /* straight into buf, with no decrypted copy in between */
+    *finalFontSize = fontSize;
+    if (bufSize < fontSize) {
+      return EOT_BUFFER_TOO_SMALL;
+    }
+    if (encrypted) {
+      xorBuffer(buf, font, fontSize, ENCRYPTION_KEY);
+    } else {
+      memcpy(buf, font, fontSize);
+    }
+    return EOT_SUCCESS;
+  }
+  struct _wff_Source source = _wff_source(font, fontSize, encrypted, opts);
+  struct _wff_Unpacked u;
+  enum EOTError result =
+      _wff_takeKept(ctx, &source, &u)
+          ? EOT_SUCCESS
+          : _wff_unpack(font, fontSize, compressed, encrypted, opts, ctx, &u);
+  if (result == EOT_SUCCESS) {
+    result = dumpContainerToBuffer(u.ctr, buf, bufSize, finalFontSize);
+  }
+  if (result == EOT_BUFFER_TOO_SMALL && ctx) {
+    /* for another try with a bigger buffer */
+    _wff_keep(&u, &source);
+    return result;
+  }
+  if (result == EOT_SUCCESS) {
+    result = u.warning;
   }
+  _wff_free(&u);
   return result;
 }
 
-enum EOTError writeFontFile(const uint8_t *font, unsigned fontSize,
-                            bool compressed, bool encrypted, FILE *outFile)
+enum EOTError writeFontOwned(const uint8_t *font, unsigned fontSize,
+                             bool compressed, bool encrypted,
+                             const struct EOTConversionOptions *opts,
+                             struct EOTContext *ctx, uint8_t **finalOutBuffer,
+                             unsigned *finalFontSize)
 {
-  enum EOTError result;
-  uint8_t *finalBuf = NULL;
-  unsigned finalFontSize;
-  result = writeFontBuffer(font, fontSize, compressed, encrypted, &finalBuf,
-                           &finalFontSize);
+  const struct EOTAllocator *alloc = opts ? opts->allocator : NULL;
+  *finalOutBuffer = NULL;
+  if (!compressed) {
+    /* decrypted or copied straight into the result */
+    uint8_t *out = (uint8_t *)eotMalloc(alloc, fontSize ? fontSize : 1);
+    if (!out) {
+      return EOT_CANT_ALLOCATE_MEMORY;
+    }
+    writeFontInto(font, fontSize, false, encrypted, opts, ctx, out, fontSize,
+                  finalFontSize);
+    *finalOutBuffer = out;
+    return EOT_SUCCESS;
+  }
+  struct _wff_Unpacked u;
+  enum EOTError result =
+      _wff_unpack(font, fontSize, compressed, encrypted, opts, ctx, &u);
+  if (result == EOT_SUCCESS) {
+    unsigned size = getContainerSize(u.ctr);
+    uint8_t *out = (uint8_t *)eotMalloc(alloc, size ? size : 1);
+    if (!out) {
+      result = EOT_CANT_ALLOCATE_MEMORY;
+    } else {
+      result = dumpContainerToBuffer(u.ctr, out, size, finalFontSize);
+      if (result == EOT_SUCCESS) {
+        *finalOutBuffer = out;
+        result = u.warning;
+      } else {
+        eotFree(alloc, out);
+      }
+    }
+  }
+  _wff_free(&u);
+  return result;
+}
+
+enum EOTError _wff_writeFont(const uint8_t *font, unsigned fontSize,
+                             bool compressed, bool encrypted,
+                             const struct EOTConversionOptions *opts,
+                             struct EOTContext *ctx, SFNTWriteFn write,
+                             void *userData)
+{
+  struct _wff_Unpacked u;
+  enum EOTError result =
+      _wff_unpack(font, fontSize, compressed, encrypted, opts, ctx, &u);
   if (result != EOT_SUCCESS) {
     goto CLEANUP;
   }
-  int itemsWritten = fwrite(finalBuf, 1, (long)finalFontSize, outFile);
-  if (itemsWritten == finalFontSize) {
-    result = EOT_SUCCESS;
+  if (u.ctr) {
+    result = dumpContainerToSink(u.ctr, write, userData);
   } else {
-    result = EOT_FWRITE_ERROR;
+    struct SFNTChunk chunk = {u.data, u.dataSize};
+    result = write(userData, &chunk, 1) ? EOT_SUCCESS : EOT_FWRITE_ERROR;
   }
-CLEANUP:
-  if (finalBuf) {
-    free(finalBuf);
+  if (result == EOT_SUCCESS) {
+    result = u.warning;
   }
+CLEANUP:
+  _wff_free(&u);
   return result;
 }
 
+bool _wff_writeFILE(void *userData, const struct SFNTChunk *chunks,
+                    unsigned numChunks)
+{
+  for (unsigned i = 0; i < numChunks; ++i) {
+    if (fwrite(chunks[i].data, 1, chunks[i].size, (FILE *)userData) !=
+        chunks[i].size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#define WFF_IOV_BATCH 64
+bool _wff_writeFd(void *userData, const struct SFNTChunk *chunks,
+                  unsigned numChunks)
+{
+  int fd = *(const int *)userData;
+  struct iovec iov[WFF_IOV_BATCH];
+  unsigned next = 0;
+  unsigned numIov = 0;
+  unsigned first = 0;
+  while (first < numIov || next < numChunks) {
+    /* top the batch up, dropping what has been written already */
+    if (first > 0) {
+      for (unsigned i = first; i < numIov; ++i) {
+        iov[i - first] = iov[i];
+      }
+      numIov -= first;
+      first = 0;
+    }
+    while (numIov < WFF_IOV_BATCH && next < numChunks) {
+      if (chunks[next].size > 0) {
+        iov[numIov].iov_base = (void *)chunks[next].data;
+        iov[numIov].iov_len = chunks[next].size;
+        ++numIov;
+      }
+      ++next;
+    }
+    if (numIov == 0) {
+      break;
+    }
+    ssize_t written = writev(fd, iov, (int)numIov);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    /* skip over what got written, which may end in the middle of a chunk */
+    size_t left = (size_t)written;
+    while (first < numIov && left >= iov[first].iov_len) {
+      left -= iov[first].iov_len;
+      ++first;
+    }
+    if (first < numIov) {
+      iov[first].iov_base = (uint8_t *)iov[first].iov_base + left;
+      iov[first].iov_len -= left;
+    }
+  }
+  return true;
+}
+
+struct _wff_Callback {
+  EOTWriteCallback write;
+  void *userData;
+};
+
+bool _wff_writeCallback(void *userData, const struct SFNTChunk *chunks,
+                        unsigned numChunks)
+{
+  struct _wff_Callback *cb = (struct _wff_Callback *)userData;
+  for (unsigned i = 0; i < numChunks; ++i) {
+    if (chunks[i].size > 0 &&
+        !cb->write(cb->userData, chunks[i].data, chunks[i].size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+enum EOTError writeFontFile(const uint8_t *font, unsigned fontSize,
+                            bool compressed, bool encrypted,
+                            const struct EOTConversionOptions *opts,
+                            struct EOTContext *ctx, FILE *outFile)
+{
+  return _wff_writeFont(font, fontSize, compressed, encrypted, opts, ctx,
+                        _wff_writeFILE, outFile);
+}
+
+enum EOTError writeFontFd(const uint8_t *font, unsigned fontSize,
+                          bool compressed, bool encrypted,
+                          const struct EOTConversionOptions *opts,
+                          struct EOTContext *ctx, int fd)
+{
+  return _wff_writeFont(font, fontSize, compressed, encrypted, opts, ctx,
+                        _wff_writeFd, &fd);
+}
+
+enum EOTError writeFontCallback(const uint8_t *font, unsigned fontSize,
+                                bool compressed, bool encrypted,
+                                const struct EOTConversionOptions *opts,
+                                struct EOTContext *ctx, EOTWriteCallback write,
+                                void *userData)
+{
+  struct _wff_Callback cb = {write, userData};
+  return _wff_writeFont(font, fontSize, compressed, encrypted, opts, ctx,
+                        _wff_writeCallback, &cb);
+}
+
 /* vim:set shiftwidth=2 softtabstop=2 expandtab: */
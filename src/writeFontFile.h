@@ -10,12 +10,73 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+/* The first step of every conversion: fills in the metadata of font, with
+ * opts' allocator if opts is given. If printWarnings, warnings are printed to
+ * stderr and EOT_SUCCESS returned in their place; otherwise they are passed
+ * back, and only a result below EOT_WARN other than EOT_SUCCESS means the
+ * font can't be converted. Defined in libeot.c. */
+enum EOTError fillConversionMetadata(const uint8_t *font, unsigned fontSize,
+                                     const struct EOTConversionOptions *opts,
+                                     bool printWarnings,
+                                     struct EOTMetadata *metadataOut);
+
+/* Undoes the XOR encryption of font data, overwriting it. */
+void decryptFontInPlace(uint8_t *font, unsigned fontSize);
+
+/* ctx may be NULL. If it is not, the conversion works in the context's
+ * buffers, and the result of writeFontBuffer belongs to the context. Like
+ * fillConversionMetadata, these never print warnings: a result >= EOT_WARN
+ * means the font was written, but without a table that could not be
+ * decoded. */
 enum EOTError writeFontBuffer(const uint8_t *font, unsigned fontSize,
                               bool compressed, bool encrypted,
-                              uint8_t **finalOutBuffer,
+                              const struct EOTConversionOptions *opts,
+                              struct EOTContext *ctx, uint8_t **finalOutBuffer,
                               unsigned *finalFontSize);
 
+/* The size of the TTF writeFontBuffer would produce. Only MTX-compressed fonts
+ * are unpacked to find out. With ctx, the decoded font is kept in it for a
+ * writeFontInto of the same font and options that comes next. */
+enum EOTError measureFont(const uint8_t *font, unsigned fontSize,
+                          bool compressed, bool encrypted,
+                          const struct EOTConversionOptions *opts,
+                          struct EOTContext *ctx, unsigned *finalFontSize);
+
+/* Writes the TTF into buf, or returns EOT_BUFFER_TOO_SMALL with the size it
+ * needs in *finalFontSize. With ctx, it writes out the font measureFont or a
+ * writeFontInto that ran out of room kept, if it is the same one, and keeps
+ * the font itself when buf is too small. */
+enum EOTError writeFontInto(const uint8_t *font, unsigned fontSize,
+                            bool compressed, bool encrypted,
+                            const struct EOTConversionOptions *opts,
+                            struct EOTContext *ctx, uint8_t *buf,
+                            unsigned bufSize, unsigned *finalFontSize);
+
+/* Like writeFontBuffer, but the result is allocated from the options'
+ * allocator even when ctx is given, so that it outlives the next conversion
+ * made with ctx. The context then only lends its decoder state. */
+enum EOTError writeFontOwned(const uint8_t *font, unsigned fontSize,
+                             bool compressed, bool encrypted,
+                             const struct EOTConversionOptions *opts,
+                             struct EOTContext *ctx, uint8_t **finalOutBuffer,
+                             unsigned *finalFontSize);
+
 enum EOTError writeFontFile(const uint8_t *font, unsigned fontSize,
-                            bool compressed, bool encrypted, FILE *outFile);
+                            bool compressed, bool encrypted,
+                            const struct EOTConversionOptions *opts,
+                            struct EOTContext *ctx, FILE *outFile);
+
+/* These write the TTF out piece by piece, straight from the table buffers,
+ * instead of assembling it in memory first. */
+enum EOTError writeFontFd(const uint8_t *font, unsigned fontSize,
+                          bool compressed, bool encrypted,
+                          const struct EOTConversionOptions *opts,
+                          struct EOTContext *ctx, int fd);
+
+enum EOTError writeFontCallback(const uint8_t *font, unsigned fontSize,
+                                bool compressed, bool encrypted,
+                                const struct EOTConversionOptions *opts,
+                                struct EOTContext *ctx, EOTWriteCallback write,
+                                void *userData);
 
 #endif /* #define __LIBEOT_WRITE_FONT_FILE_H__ */